@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Throughput benchmark of hex dump formatter
+ *  
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../utils/HexDump.hpp"
+
+using std::cout;
+using std::endl;
+using std::ostream;
+using std::string;
+using std::vector;
+
+/** Formatter which was used before (reference output) **/
+static void referenceDump(ostream &stream, const vector<uint8_t> &data) {
+    char buffer[4];
+    size_t length=data.size();
+    string hex, ascii;
+    for (size_t i=0; i<=length; i++) {
+        if (i<length) {
+            uint8_t b=data[i];
+            sprintf(buffer, "%02x ", b);
+            hex+=buffer;
+            if (i%8==7)
+                hex+=' ';
+            ascii+=((b>=32&&b<127)?(char)b:'.');
+        }
+        if ((i%16==15)||(i==length)) {
+            for (unsigned i=hex.length(); i<50; i++)
+                hex+=' ';
+            stream << hex << ascii << endl;
+            hex=string();
+            ascii=string();
+        }
+    }
+}
+
+static vector<uint8_t> randomPacket(size_t length) {
+    vector<uint8_t> result(length);
+    for (size_t i=0; i<length; i++)
+        result[i]=uint8_t(rand());
+    return result;
+}
+
+/** Check that implementation gives the same text as the reference **/
+static bool verify(HexDumpFunction function) {
+    for (size_t length=1; length<600; length++) {
+        vector<uint8_t> packet=randomPacket(length);
+        std::ostringstream expected;
+        referenceDump(expected, packet);
+        string actual(hexDumpLength(length), '\0');
+        char * end=function(&actual[0], packet.data(), length);
+        if (end!=&actual[0]+actual.length()||actual!=expected.str())
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    size_t total=argc>1?atol(argv[1])<<20:32<<20;
+    size_t packetSize=argc>2?atol(argv[2]):1500;
+    vector<vector<uint8_t>> packets;
+    for (size_t size=0; size<total; size+=packetSize)
+        packets.push_back(randomPacket(packetSize));
+    
+    cout << "implementation   verified      MB/s" << endl;
+    
+    // Old formatter writing to a string stream, as the plugins do
+    auto start=std::chrono::steady_clock::now();
+    for (auto i=packets.begin(); i!=packets.end(); ++i) {
+        std::ostringstream stream;
+        referenceDump(stream, *i);
+    }
+    std::chrono::duration<double> elapsed=std::chrono::steady_clock::now()-start;
+    cout << std::left << std::setw(17) << "sprintf" << std::setw(10) << "-" <<
+        std::right << std::fixed << std::setprecision(1) << std::setw(8) <<
+        total/elapsed.count()/1048576 << endl;
+    
+    static const char * const NAMES[]={"scalar", "ssse3", "avx2"};
+    string text(hexDumpLength(packetSize), '\0');
+    for (auto name : NAMES) {
+        HexDumpFunction function=getHexDumpFunction(name);
+        if (!function) {
+            cout << std::left << std::setw(17) << name << "not supported" << endl;
+            continue;
+        }
+        bool verified=verify(function);
+        start=std::chrono::steady_clock::now();
+        for (unsigned round=0; round<10; round++)
+            for (auto i=packets.begin(); i!=packets.end(); ++i)
+                function(&text[0], i->data(), i->size());
+        elapsed=std::chrono::steady_clock::now()-start;
+        cout << std::left << std::setw(17) << name << std::setw(10) <<
+            (verified?"yes":"NO") << std::right << std::setw(8) <<
+            10*total/elapsed.count()/1048576 << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Throughput benchmark of protocol plugins
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "../core/Sniffer.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+/** Number of allocations made by operator new since start **/
+static unsigned long long allocations=0;
+
+void * operator new(size_t size) {
+    allocations++;
+    void * result=malloc(size?size:1);
+    if (!result)
+        throw std::bad_alloc();
+    return result;
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+// GCC takes the replacements of new and delete for a mismatched pair
+#if __GNUC__>=11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void * pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete[](void * pointer) noexcept {
+    free(pointer);
+}
+
+/** Reader over a memory buffer which exposes data in windows of limited size
+    (like StreamReader exposes chunks as they arrive from network) **/
+class MemoryReader : public Reader {
+public:
+    MemoryReader(const string &data, size_t portion) : data(data),
+        portion(portion), offset(0) {}
+    size_t read(void * buffer, size_t length) {
+        if (head==tail&&!refill())
+            return 0;
+        if (length>size_t(tail-head))
+            length=tail-head;
+        memcpy(buffer, head, length);
+        head+=length;
+        return length;
+    }
+
+private:
+    const string &data;
+    size_t portion;
+    size_t offset;
+
+    bool underflow() {
+        size_t length=std::min(portion, data.size()-offset);
+        head=reinterpret_cast<const uint8_t *>(data.data())+offset;
+        tail=head+length;
+        offset+=length;
+        return length>0;
+    }
+};
+
+/** Data sent in one direction before the other side answers **/
+struct Segment {
+    bool incoming;
+    string data;
+};
+
+/** Traffic given to a plugin **/
+struct Corpus {
+    string name;
+    const char * plugin;
+    vector<Segment> segments;
+    size_t size() const {
+        size_t result=0;
+        for (auto i=segments.begin(); i!=segments.end(); ++i)
+            result+=i->data.size();
+        return result;
+    }
+};
+
+/** Random generator which gives the same corpus on each run **/
+static uint32_t random32() {
+    static uint32_t state=2463534242u;
+    state^=state<<13;
+    state^=state>>17;
+    state^=state<<5;
+    return state;
+}
+
+static string randomBytes(size_t length) {
+    string result(length, '\0');
+    for (size_t i=0; i<length; i++)
+        result[i]=char(random32());
+    return result;
+}
+
+/** Stream of TLS application data records with lengths in [minimum,
+    maximum] **/
+static string generateTLS(size_t total, uint16_t minimum, uint16_t maximum) {
+    string result;
+    while (result.size()<total) {
+        uint16_t length=uint16_t(minimum+random32()%(maximum-minimum+1));
+        result+="\x17\x03\x03";
+        result+=char(length>>8);
+        result+=char(length);
+        result+=randomBytes(length);
+    }
+    return result;
+}
+
+/** Compress data into a gzip member **/
+static string gzip(const string &data) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16+MAX_WBITS,
+            8, Z_DEFAULT_STRATEGY)!=Z_OK)
+        throw "deflateInit2() failed";
+    string result(deflateBound(&stream, data.size()), '\0');
+    stream.next_in=reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in=uInt(data.size());
+    stream.next_out=reinterpret_cast<Bytef *>(&result[0]);
+    stream.avail_out=uInt(result.size());
+    int retval=deflate(&stream, Z_FINISH);
+    result.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (retval!=Z_STREAM_END)
+        throw "deflate() failed";
+    return result;
+}
+
+/** Bubuta frame with the given header and payload **/
+static string bubutaFrame(uint8_t foodgroup, uint8_t type, uint8_t flags,
+        const string &payload) {
+    string result;
+    uint32_t length=htonl(uint32_t(payload.size()+4));
+    result.append(reinterpret_cast<const char *>(&length), 4);
+    result+='\0';                           // checksum
+    result+=char(foodgroup);
+    result+=char(type);
+    result+=char(flags);
+    result+=payload;
+    return result;
+}
+
+/** Stream of Bubuta frames carrying arrays of strings, compressed with gzip
+    or encrypted with a repeating XOR key on request **/
+static string generateBubuta(size_t total, bool compressed, bool encrypted) {
+    string result, key;
+    if (encrypted) {
+        // Frame 0/1 gives the key from its 12th byte on, and is not encrypted
+        key=randomBytes(8);
+        result=bubutaFrame(0, 1, 0, string(11, '\0')+key);
+    }
+    while (result.size()<total) {
+        // Array of strings (the frame is an array without a type byte)
+        string payload("\x00\x04", 2);
+        for (unsigned i=0; i<4; i++) {
+            uint16_t length=uint16_t(random32()%200);
+            payload+='\x01';
+            payload+=char(length>>8);
+            payload+=char(length);
+            for (uint16_t j=0; j<length; j++)
+                payload+=char('a'+random32()%26);
+        }
+        string frame=compressed?bubutaFrame(1, 2, 1, gzip(payload)):
+            bubutaFrame(1, 2, 0, payload);
+        // The key is applied from its start in every frame
+        if (!key.empty())
+            for (size_t i=0; i<frame.size(); i++)
+                frame[i]^=key[i%key.size()];
+        result+=frame;
+    }
+    return result;
+}
+
+/** Client messages of random length, each answered by the server **/
+static vector<Segment> generatePingPong(size_t total) {
+    vector<Segment> result;
+    size_t size=0;
+    for (bool incoming=false; size<total; incoming=!incoming) {
+        Segment segment={incoming, randomBytes(16+random32()%1009)};
+        size+=segment.data.size();
+        result.push_back(segment);
+    }
+    return result;
+}
+
+static void add(vector<Corpus> &corpora, const char * name, const char * plugin,
+        const string &data) {
+    Corpus corpus={name, plugin, vector<Segment>(1, Segment{false, data})};
+    corpora.push_back(corpus);
+}
+
+static vector<Corpus> generate(size_t total) {
+    vector<Corpus> corpora;
+    add(corpora, "tls-small", "tls", generateTLS(total, 16, 256));
+    add(corpora, "tls-medium", "tls", generateTLS(total, 256, 4096));
+    add(corpora, "tls-large", "tls", generateTLS(total, 16384, 16384));
+    add(corpora, "bubuta", "bubuta", generateBubuta(total, false, false));
+    add(corpora, "bubuta-gzip", "bubuta", generateBubuta(total, true, false));
+    add(corpora, "bubuta-xor", "bubuta", generateBubuta(total, false, true));
+    // Without answers, the raw plugin collects the whole stream into a packet
+    add(corpora, "raw-oneway", "raw", randomBytes(total));
+    Corpus pingPong={"raw-pingpong", "raw", generatePingPong(total)};
+    corpora.push_back(pingPong);
+
+    // Plugins without a generator of their own get random data
+    Registry &registry=Registry::instance();
+    for (auto i=registry.begin(); i!=registry.end(); ++i) {
+        bool known=false;
+        for (auto j=corpora.begin(); j!=corpora.end(); ++j)
+            known|=!strcmp(j->plugin, i->name);
+        if (!known)
+            add(corpora, i->name, i->name, randomBytes(total));
+    }
+    return corpora;
+}
+
+/** Measurements of the fastest round **/
+struct Result {
+    size_t messages;
+    double seconds;
+    unsigned long long allocations;
+};
+
+/** Dissect the corpus with a new plugin instance **/
+static Result run(const Plugin &plugin, const Corpus &corpus, size_t portion) {
+    OptionsImpl options;
+    Protocol * protocol=plugin.factory(options);
+    Result result={0, 0, 0};
+    unsigned long long allocated=allocations;
+    auto start=std::chrono::steady_clock::now();
+    for (auto i=corpus.segments.begin(); i!=corpus.segments.end(); ++i) {
+        // End of a segment looks like the direction has gone quiet
+        MemoryReader reader(i->data, portion);
+        try {
+            while (true) {
+                protocol->dump(i->incoming, reader);
+                result.messages++;
+            }
+        }
+        catch (Reader::End) {}
+    }
+    std::chrono::duration<double> elapsed=std::chrono::steady_clock::now()-start;
+    result.allocations=allocations-allocated;
+    result.seconds=elapsed.count();
+    delete protocol;
+    return result;
+}
+
+int main(int argc, char ** argv) {
+    size_t total=argc>1?atol(argv[1])<<20:16<<20;
+    size_t portion=argc>2?atol(argv[2]):4096;
+    unsigned rounds=argc>3?atoi(argv[3]):3;
+    const char * only=argc>4?argv[4]:nullptr;
+    if (total==0||portion==0||rounds==0) {
+        cerr << "Usage: " << argv[0] << " [MEGABYTES [WINDOW [ROUNDS [CORPUS]]]]" << endl;
+        return 2;
+    }
+    Registry &registry=Registry::instance();
+
+    try {
+        vector<Corpus> corpora=generate(total);
+        cout << std::left << std::setw(14) << "corpus" << std::right <<
+            std::setw(12) << "bytes" << std::setw(10) << "messages" <<
+            std::setw(10) << "seconds" << std::setw(10) << "MB/s" <<
+            std::setw(12) << "msg/s" << std::setw(12) << "allocs/msg" << endl;
+        for (auto i=corpora.begin(); i!=corpora.end(); ++i) {
+            if (only&&i->name!=only)
+                continue;
+            const Plugin &plugin=registry[i->plugin];
+
+            // Take the best of several rounds to hide scheduling noise
+            Result best={0, 0, 0};
+            for (unsigned round=0; round<rounds; round++) {
+                Result result=run(plugin, *i, portion);
+                if (round==0||result.seconds<best.seconds)
+                    best=result;
+            }
+
+            size_t size=i->size();
+            cout << std::left << std::setw(14) << i->name << std::right <<
+                std::setw(12) << size << std::setw(10) << best.messages <<
+                std::setw(10) << std::fixed << std::setprecision(3) << best.seconds <<
+                std::setw(10) << std::setprecision(1) << size/best.seconds/1048576 <<
+                std::setw(12) << std::setprecision(0) << best.messages/best.seconds <<
+                std::setw(12) << std::setprecision(1) <<
+                (best.messages?double(best.allocations)/best.messages:0.0) << endl;
+        }
+    }
+    catch (const Registry::PluginNotFoundException &e) {
+        cerr << argv[0] << ": plugin «" << e.getName() << "» is not registered" << endl;
+        return 1;
+    }
+    catch (const char * e) {
+        cerr << argv[0] << ": " << e << endl;
+        return 1;
+    }
+    return 0;
+}
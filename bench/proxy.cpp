@@ -0,0 +1,550 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Loopback throughput and latency benchmark of the forwarding path
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "../core/Sniffer.hpp"
+#include "../utils/Histogram.hpp"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+typedef std::chrono::steady_clock Clock;
+
+/** Command line settings **/
+struct Settings {
+    Settings() : connections(16), size(1024), duration(3), sniffer("./sniffer"),
+        output("bench/proxy.json"), port(19000) {}
+    /** Number of concurrent client connections **/
+    unsigned connections;
+    /** Size of one message in bytes **/
+    size_t size;
+    /** Duration of one run in seconds **/
+    double duration;
+    /** Protocol plugins, sniffer modes and traffic patterns to run **/
+    vector<string> plugins, modes, patterns;
+    /** Path of the sniffer binary **/
+    string sniffer;
+    /** File receiving results as JSON **/
+    string output;
+    /** First local port used by the benchmark **/
+    uint16_t port;
+};
+
+/** Measurements of one run **/
+struct Result {
+    string plugin, mode, pattern;
+    /** Bytes forwarded in both directions **/
+    uint64_t bytes;
+    /** Completed request/response exchanges (ping-pong only) **/
+    uint64_t requests;
+    double seconds;
+    /** Round trip percentiles in microseconds (ping-pong only) **/
+    double p50, p99, p999;
+    /** User and system time of the sniffer process (negative if none) **/
+    double cpu;
+};
+
+/** Split comma separated list **/
+static vector<string> split(const char * list) {
+    vector<string> result;
+    std::istringstream stream(list);
+    string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            result.push_back(item);
+    return result;
+}
+
+/** Connect to 127.0.0.1 at port, returns -1 on failure **/
+static int connectTo(uint16_t port) {
+    int fd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd<0)
+        Error::raise("creating socket");
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family=AF_INET;
+    address.sin_port=htons(port);
+    address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address))<0) {
+        close(fd);
+        return -1;
+    }
+    int one=1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/** Write the whole buffer **/
+static void writeFully(int fd, const void * buffer, size_t length) {
+    const uint8_t * data=static_cast<const uint8_t *>(buffer);
+    while (length) {
+        ssize_t retval=send(fd, data, length, MSG_NOSIGNAL);
+        if (retval<0&&errno==EINTR)
+            continue;
+        if (retval<=0)
+            Error::raise("writing to proxy");
+        data+=retval;
+        length-=retval;
+    }
+}
+
+/** Read exactly length bytes **/
+static void readExactly(int fd, void * buffer, size_t length) {
+    uint8_t * data=static_cast<uint8_t *>(buffer);
+    while (length) {
+        ssize_t retval=recv(fd, data, length, 0);
+        if (retval<0&&errno==EINTR)
+            continue;
+        if (retval<0)
+            Error::raise("reading from proxy");
+        if (retval==0)
+            throw Reader::End();
+        data+=retval;
+        length-=retval;
+    }
+}
+
+/** Ask SOCKS5 proxy to connect to 127.0.0.1 at port **/
+static void negotiate(int fd, uint16_t port) {
+    const uint8_t greeting[]={5, 1, 0};
+    writeFully(fd, greeting, sizeof(greeting));
+    uint8_t answer[2];
+    readExactly(fd, answer, sizeof(answer));
+    if (answer[0]!=5||answer[1]!=0)
+        throw "SOCKS proxy refused the greeting";
+    uint8_t request[]={5, 1, 0, 1, 127, 0, 0, 1, uint8_t(port>>8), uint8_t(port)};
+    writeFully(fd, request, sizeof(request));
+    uint8_t reply[4];
+    readExactly(fd, reply, sizeof(reply));
+    if (reply[1]!=0)
+        throw "SOCKS proxy could not connect";
+    // Bound address and port
+    uint8_t bound[18];
+    readExactly(fd, bound, (reply[3]==4?16:4)+2);
+}
+
+/******************************************************************************/
+
+/** Echo or sink server at 127.0.0.1, one thread per connection **/
+class Server {
+public:
+    Server(uint16_t port, bool echo) : echo(echo) {
+        listener=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (listener<0)
+            Error::raise("creating socket");
+        int one=1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family=AF_INET;
+        address.sin_port=htons(port);
+        address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        if (bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address))<0||
+                listen(listener, 1024)<0)
+            Error::raise("listening for benchmark clients");
+        thread=std::thread(&Server::threadFunc, this);
+    }
+    ~Server() {
+        // Wakes up accept(), connection threads end with their clients
+        shutdown(listener, SHUT_RDWR);
+        thread.join();
+        close(listener);
+    }
+
+private:
+    int listener;
+    bool echo;
+    std::thread thread;
+
+    void threadFunc() {
+        while (true) {
+            int fd=accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd<0) {
+                if (errno==EINTR||errno==ECONNABORTED)
+                    continue;
+                break;
+            }
+            int one=1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread(&Server::serve, fd, echo).detach();
+        }
+    }
+
+    static void serve(int fd, bool echo) {
+        vector<uint8_t> buffer(1<<16);
+        try {
+            while (true) {
+                ssize_t retval=recv(fd, buffer.data(), buffer.size(), 0);
+                if (retval<0&&errno==EINTR)
+                    continue;
+                if (retval<=0)
+                    break;
+                if (echo)
+                    writeFully(fd, buffer.data(), retval);
+            }
+        }
+        catch (const Error &) {}
+        close(fd);
+    }
+};
+
+/******************************************************************************/
+
+/** Running sniffer process **/
+class SnifferProcess {
+public:
+    SnifferProcess(const Settings &settings, const string &plugin, const string &mode,
+            uint16_t target, uint16_t port) {
+        vector<string> arguments={settings.sniffer, "--protocol="+plugin,
+            "--port="+std::to_string(port), "--output=/dev/null"};
+        if (mode=="socks")
+            arguments.push_back("--socks-server");
+        else
+            arguments.push_back("--tcp-server=127.0.0.1:"+std::to_string(target));
+        vector<char *> argv;
+        for (auto i=arguments.begin(); i!=arguments.end(); ++i)
+            argv.push_back(const_cast<char *>(i->c_str()));
+        argv.push_back(nullptr);
+
+        pid=fork();
+        if (pid<0)
+            Error::raise("starting sniffer");
+        if (pid==0) {
+            // Messages about every connection would cost more than forwarding
+            int null=open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+
+        // Wait until the sniffer listens
+        for (unsigned attempt=0; attempt<500; attempt++) {
+            int fd=connectTo(port);
+            if (fd>=0) {
+                close(fd);
+                return;
+            }
+            if (waitpid(pid, nullptr, WNOHANG)==pid)
+                throw "sniffer has exited, check --sniffer";
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        stop();
+        throw "sniffer does not listen";
+    }
+    ~SnifferProcess() {
+        if (pid>0)
+            stop();
+    }
+    /** Terminate the sniffer, returns CPU time it has used in seconds **/
+    double stop() {
+        kill(pid, SIGTERM);
+        int status;
+        struct rusage usage;
+        // Dissection of the captured backlog is part of the cost, so the
+        // sniffer is given time to finish it
+        for (unsigned attempt=0; wait4(pid, &status, WNOHANG, &usage)==0; attempt++) {
+            if (attempt==3000)
+                kill(pid, SIGKILL);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        pid=-1;
+        return usage.ru_utime.tv_sec+usage.ru_utime.tv_usec/1e6+
+            usage.ru_stime.tv_sec+usage.ru_stime.tv_usec/1e6;
+    }
+
+private:
+    pid_t pid;
+};
+
+/******************************************************************************/
+
+/** Traffic of one client connection **/
+struct Client {
+    Client() : fd(-1), bytes(0), requests(0), failed(false) {}
+    int fd;
+    uint64_t bytes;
+    uint64_t requests;
+    bool failed;
+    /** Round trip times in nanoseconds **/
+    Histogram latency;
+};
+
+/** Send messages and wait for each echo until deadline **/
+static void pingPong(Client &client, size_t size, Clock::time_point deadline) {
+    vector<uint8_t> message(size, 'x'), echo(size);
+    while (Clock::now()<deadline) {
+        Clock::time_point start=Clock::now();
+        writeFully(client.fd, message.data(), size);
+        readExactly(client.fd, echo.data(), size);
+        client.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now()-start).count());
+        client.bytes+=2*size;
+        client.requests++;
+    }
+}
+
+/** Stream messages until deadline, then wait until the sink has all **/
+static void oneWay(Client &client, size_t size, Clock::time_point deadline) {
+    vector<uint8_t> message(size, 'x');
+    while (Clock::now()<deadline) {
+        writeFully(client.fd, message.data(), size);
+        client.bytes+=size;
+    }
+    // The sink closes after end of stream, which arrives after the data
+    shutdown(client.fd, SHUT_WR);
+    uint8_t byte;
+    while (recv(client.fd, &byte, 1, 0)>0);
+}
+
+/** Drive all connections through the proxy at port **/
+static Result run(const Settings &settings, const string &pattern, uint16_t port,
+        uint16_t target, bool socks) {
+    vector<std::unique_ptr<Client>> clients;
+    for (unsigned i=0; i<settings.connections; i++) {
+        std::unique_ptr<Client> client(new Client());
+        client->fd=connectTo(port);
+        if (client->fd<0)
+            Error::raise("connecting to proxy");
+        if (socks)
+            negotiate(client->fd, target);
+        clients.push_back(std::move(client));
+    }
+
+    Clock::time_point start=Clock::now();
+    Clock::time_point deadline=start+std::chrono::microseconds(
+        uint64_t(settings.duration*1e6));
+    vector<std::thread> threads;
+    for (auto i=clients.begin(); i!=clients.end(); ++i) {
+        Client * client=i->get();
+        threads.emplace_back([client, &settings, &pattern, deadline]() {
+            try {
+                if (pattern=="pingpong")
+                    pingPong(*client, settings.size, deadline);
+                else
+                    oneWay(*client, settings.size, deadline);
+            }
+            catch (...) {
+                client->failed=true;
+            }
+        });
+    }
+    for (auto i=threads.begin(); i!=threads.end(); ++i)
+        i->join();
+    std::chrono::duration<double> elapsed=Clock::now()-start;
+
+    Result result;
+    result.pattern=pattern;
+    result.bytes=result.requests=0;
+    result.seconds=elapsed.count();
+    Histogram latency;
+    for (auto i=clients.begin(); i!=clients.end(); ++i) {
+        if ((*i)->failed)
+            throw "a client connection failed";
+        result.bytes+=(*i)->bytes;
+        result.requests+=(*i)->requests;
+        latency.add((*i)->latency);
+        close((*i)->fd);
+    }
+    result.p50=latency.getPercentile(0.5)/1e3;
+    result.p99=latency.getPercentile(0.99)/1e3;
+    result.p999=latency.getPercentile(0.999)/1e3;
+    result.cpu=-1;
+    return result;
+}
+
+/******************************************************************************/
+
+static void writeJSON(const Settings &settings, const vector<Result> &results) {
+    std::ofstream out(settings.output.c_str());
+    if (!out)
+        throw "cannot write --output";
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"connections\": " << settings.connections << ",\n";
+    out << "  \"size\": " << settings.size << ",\n";
+    out << "  \"duration\": " << settings.duration << ",\n";
+    out << "  \"results\": [";
+    for (size_t i=0; i<results.size(); i++) {
+        const Result &r=results[i];
+        double gigabytes=r.bytes/1e9;
+        out << (i?",":"") << "\n    {\"plugin\": \"" << r.plugin << "\", \"mode\": \""
+            << r.mode << "\", \"pattern\": \"" << r.pattern << "\", \"bytes\": "
+            << r.bytes << ", \"seconds\": " << r.seconds << ", \"mb_per_second\": "
+            << r.bytes/r.seconds/1e6 << ", \"requests\": " << r.requests;
+        if (r.requests)
+            out << ", \"p50_us\": " << r.p50 << ", \"p99_us\": " << r.p99
+                << ", \"p999_us\": " << r.p999;
+        if (r.cpu>=0)
+            out << ", \"cpu_seconds\": " << r.cpu << ", \"cpu_seconds_per_gb\": "
+                << (gigabytes>0?r.cpu/gigabytes:0);
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static void printRow(const Result &r) {
+    cout << std::left << std::setw(8) << r.plugin << std::setw(7) << r.mode <<
+        std::setw(10) << r.pattern << std::right << std::fixed <<
+        std::setprecision(1) << std::setw(10) << r.bytes/r.seconds/1e6;
+    if (r.requests)
+        cout << std::setw(10) << r.p50 << std::setw(10) << r.p99 <<
+            std::setw(10) << r.p999;
+    else
+        cout << std::setw(10) << "-" << std::setw(10) << "-" << std::setw(10) << "-";
+    if (r.cpu>=0)
+        cout << std::setw(10) << std::setprecision(2) << r.cpu/(r.bytes/1e9);
+    else
+        cout << std::setw(10) << "-";
+    cout << endl;
+}
+
+static int usage(const char * program) {
+    cout << "Usage: " << program << " [OPTIONS]" << endl;
+    cout << "\t--connections=COUNT      Concurrent client connections (16)" << endl;
+    cout << "\t--duration=SEC           Length of each run (3)" << endl;
+    cout << "\t--modes=LIST             Any of direct,tcp,socks (all)" << endl;
+    cout << "\t--output=FILE            Write results as JSON to FILE (bench/proxy.json)" << endl;
+    cout << "\t--patterns=LIST          Any of pingpong,oneway (all)" << endl;
+    cout << "\t--plugins=LIST           Protocol plugins to run (all)" << endl;
+    cout << "\t--port=PORT              First local port to use (19000)" << endl;
+    cout << "\t--size=BYTES             Message size (1024)" << endl;
+    cout << "\t--sniffer=PATH           Sniffer binary (./sniffer)" << endl;
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    try {
+        signal(SIGPIPE, SIG_IGN);
+        Settings settings;
+        static struct option OPTIONS[]={
+            {   "connections",  required_argument,  0,  'c' },
+            {   "duration",     required_argument,  0,  'd' },
+            {   "help",         no_argument,        0,  'h' },
+            {   "modes",        required_argument,  0,  'm' },
+            {   "output",       required_argument,  0,  'o' },
+            {   "patterns",     required_argument,  0,  't' },
+            {   "plugins",      required_argument,  0,  'P' },
+            {   "port",         required_argument,  0,  'p' },
+            {   "size",         required_argument,  0,  's' },
+            {   "sniffer",      required_argument,  0,  'S' },
+            {   0                                           }
+        };
+        int c;
+        while ((c=getopt_long(argc, argv, "", OPTIONS, 0))!=-1) {
+            if (c=='c')
+                settings.connections=atoi(optarg);
+            else if (c=='d')
+                settings.duration=atof(optarg);
+            else if (c=='h')
+                return usage(argv[0]);
+            else if (c=='m')
+                settings.modes=split(optarg);
+            else if (c=='o')
+                settings.output=optarg;
+            else if (c=='t')
+                settings.patterns=split(optarg);
+            else if (c=='P')
+                settings.plugins=split(optarg);
+            else if (c=='p')
+                settings.port=atoi(optarg);
+            else if (c=='s')
+                settings.size=atol(optarg);
+            else if (c=='S')
+                settings.sniffer=optarg;
+            else
+                return 2;
+        }
+        if (settings.connections==0||settings.size==0||settings.duration<=0||
+                settings.port==0||settings.port>65000)
+            throw "invalid arguments, see --help";
+        if (settings.modes.empty())
+            settings.modes={"direct", "tcp", "socks"};
+        if (settings.patterns.empty())
+            settings.patterns={"pingpong", "oneway"};
+        if (settings.plugins.empty()) {
+            Registry &registry=Registry::instance();
+            for (auto i=registry.begin(); i!=registry.end(); ++i)
+                settings.plugins.push_back(i->name);
+        }
+
+        uint16_t echoPort=settings.port, sinkPort=settings.port+1;
+        Server echo(echoPort, true), sink(sinkPort, false);
+
+        cout << settings.connections << " connections, " << settings.size <<
+            "-byte messages, " << settings.duration << " s per run" << endl;
+        cout << std::left << std::setw(8) << "plugin" << std::setw(7) << "mode" <<
+            std::setw(10) << "pattern" << std::right << std::setw(10) << "MB/s" <<
+            std::setw(10) << "p50 us" << std::setw(10) << "p99 us" <<
+            std::setw(10) << "p99.9 us" << std::setw(10) << "CPU s/GB" << endl;
+
+        vector<Result> results;
+        // Every run listens at a fresh port, so that connections of the
+        // previous one in TIME_WAIT do not prevent binding
+        uint16_t port=settings.port+2;
+        for (auto mode=settings.modes.begin(); mode!=settings.modes.end(); ++mode) {
+            if (*mode!="direct"&&*mode!="tcp"&&*mode!="socks")
+                throw "unknown mode";
+            // Plugins do not matter without the sniffer
+            vector<string> plugins=*mode=="direct"?vector<string>(1, "-"):settings.plugins;
+            for (auto plugin=plugins.begin(); plugin!=plugins.end(); ++plugin)
+                for (auto pattern=settings.patterns.begin(); pattern!=settings.patterns.end(); ++pattern) {
+                    if (*pattern!="pingpong"&&*pattern!="oneway")
+                        throw "unknown pattern";
+                    uint16_t target=*pattern=="pingpong"?echoPort:sinkPort;
+                    Result result;
+                    if (*mode=="direct")
+                        result=run(settings, *pattern, target, target, false);
+                    else {
+                        SnifferProcess sniffer(settings, *plugin, *mode, target, port);
+                        result=run(settings, *pattern, port++, target, *mode=="socks");
+                        result.cpu=sniffer.stop();
+                    }
+                    result.plugin=*plugin;
+                    result.mode=*mode;
+                    printRow(result);
+                    results.push_back(result);
+                }
+        }
+        writeJSON(settings, results);
+        cout << "Results were written to " << settings.output << endl;
+        return 0;
+    }
+    catch (const Error &e) {
+        cerr << argv[0] << ": " << e << endl;
+        return 1;
+    }
+    catch (const char * e) {
+        cerr << argv[0] << ": " << e << endl;
+        return 1;
+    }
+}
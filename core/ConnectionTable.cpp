@@ -0,0 +1,43 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Table of connections with generational handles
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cerrno>
+#include "ConnectionTable.hpp"
+#include "../sniffer.hpp"
+
+ConnectionTable::Handle ConnectionTable::insert(Connection * connection) {
+    uint32_t index;
+    if (freeList!=NONE) {
+        index=freeList;
+        freeList=slots[index].nextFree;
+    }
+    else {
+        if (slots.size()>=CAPACITY)
+            throw Error("adding connection", EMFILE);
+        index=uint32_t(slots.size());
+        slots.push_back(Slot{nullptr, 1, NONE});
+    }
+    Slot &slot=slots[index];
+    slot.connection=connection;
+    count++;
+    return Handle{index, slot.generation};
+}
+
+Connection * ConnectionTable::erase(const Handle &handle) {
+    Connection * connection=find(handle);
+    if (connection) {
+        Slot &slot=slots[handle.slot];
+        slot.connection=nullptr;
+        // Generation zero is reserved for handles which match nothing
+        if (++slot.generation==0)
+            slot.generation=1;
+        slot.nextFree=freeList;
+        freeList=handle.slot;
+        count--;
+    }
+    return connection;
+}
@@ -0,0 +1,73 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Table of connections with generational handles
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_CONNECTIONTABLE_HPP
+#define __CORE_CONNECTIONTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Connection;
+
+/** Slots of connections with a free list. A slot gets a new generation every
+    time it is freed, so a handle of a removed connection never finds the
+    connection which took the slot later. Insertion, removal and lookup are
+    O(1). Not thread-safe. **/
+class ConnectionTable {
+public:
+    /** Reference to connection which can be checked after it is removed **/
+    struct Handle {
+        uint32_t slot;
+        /** Generation of the slot (zero in handles which match nothing) **/
+        uint32_t generation;
+    };
+    /** Largest number of slots **/
+    static const size_t CAPACITY=size_t(1)<<30;
+    
+    ConnectionTable() : freeList(NONE), count(0) {}
+    /** Returns number of connections **/
+    size_t size() const { return count; }
+    /** Put connection to a free slot and return its handle **/
+    Handle insert(Connection * connection);
+    /** Remove connection, returns it or null if the handle is obsolete **/
+    Connection * erase(const Handle &handle);
+    /** Returns connection if it is still in the table **/
+    Connection * find(const Handle &handle) const {
+        if (handle.slot<slots.size()) {
+            const Slot &slot=slots[handle.slot];
+            if (slot.generation==handle.generation)
+                return slot.connection;
+        }
+        return nullptr;
+    }
+    /** Call function for each connection **/
+    template <class F>
+    void forEach(F function) const {
+        for (auto i=slots.begin(); i!=slots.end(); ++i)
+            if (i->connection)
+                function(i->connection);
+    }
+    
+private:
+    /** End of the free list **/
+    static const uint32_t NONE=~uint32_t(0);
+    struct Slot {
+        /** Connection or null if the slot is free **/
+        Connection * connection;
+        /** Generation of the current or the next connection **/
+        uint32_t generation;
+        /** Next free slot (free slots only) **/
+        uint32_t nextFree;
+    };
+    std::vector<Slot> slots;
+    /** Most recently freed slot **/
+    uint32_t freeList;
+    size_t count;
+};
+
+#endif
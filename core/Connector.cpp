@@ -0,0 +1,218 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Non-blocking connection to upstream servers
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include "Connector.hpp"
+#include "Metrics.hpp"
+
+using std::endl;
+
+/** Order addresses for Happy Eyeballs: IPv6 first, then families alternate **/
+static AddressList interleave(const AddressList &addresses) {
+    AddressList families[2], result;
+    for (auto i=addresses.begin(); i!=addresses.end(); ++i)
+        families[i->ss_family==AF_INET].push_back(*i);
+    for (size_t i=0; i<std::max(families[0].size(), families[1].size()); i++)
+        for (unsigned j=0; j<2; j++)
+            if (i<families[j].size())
+                result.push_back(families[j][i]);
+    return result;
+}
+
+std::atomic<unsigned long> Connector::wins[2];
+
+Connector::Connector(Sniffer &sniffer, Connection &connection, unsigned index) :
+        sniffer(sniffer), connection(connection), index(index), port(0),
+        next(0), lastError(EHOSTUNREACH), nextStart(0),
+        timer([this]() { timeout(); }), started(0) {}
+
+Connector::~Connector() {
+    // Closing the descriptors removes them from epoll
+    for (auto i=attempts.begin(); i!=attempts.end(); ++i)
+        close(i->fd);
+}
+
+void Connector::connect(const HostAddress &remote, Callback callback) {
+    this->callback=callback;
+    port=htons(remote.second);
+    started=Latency::now();
+    connection.error() << "connecting to " << remote.first << ':' << remote.second << "…" << endl;
+    
+    // The answer may come on a resolver thread, so it is posted to the
+    // polling thread, where it is dropped if the connection is gone
+    Sniffer &sniffer=this->sniffer;
+    Sniffer::Handle handle=sniffer.getHandle(connection);
+    Connector * self=this;
+    sniffer.getResolver().resolve(remote.first,
+        [&sniffer, handle, self](const AddressList &addresses, int error) {
+            sniffer.post(handle, [self, addresses, error]() {
+                self->resolved(addresses, error);
+            });
+        });
+}
+
+void Connector::resolved(const AddressList &addresses, int error) {
+    if (error) {
+        connection.error() << "resolving host name: " << gai_strerror(error) << endl;
+        finish(-1, EHOSTUNREACH);
+        return;
+    }
+    this->addresses=interleave(addresses);
+    next=0;
+    tryNext();
+}
+
+void Connector::tryNext() {
+    while (next<addresses.size()) {
+        struct sockaddr_storage &address=addresses[next++];
+        socklen_t length;
+        if (address.ss_family==AF_INET) {
+            reinterpret_cast<struct sockaddr_in &>(address).sin_port=port;
+            length=sizeof(struct sockaddr_in);
+        }
+        else {
+            reinterpret_cast<struct sockaddr_in6 &>(address).sin6_port=port;
+            length=sizeof(struct sockaddr_in6);
+        }
+        
+        int s=::socket(address.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (s<0) {
+            lastError=errno;
+            continue;
+        }
+        if (::connect(s, reinterpret_cast<struct sockaddr *>(&address), length)==0) {
+            wins[address.ss_family==AF_INET6]++;
+            finish(s, 0);
+            return;
+        }
+        if (errno==EINPROGRESS) {
+            try {
+                // Descriptors of all attempts share the index, notify()
+                // finds out which of them is ready
+                sniffer.watch(connection, index, s, EPOLLOUT);
+                uint64_t now=sniffer.getTime();
+                attempts.push_back(Attempt{s,
+                    now+sniffer.getConfiguration().connectTimeout,
+                    address.ss_family==AF_INET6});
+                nextStart=now+ATTEMPT_DELAY;
+                rearm();
+                return;
+            }
+            catch (const Error &e) {
+                lastError=e.getErrno();
+            }
+        }
+        else
+            lastError=errno;
+        ::close(s);
+    }
+    if (attempts.empty())
+        finish(-1, lastError);
+    else
+        rearm();
+}
+
+void Connector::notify() {
+    if (attempts.empty())
+        return;
+    std::vector<struct pollfd> ready(attempts.size());
+    for (size_t i=0; i<attempts.size(); i++)
+        ready[i]={attempts[i].fd, POLLOUT, 0};
+    if (poll(ready.data(), ready.size(), 0)<=0)
+        return;
+    
+    bool failed=false;
+    for (size_t i=attempts.size(); i-->0;) {
+        if (!ready[i].revents)
+            continue;
+        int error=0;
+        socklen_t length=sizeof(error);
+        if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length)<0)
+            error=errno;
+        if (error) {
+            abandon(i, error);
+            failed=true;
+        }
+        else {
+            int s=attempts[i].fd;
+            bool ipv6=attempts[i].ipv6;
+            attempts.erase(attempts.begin()+i);
+            sniffer.unwatch(s);
+            wins[ipv6]++;
+            finish(s, 0);
+            return;
+        }
+    }
+    // A failed attempt lets the next address start without waiting
+    if (failed)
+        tryNext();
+}
+
+void Connector::timeout() {
+    uint64_t now=sniffer.getTime();
+    bool expired=false;
+    for (size_t i=attempts.size(); i-->0;)
+        if (now>=attempts[i].deadline) {
+            abandon(i, ETIMEDOUT);
+            expired=true;
+        }
+    if (expired||(next<addresses.size()&&now>=nextStart))
+        tryNext();
+    else
+        rearm();
+}
+
+void Connector::rearm() {
+    uint64_t deadline=TimerWheel::NEVER;
+    for (auto i=attempts.begin(); i!=attempts.end(); ++i)
+        deadline=std::min(deadline, i->deadline);
+    if (next<addresses.size())
+        deadline=std::min(deadline, nextStart);
+    if (deadline==TimerWheel::NEVER)
+        timer.cancel();
+    else {
+        uint64_t now=sniffer.getTime();
+        sniffer.setTimer(timer, unsigned(deadline>now?deadline-now:0));
+    }
+}
+
+void Connector::abort() {
+    timer.cancel();
+    callback=nullptr;
+    finish(-1, ECANCELED);
+}
+
+void Connector::abandon(size_t attempt, int error) {
+    close(attempts[attempt].fd);
+    attempts.erase(attempts.begin()+attempt);
+    lastError=error;
+}
+
+void Connector::finish(int fd, int error) {
+    // Attempts which have lost the race are cancelled
+    for (auto i=attempts.begin(); i!=attempts.end(); ++i)
+        close(i->fd);
+    attempts.clear();
+    next=addresses.size();
+    timer.cancel();
+    
+    Callback callback;
+    callback.swap(this->callback);
+    if (fd>=0&&callback)
+        Latency::record(Latency::CONNECT, started);
+    if (callback)
+        callback(fd, error);
+    else if (fd>=0)
+        close(fd);
+}
@@ -0,0 +1,91 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Non-blocking connection to upstream servers
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_CONNECTOR_HPP
+#define __CORE_CONNECTOR_HPP
+
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "Sniffer.hpp"
+
+/** Resolves host name and connects to its addresses without blocking the
+    polling thread. Addresses of both families are raced as described in
+    RFC 8305 (Happy Eyeballs): IPv6 and IPv4 addresses take turns, and the
+    next attempt starts when the previous one fails or has not finished in
+    ATTEMPT_DELAY. The first connected socket wins, the others are closed.
+    Each attempt is limited by the connect timeout from configuration. The
+    owning connection must pass its events with the given index to notify()
+    and call abort() when it is deactivated. **/
+class Connector {
+public:
+    /** Receives connected socket (in non-blocking mode) or errno value **/
+    typedef std::function<void(int fd, int error)> Callback;
+    /** Delay before starting the next attempt in milliseconds **/
+    static const unsigned ATTEMPT_DELAY=250;
+    
+    /**/
+    Connector(Sniffer &sniffer, Connection &connection, unsigned index);
+    /** Abort connection in progress **/
+    ~Connector();
+    /** Returns number of connections made over IPv6 or IPv4 **/
+    static unsigned long getWins(bool ipv6) { return wins[ipv6]; }
+    /** Start connecting (polling thread only) **/
+    void connect(const HostAddress &remote, Callback callback);
+    /** Socket of the current attempt has events **/
+    void notify();
+    /** Close attempts in progress and stop the timer without calling back
+        (polling thread only) **/
+    void abort();
+    
+private:
+    Connector(const Connector &)=delete;
+    Connector &operator =(const Connector &)=delete;
+    /** Connection attempt in progress **/
+    struct Attempt {
+        int fd;
+        /** When the attempt times out (Sniffer::getTime()) **/
+        uint64_t deadline;
+        bool ipv6;
+    };
+    
+    static std::atomic<unsigned long> wins[2];
+    Sniffer &sniffer;
+    Connection &connection;
+    unsigned index;
+    Callback callback;
+    uint16_t port;
+    /** Resolved addresses in order of attempts and the next one to try **/
+    AddressList addresses;
+    size_t next;
+    /** Attempts in progress **/
+    std::vector<Attempt> attempts;
+    /** Error of the last failed attempt **/
+    int lastError;
+    /** When the next address is tried even if attempts are in progress **/
+    uint64_t nextStart;
+    /** Fires at the nearest deadline of attempts or at nextStart **/
+    Timeout timer;
+    /** When connect() was called (Latency::now()) **/
+    uint64_t started;
+    
+    /** Called when the host name is resolved **/
+    void resolved(const AddressList &addresses, int error);
+    /** Start connecting to the next address, reports failure if all
+        addresses failed **/
+    void tryNext();
+    /** Called by timer **/
+    void timeout();
+    /** Schedule timer for the nearest deadline **/
+    void rearm();
+    /** Drop attempt because of error **/
+    void abandon(size_t attempt, int error);
+    /** Pass the result to callback and close the other attempts **/
+    void finish(int fd, int error);
+};
+
+#endif
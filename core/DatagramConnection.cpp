@@ -1,13 +1,335 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Sniffer for datagram-based connection (SOCK_DGRAM)
+ *  
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <future>
 #include <iostream>
+#include <netinet/in.h>
+#include <unistd.h>
 #include "DatagramConnection.hpp"
+#include "Metrics.hpp"
 
+using std::cerr;
 using std::endl;
-using std::ostream;
-
-DatagramConnection::DatagramConnection(Sniffer &sniffer, ostream &log,
-        uint16_t localPort, HostAddress remote) : Connection(sniffer) {
-    log << "Datagram sniffer log" << endl;
-    log << "Date: <DATE HERE>" << endl;
-    log << "Port: <PORT>" << endl;
-    throw "NOT IMPLEMENTED YET";
+
+socklen_t getAddressLength(const struct sockaddr_storage &address) {
+    return address.ss_family==AF_INET6?sizeof(struct sockaddr_in6):sizeof(struct sockaddr_in);
+}
+
+void sendDatagrams(int fd, struct mmsghdr * messages, size_t count) {
+    for (size_t sent=0; sent<count;) {
+        int retval=sendmmsg(fd, messages+sent, count-sent, MSG_DONTWAIT);
+        if (retval>0)
+            sent+=retval;
+        else if (retval<0&&errno==EINTR)
+            continue;
+        else if (retval<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK)
+            // Only this datagram failed (e.g. a pending ICMP error)
+            sent++;
+        else
+            break;
+    }
+}
+
+/******************************************************************************/
+
+DatagramBatch::DatagramBatch() : data(new uint8_t[SIZE*CAPACITY]) {
+    memset(messages, 0, sizeof(messages));
+    for (unsigned i=0; i<SIZE; i++) {
+        iov[i].iov_base=data.get()+i*CAPACITY;
+        messages[i].msg_hdr.msg_iov=&iov[i];
+        messages[i].msg_hdr.msg_iovlen=1;
+    }
+}
+
+void DatagramBatch::prepare() {
+    for (unsigned i=0; i<SIZE; i++) {
+        iov[i].iov_len=CAPACITY;
+        messages[i].msg_hdr.msg_name=&addresses[i];
+        messages[i].msg_hdr.msg_namelen=sizeof(addresses[i]);
+    }
+}
+
+/******************************************************************************/
+
+DatagramChannel::DatagramChannel(int fd) : fd(fd), record(0), assembled(false),
+        closed(false) {}
+
+DatagramChannel::~DatagramChannel() {
+    close();
+}
+
+void DatagramChannel::push(const uint8_t * data, size_t length) {
+    // A record which fits into a chunk never crosses chunks, so the dissector
+    // gets it in place; larger datagrams continue in the next chunks
+    account(length);
+    uint32_t size=uint32_t(length);
+    // Datagrams cannot be held back, so they are dropped in any case
+    if (!admit(sizeof(size)+size, false))
+        return;
+    uint64_t arrived=Latency::now();
+    size_t available;
+    uint8_t * space=buffer.reserve(available,
+        std::min(sizeof(size)+length, Chunk::CAPACITY));
+    memcpy(space, &size, sizeof(size));
+    size_t copied=std::min(length, available-sizeof(size));
+    memcpy(space+sizeof(size), data, copied);
+    buffer.commit(sizeof(size)+copied, arrived);
+    while (copied<length) {
+        space=buffer.reserve(available);
+        size_t part=std::min(length-copied, available);
+        memcpy(space, data+copied, part);
+        buffer.commit(part, arrived);
+        copied+=part;
+    }
+    wakeDissector();
+}
+
+bool DatagramChannel::next() {
+    if (!assembled)
+        buffer.consume(record);
+    taken(record);
+    record=0;
+    assembled=false;
+    while (true) {
+        const uint8_t * data;
+        size_t length=buffer.peek(data);
+        if (length==0) {
+            if (!closed&&!isTruncated()) {
+                // Give the worker back until the next datagram arrives
+                Coroutine::current()->yield();
+                continue;
+            }
+            length=buffer.peek(data);
+            if (length==0)
+                return false;
+        }
+        uint32_t size;
+        memcpy(&size, data, sizeof(size));
+        record=sizeof(size)+size;
+        if (size<=length-sizeof(size)) {
+            resetWindow(data+sizeof(size), size);
+            setArrival(buffer.getStamp());
+            return true;
+        }
+
+        // The datagram spans chunks, it is copied out as a whole (the rest
+        // is being written by the producer right now)
+        buffer.consume(sizeof(size));
+        large.resize(size);
+        for (size_t copied=0; copied<size;) {
+            size_t part=buffer.read(large.data()+copied, size-copied);
+            if (!part)
+                Coroutine::current()->yield();
+            copied+=part;
+        }
+        assembled=true;
+        resetWindow(large.data(), size);
+        setArrival(buffer.getStamp());
+        return true;
+    }
+}
+
+void DatagramChannel::close() {
+    if (!closed.exchange(true)) {
+        if (fd>=0) {
+            ::close(fd);
+            fd=-1;
+        }
+        wakeDissector();
+    }
+}
+
+/******************************************************************************/
+
+/** Create socket connected to server **/
+static int connectTo(const struct sockaddr_storage &server) {
+    int fd=socket(server.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd<0)
+        Error::raise("creating socket");
+    if (connect(fd, reinterpret_cast<const struct sockaddr *>(&server),
+            getAddressLength(server))<0) {
+        int error=errno;
+        close(fd);
+        throw Error("connecting to server", error);
+    }
+    return fd;
+}
+
+DatagramConnection::DatagramConnection(Sniffer &sniffer, DatagramServer * owner,
+        struct sockaddr_storage client) : Connection(sniffer), owner(*owner),
+        key(client), clientAddress(client), clientLength(getAddressLength(client)),
+        server(connectTo(owner->server)), lastActive(DatagramServer::getTick()) {
+    outgoing.reserve(DatagramBatch::SIZE);
+    Connection::start(sniffer);
+}
+
+DatagramConnection::~DatagramConnection() {}
+
+void DatagramConnection::received(DatagramBatch &batch, unsigned index) {
+    lastActive.store(DatagramServer::getTick(), std::memory_order_relaxed);
+    batch.setLength(index);
+    client.push(reinterpret_cast<uint8_t *>(batch.iov[index].iov_base),
+        batch.iov[index].iov_len);
+    struct mmsghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_hdr.msg_iov=&batch.iov[index];
+    message.msg_hdr.msg_iovlen=1;
+    outgoing.push_back(message);
+}
+
+void DatagramConnection::flush() {
+    // Datagrams which do not fit into the socket buffer are dropped, as
+    // a router would do
+    sendDatagrams(server.getDescriptor(), outgoing.data(), outgoing.size());
+    outgoing.clear();
+}
+
+void DatagramConnection::notify(unsigned index) {
+    if (index!=1)
+        return;
+    
+    // The polling thread reuses one batch for all connections
+    static thread_local DatagramBatch batch;
+    while (server.isAlive()) {
+        batch.prepare();
+        int count=recvmmsg(server.getDescriptor(), batch.messages,
+            DatagramBatch::SIZE, MSG_DONTWAIT, nullptr);
+        if (count<0) {
+            // ICMP errors are reported to the next call, the flow stays
+            if (errno==ECONNREFUSED)
+                continue;
+            if (errno!=EAGAIN&&errno!=EINTR)
+                error() << "receiving from server: " << strerror(errno) << endl;
+            break;
+        }
+        for (int i=0; i<count; i++) {
+            batch.setLength(i);
+            server.push(reinterpret_cast<uint8_t *>(batch.iov[i].iov_base),
+                batch.iov[i].iov_len);
+            batch.messages[i].msg_hdr.msg_name=&clientAddress;
+            batch.messages[i].msg_hdr.msg_namelen=clientLength;
+        }
+        if (count>0) {
+            lastActive.store(DatagramServer::getTick(), std::memory_order_relaxed);
+            sendDatagrams(owner.listener, batch.messages, count);
+        }
+        if (count<int(DatagramBatch::SIZE))
+            break;
+    }
+}
+
+void DatagramConnection::close() {
+    client.close();
+    server.close();
+}
+
+void DatagramConnection::expired() {
+    owner.expired(*this);
+}
+
+void DatagramConnection::threadFunc(bool incoming) {
+    DatagramChannel &channel=incoming?server:client;
+    while (channel.next()) {
+        try {
+            dump(incoming, channel);
+        }
+        catch (Reader::End) {
+            // The plugin wanted more than the datagram contains
+        }
+    }
+}
+
+/******************************************************************************/
+
+DatagramServer::DatagramServer(Sniffer &sniffer, int listener,
+        const struct sockaddr_storage &server) : sniffer(sniffer),
+        listener(listener), server(server),
+        timeout(std::max(1u, sniffer.getConfiguration().datagramTimeout*1000/TICK)),
+        timers(getTick()) {
+    // Wake up every tick even if no datagrams arrive
+    struct timeval interval={0, TICK*1000};
+    if (setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &interval, sizeof(interval))<0)
+        Error::raise("setting receive timeout");
+}
+
+DatagramServer::~DatagramServer() {
+    // Flows send replies through the listener from the polling thread, so
+    // they are closed there and the listener is left only after that
+    std::vector<DatagramConnection *> remaining;
+    flows.forEach([&remaining](DatagramConnection * flow) { remaining.push_back(flow); });
+    std::promise<void> closed;
+    if (sniffer.post([&remaining, &closed]() {
+            for (auto i=remaining.begin(); i!=remaining.end(); ++i)
+                (*i)->close();
+            closed.set_value();
+        })) {
+        closed.get_future().wait();
+        return;
+    }
+    // The polling thread is gone, nothing else uses the listener
+    for (auto i=remaining.begin(); i!=remaining.end(); ++i)
+        (*i)->close();
+}
+
+uint64_t DatagramServer::getTick() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count()/TICK;
+}
+
+void DatagramServer::receive() {
+    batch.prepare();
+    int count=recvmmsg(listener, batch.messages, DatagramBatch::SIZE,
+        MSG_WAITFORONE, nullptr);
+    if (count<0&&errno!=EAGAIN)
+        Error::raise("receiving datagrams");
+    
+    // Datagrams of one client are sent to the server with one call
+    for (int i=0; i<count; i++) {
+        FlowKey key(batch.addresses[i]);
+        DatagramConnection * flow=flows.find(key);
+        if (!flow) {
+            try {
+                flow=sniffer.add<DatagramConnection>(this, batch.addresses[i]);
+            }
+            catch (const Error &e) {
+                cerr << "creating flow: " << e << endl;
+                continue;
+            }
+            flows.insert(key, flow);
+            timers.schedule(*flow, timers.getTime()+timeout);
+            Metrics::add(Metrics::ACCEPTS);
+        }
+        if (!flow->isQueued())
+            touched.push_back(flow);
+        flow->received(batch, i);
+    }
+    for (auto i=touched.begin(); i!=touched.end(); ++i)
+        (*i)->flush();
+    touched.clear();
+    
+    timers.advance(getTick());
+}
+
+void DatagramServer::expired(DatagramConnection &flow) {
+    // Activity only moves the deadline, the timer is not touched per datagram
+    uint64_t deadline=flow.lastActive.load(std::memory_order_relaxed)+timeout;
+    if (deadline>timers.getTime()) {
+        timers.schedule(flow, deadline);
+        return;
+    }
+    
+    // The polling thread owns the server socket, so it closes the flow. The
+    // connection is deleted only after its channels are closed, so the
+    // pointer stays valid until then.
+    flows.erase(flow.getKey());
+    DatagramConnection * closed=&flow;
+    sniffer.post([closed]() { closed->close(); });
 }
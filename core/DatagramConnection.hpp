@@ -1,20 +1,161 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Sniffer for datagram-based connection (SOCK_DGRAM)
+ *  
+ *  © 2021, Sauron
+ ******************************************************************************/
+
 #ifndef __CORE_DATAGRAMCONNECTION_HPP
 #define __CORE_DATAGRAMCONNECTION_HPP
 
+#include <memory>
+#include <sys/socket.h>
+#include <vector>
+#include "FlowTable.hpp"
 #include "Sniffer.hpp"
+#include "../utils/ChunkQueue.hpp"
+#include "../utils/TimerWheel.hpp"
+
+/** Buffers for receiving and sending datagrams with recvmmsg()/sendmmsg() **/
+struct DatagramBatch {
+    /** Number of datagrams in a batch **/
+    static const unsigned SIZE=32;
+    /** Largest datagram **/
+    static const size_t CAPACITY=65536;
+    
+    DatagramBatch();
+    /** Make all slots ready to receive **/
+    void prepare();
+    /** Set length of received datagram for sending it on **/
+    void setLength(unsigned index) { iov[index].iov_len=messages[index].msg_len; }
+    
+    struct mmsghdr messages[SIZE];
+    struct iovec iov[SIZE];
+    struct sockaddr_storage addresses[SIZE];
+    std::unique_ptr<uint8_t[]> data;
+};
 
-/** Datagram-based protocol (UDP, UDPLITE, DCCP) sniffer **/
-class DatagramConnection : public Connection {
+/** Datagrams of one direction passed to the dissector. Each datagram is
+    exposed as a separate window, so that the plugin sees the end of stream
+    at its boundary. **/
+class DatagramChannel : public Reader, public Channel {
 public:
-    /** Initialize UDP sniffer **/
-    DatagramConnection(Sniffer &sniffer, std::ostream &log,
-        uint16_t localPort, HostAddress remote);
+    /** Create channel which receives from socket (or is fed by push()) **/
+    explicit DatagramChannel(int fd=-1);
+    ~DatagramChannel();
+    bool isAlive() const { return !closed; }
+    int getDescriptor() const { return fd; }
+    /** Events are handled by the connection **/
+    void notify() {}
+    /** Pass datagram to the dissector (producer thread only) **/
+    void push(const uint8_t * data, size_t length);
+    /** Move to the next datagram, returns false after the channel was
+        closed and all datagrams were taken (dissector only) **/
+    bool next();
+    void close();
     
 private:
-    /** Client socket **/
+    DatagramChannel(const DatagramChannel &)=delete;
+    DatagramChannel &operator =(const DatagramChannel &)=delete;
+    size_t read(void * buffer, size_t length) { return 0; }
     
-    /****/
+    int fd;
+    /** Datagrams prefixed with 32-bit length **/
+    ChunkQueue buffer;
+    /** Length of the record of the current datagram **/
+    size_t record;
+    /** Copy of the current datagram if it spans chunks **/
+    std::vector<uint8_t> large;
+    /** The current record was consumed while copying it to large **/
+    bool assembled;
+    std::atomic<bool> closed;
+};
+
+/** Datagram-based protocol (UDP, UDPLITE, DCCP) sniffer. Each client address
+    gets its own connected socket to the server, so replies are matched to
+    the client without any lookup. **/
+class DatagramConnection : public Connection, private TimerWheel::Timer {
+public:
+    /** Create flow of a client which sent datagrams to the server's listener **/
+    DatagramConnection(Sniffer &sniffer, class DatagramServer * owner,
+        struct sockaddr_storage client);
+    ~DatagramConnection();
+    Channel &getChannel(bool incoming) { return incoming?server:client; }
+    /** Returns client address **/
+    const FlowKey &getKey() const { return key; }
+    /** Queue datagram from the client (receiving thread only) **/
+    void received(DatagramBatch &batch, unsigned index);
+    /** Send datagrams queued by received() to the server **/
+    void flush();
+    /** Returns whether datagrams are queued for the server **/
+    bool isQueued() const { return !outgoing.empty(); }
+    /** Close both channels (polling thread only) **/
+    void close();
+    
+private:
+    DatagramServer &owner;
+    FlowKey key;
+    struct sockaddr_storage clientAddress;
+    socklen_t clientLength;
+    /** Client to server datagrams **/
+    DatagramChannel client;
+    /** Server to client datagrams (owns the connected socket) **/
+    DatagramChannel server;
+    /** Datagrams waiting for flush() **/
+    std::vector<struct mmsghdr> outgoing;
+    /** Tick of the last datagram in either direction **/
+    std::atomic<uint64_t> lastActive;
     
+    /** Forward datagrams from the server to the client **/
+    void notify(unsigned index);
+    void threadFunc(bool incoming);
+    /** Idle timer has fired **/
+    void expired();
+    friend class DatagramServer;
 };
 
+/** Receives datagrams of all clients from one listener and hands them over
+    to flows. Flows which stay idle for the configured time are closed. **/
+class DatagramServer {
+public:
+    /** Length of a timer tick in milliseconds **/
+    static const unsigned TICK=100;
+    
+    /** Forward datagrams from listener to server **/
+    DatagramServer(Sniffer &sniffer, int listener,
+        const struct sockaddr_storage &server);
+    /** Close all flows, so that none uses the listener afterwards **/
+    ~DatagramServer();
+    /** Returns current tick **/
+    static uint64_t getTick();
+    /** Receive and forward one batch of datagrams, expire idle flows (waits
+        at most one tick) **/
+    void receive();
+    
+private:
+    DatagramServer(const DatagramServer &)=delete;
+    DatagramServer &operator =(const DatagramServer &)=delete;
+    
+    Sniffer &sniffer;
+    int listener;
+    struct sockaddr_storage server;
+    /** Idle time after which flows are closed, in ticks **/
+    uint64_t timeout;
+    FlowTable flows;
+    TimerWheel timers;
+    DatagramBatch batch;
+    /** Flows which received datagrams in the current batch **/
+    std::vector<DatagramConnection *> touched;
+    
+    /** Called by flow when its idle timer fires **/
+    void expired(DatagramConnection &flow);
+    friend class DatagramConnection;
+};
+
+/** Returns length of IPv4 or IPv6 address **/
+socklen_t getAddressLength(const struct sockaddr_storage &address);
+/** Send datagrams without blocking. A datagram which fails is skipped, the
+    rest are dropped when the socket buffer is full. **/
+void sendDatagrams(int fd, struct mmsghdr * messages, size_t count);
+
 #endif
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Hash table of datagram flows keyed by client address
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstring>
+#include <netinet/in.h>
+#include <random>
+#include "FlowTable.hpp"
+
+FlowKey::FlowKey(const struct sockaddr_storage &address) {
+    uint8_t bytes[24];
+    memset(bytes, 0, sizeof(bytes));
+    if (address.ss_family==AF_INET6) {
+        const struct sockaddr_in6 &in6=reinterpret_cast<const struct sockaddr_in6 &>(address);
+        memcpy(bytes, &in6.sin6_addr, 16);
+        memcpy(bytes+16, &in6.sin6_port, 2);
+    }
+    else {
+        const struct sockaddr_in &in=reinterpret_cast<const struct sockaddr_in &>(address);
+        memcpy(bytes, &in.sin_addr, 4);
+        memcpy(bytes+16, &in.sin_port, 2);
+    }
+    uint16_t family=address.ss_family;
+    memcpy(bytes+18, &family, 2);
+    memcpy(words, bytes, sizeof(words));
+}
+
+/******************************************************************************/
+
+/** Mix bits of 64-bit value (finalizer of MurmurHash3) **/
+static inline uint64_t mix(uint64_t value) {
+    value^=value>>33;
+    value*=0xff51afd7ed558ccdULL;
+    value^=value>>33;
+    value*=0xc4ceb9fe1a85ec53ULL;
+    value^=value>>33;
+    return value;
+}
+
+FlowTable::FlowTable(size_t capacity) : count(0) {
+    size_t size=16;
+    while (size<capacity*2)
+        size<<=1;
+    slots.assign(size, Slot());
+    for (auto i=slots.begin(); i!=slots.end(); ++i)
+        i->hash=0;
+    mask=size-1;
+    std::random_device random;
+    seed=(uint64_t(random())<<32)|random();
+}
+
+uint64_t FlowTable::hash(const FlowKey &key) const {
+    uint64_t result=mix(key.words[0]^seed);
+    result=mix(result^key.words[1]);
+    result=mix(result^key.words[2]);
+    return result|1;
+}
+
+DatagramConnection * FlowTable::find(const FlowKey &key) const {
+    uint64_t h=hash(key);
+    for (size_t i=h&mask; slots[i].hash; i=(i+1)&mask)
+        if (slots[i].hash==h&&slots[i].key==key)
+            return slots[i].flow;
+    return nullptr;
+}
+
+void FlowTable::insert(const FlowKey &key, DatagramConnection * flow) {
+    // Keep the load factor at most 1/2, so that probe sequences stay short
+    if ((count+1)*2>slots.size())
+        grow();
+    uint64_t h=hash(key);
+    size_t i=h&mask;
+    while (slots[i].hash)
+        i=(i+1)&mask;
+    slots[i].key=key;
+    slots[i].hash=h;
+    slots[i].flow=flow;
+    count++;
+}
+
+bool FlowTable::erase(const FlowKey &key) {
+    uint64_t h=hash(key);
+    size_t i=h&mask;
+    while (slots[i].hash&&!(slots[i].hash==h&&slots[i].key==key))
+        i=(i+1)&mask;
+    if (!slots[i].hash)
+        return false;
+    
+    // Move back entries whose probe sequence passes through the hole
+    for (size_t j=(i+1)&mask; slots[j].hash; j=(j+1)&mask) {
+        size_t home=slots[j].hash&mask;
+        if (((j-home)&mask)>=((j-i)&mask)) {
+            slots[i]=slots[j];
+            i=j;
+        }
+    }
+    slots[i].hash=0;
+    count--;
+    return true;
+}
+
+void FlowTable::grow() {
+    std::vector<Slot> old(slots.size()*2, Slot());
+    old.swap(slots);
+    for (auto i=slots.begin(); i!=slots.end(); ++i)
+        i->hash=0;
+    mask=slots.size()-1;
+    for (auto i=old.begin(); i!=old.end(); ++i)
+        if (i->hash) {
+            size_t j=i->hash&mask;
+            while (slots[j].hash)
+                j=(j+1)&mask;
+            slots[j]=*i;
+        }
+}
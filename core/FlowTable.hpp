@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Hash table of datagram flows keyed by client address
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_FLOWTABLE_HPP
+#define __CORE_FLOWTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+#include <vector>
+
+/** Client address packed for hashing and comparison **/
+struct FlowKey {
+    FlowKey() {}
+    /** Take IPv4 or IPv6 address and port **/
+    explicit FlowKey(const struct sockaddr_storage &address);
+    bool operator ==(const FlowKey &other) const {
+        return words[0]==other.words[0]&&words[1]==other.words[1]&&
+            words[2]==other.words[2];
+    }
+    /** Address (IPv4 in the first 4 bytes), port and family **/
+    uint64_t words[3];
+};
+
+/** Open addressing table with linear probing. Entries are stored inline with
+    their hash, so a lookup usually touches one cache line. Removal shifts
+    the following entries back instead of leaving tombstones. **/
+class FlowTable {
+public:
+    /** Create table for about capacity flows **/
+    explicit FlowTable(size_t capacity=1024);
+    /** Returns number of flows **/
+    size_t size() const { return count; }
+    /** Returns flow of client or null **/
+    class DatagramConnection * find(const FlowKey &key) const;
+    /** Add flow which is not in the table yet **/
+    void insert(const FlowKey &key, class DatagramConnection * flow);
+    /** Remove flow, returns false if it is not in the table **/
+    bool erase(const FlowKey &key);
+    /** Call function for each flow **/
+    template <class F>
+    void forEach(F function) const {
+        for (auto i=slots.begin(); i!=slots.end(); ++i)
+            if (i->hash)
+                function(i->flow);
+    }
+    
+private:
+    struct Slot {
+        FlowKey key;
+        /** Hash of key (zero in empty slots) **/
+        uint64_t hash;
+        class DatagramConnection * flow;
+    };
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t count;
+    /** Random seed, so that clients cannot choose colliding addresses **/
+    uint64_t seed;
+    
+    /** Returns non-zero hash of key **/
+    uint64_t hash(const FlowKey &key) const;
+    /** Double the number of slots **/
+    void grow();
+};
+
+#endif
@@ -0,0 +1,182 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Asynchronous writer of the dump log
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <iostream>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "../sniffer.hpp"
+#include "LogWriter.hpp"
+
+using std::string;
+
+/** Wake the writer up early when so many bytes are pending **/
+static const size_t HIGH_WATER=1<<20;
+
+static std::atomic<uint64_t> maxWriterId(0);
+
+LogWriter::Queue::~Queue() {
+    Record * record=head->next.load();
+    if (head!=&stub)
+        delete head;
+    while (record) {
+        Record * next=record->next.load();
+        delete record;
+        record=next;
+    }
+}
+
+LogWriter::Record * LogWriter::Queue::pop() {
+    Record * next=head->next.load(std::memory_order_acquire);
+    if (!next)
+        return nullptr;
+    if (head!=&stub)
+        delete head;
+    head=next;
+    return next;
+}
+
+LogWriter::LogWriter(int fd, unsigned flushInterval) : fd(fd),
+        file(nullptr), written(0), flushInterval(flushInterval),
+        id(++maxWriterId), alive(true), nextTicket(0), pendingBytes(0),
+        expected(0), thread(&LogWriter::threadFunc, this) {}
+
+LogWriter::LogWriter(RotatingFile &file, unsigned flushInterval) :
+        fd(file.getDescriptor()), file(&file),
+        written(lseek(fd, 0, SEEK_END)), flushInterval(flushInterval),
+        id(++maxWriterId), alive(true), nextTicket(0), pendingBytes(0),
+        expected(0), thread(&LogWriter::threadFunc, this) {
+    if (written<0)
+        written=0;
+}
+
+LogWriter::~LogWriter() {
+    alive=false;
+    event.notify();
+    thread.join();
+    for (auto i=queues.begin(); i!=queues.end(); ++i)
+        delete *i;
+}
+
+void LogWriter::append(string &&text) {
+    Record * record=new Record;
+    size_t length=text.length();
+    record->text=std::move(text);
+    Queue * queue=getQueue();
+
+    // Nothing may block between taking a ticket and publishing the record,
+    // since the writer holds back all records with higher tickets
+    record->ticket=nextTicket.fetch_add(1);
+    queue->push(record);
+
+    size_t pending=pendingBytes.fetch_add(length, std::memory_order_relaxed);
+    if (pending<HIGH_WATER&&pending+length>=HIGH_WATER)
+        event.notify();
+}
+
+LogWriter::Queue * LogWriter::getQueue() {
+    static thread_local uint64_t cachedId=0;
+    static thread_local Queue * cachedQueue=nullptr;
+    if (cachedId!=id) {
+        cachedQueue=new Queue;
+        std::lock_guard<std::mutex> lock(queuesMutex);
+        queues.push_back(cachedQueue);
+        cachedId=id;
+    }
+    return cachedQueue;
+}
+
+void LogWriter::collect(bool final) {
+    size_t bytes=0;
+    {
+        std::lock_guard<std::mutex> lock(queuesMutex);
+        for (auto i=queues.begin(); i!=queues.end(); ++i) {
+            while (Record * record=(*i)->pop()) {
+                bytes+=record->text.length();
+                held.emplace_back(record->ticket, std::move(record->text));
+            }
+        }
+    }
+    pendingBytes.fetch_sub(bytes, std::memory_order_relaxed);
+
+    // Write out the records which have no gaps before them
+    std::sort(held.begin(), held.end(), [](const Entry &a, const Entry &b) {
+        return a.first<b.first;
+    });
+    size_t ready=0;
+    while (ready<held.size()&&(final||held[ready].first==expected))
+        expected=held[ready++].first+1;
+    if (ready>0) {
+        std::vector<Entry> batch(std::make_move_iterator(held.begin()),
+            std::make_move_iterator(held.begin()+ready));
+        held.erase(held.begin(), held.begin()+ready);
+        write(batch);
+    }
+}
+
+void LogWriter::write(std::vector<Entry> &batch) {
+    struct iovec iov[IOV_MAX];
+    size_t next=0;
+    while (next<batch.size()) {
+        size_t count=0;
+        for (; count<IOV_MAX&&next+count<batch.size(); count++) {
+            string &text=batch[next+count].second;
+            iov[count].iov_base=&text[0];
+            iov[count].iov_len=text.length();
+        }
+        next+=count;
+
+        struct iovec * current=iov;
+        while (count>0) {
+            ssize_t nWritten=::writev(fd, current, count);
+            if (nWritten<0) {
+                if (errno==EINTR)
+                    continue;
+                std::cerr << "Log: " << Error("writing log", errno) << std::endl;
+                return;
+            }
+            written+=nWritten;
+            // Skip what was written, including a part of a partial record
+            while (count>0&&size_t(nWritten)>=current->iov_len) {
+                nWritten-=current->iov_len;
+                current++;
+                count--;
+            }
+            if (count>0) {
+                current->iov_base=static_cast<char *>(current->iov_base)+nWritten;
+                current->iov_len-=nWritten;
+            }
+        }
+    }
+}
+
+void LogWriter::rotate() {
+    // Segments are switched between batches, so records are never split
+    if (file&&file->isDue(written)) {
+        try {
+            fd=file->rotate();
+            written=0;
+        }
+        catch (const Error &error) {
+            std::cerr << "Log: " << error << std::endl;
+        }
+    }
+}
+
+void LogWriter::threadFunc() {
+    while (true) {
+        int ticket=event.prepare();
+        if (!alive)
+            break;
+        collect(false);
+        rotate();
+        event.wait(ticket, flushInterval);
+    }
+    collect(true);
+}
@@ -0,0 +1,106 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Asynchronous writer of the dump log
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_LOGWRITER_HPP
+#define __CORE_LOGWRITER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../utils/Event.hpp"
+#include "../utils/RotatingFile.hpp"
+
+/** Collects finished records from any number of threads and writes them to a
+    file descriptor in a background thread. Records are written in the order
+    in which append() was called, so the records of one connection are never
+    reordered. Threads calling append() never block on the file. **/
+class LogWriter {
+public:
+    /** Default time in milliseconds during which records may stay in memory **/
+    static const unsigned FLUSH_INTERVAL=200;
+
+    /** Start writing to descriptor (which is not closed by the writer) **/
+    explicit LogWriter(int fd, unsigned flushInterval=FLUSH_INTERVAL);
+    /** Start writing to file, switching segments between batches **/
+    explicit LogWriter(RotatingFile &file, unsigned flushInterval=FLUSH_INTERVAL);
+    /** Write out everything which was appended and stop the thread **/
+    ~LogWriter();
+    /** Queue a record for writing, may be called from any thread **/
+    void append(std::string &&record);
+    /** Returns number of appended bytes not collected by the writer yet **/
+    size_t getBacklog() const { return pendingBytes.load(std::memory_order_relaxed); }
+
+private:
+    /** Queued record **/
+    struct Record {
+        std::atomic<Record *> next;
+        uint64_t ticket;
+        std::string text;
+    };
+
+    /** Unbounded single producer, single consumer queue of one thread **/
+    class Queue {
+    public:
+        Queue() : head(&stub), tail(&stub) { stub.next=nullptr; }
+        ~Queue();
+        /** Called by the owning thread only **/
+        void push(Record * record) {
+            record->next.store(nullptr, std::memory_order_relaxed);
+            tail->next.store(record, std::memory_order_release);
+            tail=record;
+        }
+        /** Called by the writer thread only. The returned record remains
+            owned by the queue and is valid until the next call. **/
+        Record * pop();
+
+    private:
+        Record stub;
+        Record * head;
+        Record * tail;
+    };
+
+    typedef std::pair<uint64_t, std::string> Entry;
+    int fd;
+    /** Segmented file (may be null) **/
+    RotatingFile * file;
+    /** Size of the current segment (writer only) **/
+    off_t written;
+    unsigned flushInterval;
+    /** Distinguishes writers in per-thread queue cache **/
+    uint64_t id;
+    std::atomic<bool> alive;
+    /** Ticket of the next appended record **/
+    std::atomic<uint64_t> nextTicket;
+    /** Number of bytes appended, but not collected yet **/
+    std::atomic<size_t> pendingBytes;
+    /** Notified at shutdown and when a lot of data is pending **/
+    Event event;
+    /** Protects the list of queues **/
+    std::mutex queuesMutex;
+    std::vector<Queue *> queues;
+    /** Collected records waiting for records with lower tickets (writer only) **/
+    std::vector<Entry> held;
+    /** Ticket of the next record to be written (writer only) **/
+    uint64_t expected;
+    std::thread thread;
+
+    /** Returns queue of the calling thread **/
+    Queue * getQueue();
+    /** Move records from all queues to the file **/
+    void collect(bool final);
+    /** Write a batch of records to the file **/
+    void write(std::vector<Entry> &batch);
+    /** Start a new segment of the file if it is time to **/
+    void rotate();
+    void threadFunc();
+};
+
+#endif
@@ -0,0 +1,362 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Process-wide counters exported in Prometheus text format
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+#include "Connector.hpp"
+#include "Metrics.hpp"
+#include "Sniffer.hpp"
+#include "../utils/ChunkPool.hpp"
+
+using std::endl;
+using std::ostringstream;
+using std::string;
+
+/** Counters of running threads and totals of finished ones **/
+struct CounterBlocks {
+    std::mutex mutex;
+    std::vector<std::atomic<uint64_t> *> blocks;
+    uint64_t finished[Metrics::COUNTERS];
+};
+
+/** Returns the counter blocks (never destroyed, threads may finish after exit) **/
+static CounterBlocks &getBlocks() {
+    static CounterBlocks * blocks=new CounterBlocks();
+    return *blocks;
+}
+
+/** Latency histograms of running threads and totals of finished ones **/
+struct HistogramBlocks {
+    std::mutex mutex;
+    std::vector<Histogram *> blocks;
+    Histogram finished[Latency::KINDS];
+};
+
+/** Returns the histogram blocks (never destroyed, like the counter blocks) **/
+static HistogramBlocks &getHistograms() {
+    static HistogramBlocks * histograms=new HistogramBlocks();
+    return *histograms;
+}
+
+/** Longest request which is read before answering **/
+static const size_t MAX_REQUEST=4096;
+/** Time to wait for the request in milliseconds **/
+static const unsigned REQUEST_TIMEOUT=1000;
+
+/******************************************************************************/
+
+thread_local Metrics::Block Metrics::block;
+
+Metrics::Block::Block() {
+    for (unsigned i=0; i<COUNTERS; i++)
+        values[i]=0;
+    CounterBlocks &all=getBlocks();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.blocks.push_back(values);
+}
+
+Metrics::Block::~Block() {
+    CounterBlocks &all=getBlocks();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    for (unsigned i=0; i<COUNTERS; i++)
+        all.finished[i]+=values[i].load(std::memory_order_relaxed);
+    all.blocks.erase(std::find(all.blocks.begin(), all.blocks.end(), values));
+}
+
+uint64_t Metrics::get(Counter counter) {
+    CounterBlocks &all=getBlocks();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    uint64_t result=all.finished[counter];
+    for (auto i=all.blocks.begin(); i!=all.blocks.end(); ++i)
+        result+=(*i)[counter].load(std::memory_order_relaxed);
+    return result;
+}
+
+/******************************************************************************/
+
+/** Percentiles reported for every histogram **/
+static const double PERCENTILES[]={0.5, 0.9, 0.99, 0.999};
+static const char * const PERCENTILE_NAMES[]={"p50", "p90", "p99", "p99.9"};
+
+thread_local Latency::Holder Latency::holder;
+
+Latency::Holder::~Holder() {
+    if (!block)
+        return;
+    HistogramBlocks &all=getHistograms();
+    {
+        std::lock_guard<std::mutex> lock(all.mutex);
+        for (unsigned i=0; i<KINDS; i++)
+            all.finished[i].add(block->histograms[i]);
+        all.blocks.erase(std::find(all.blocks.begin(), all.blocks.end(),
+            block->histograms));
+    }
+    delete block;
+}
+
+Latency::Block * Latency::Holder::create() {
+    // Threads which never record do not pay for histograms
+    block=new Block();
+    HistogramBlocks &all=getHistograms();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.blocks.push_back(block->histograms);
+    return block;
+}
+
+void Latency::collect(Kind kind, Histogram &result) {
+    HistogramBlocks &all=getHistograms();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    result.add(all.finished[kind]);
+    for (auto i=all.blocks.begin(); i!=all.blocks.end(); ++i)
+        result.add((*i)[kind]);
+}
+
+const char * Latency::getName(Kind kind) {
+    static const char * const NAMES[KINDS]={"forward outgoing",
+        "forward incoming", "dissect outgoing", "dissect incoming", "connect",
+        "handshake"};
+    return NAMES[kind];
+}
+
+string Latency::report() {
+    ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    Histogram histogram;
+    for (unsigned i=0; i<KINDS; i++) {
+        histogram.clear();
+        collect(Kind(i), histogram);
+        out << "latency of " << getName(Kind(i)) << ": " << histogram.getCount() << " samples";
+        if (histogram.getCount()) {
+            for (size_t j=0; j<sizeof(PERCENTILES)/sizeof(*PERCENTILES); j++)
+                out << ", " << PERCENTILE_NAMES[j] << ' '
+                    << histogram.getPercentile(PERCENTILES[j])/1000.0 << " us";
+            out << ", max " << histogram.getMax()/1000.0 << " us";
+        }
+        out << '\n';
+    }
+    return out.str();
+}
+
+/******************************************************************************/
+
+/** Write HELP and TYPE lines of a metric **/
+static void describe(ostringstream &out, const char * name, const char * type,
+        const char * help) {
+    out << "# HELP " << name << ' ' << help << '\n';
+    out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+/** Write one sample of a metric **/
+template <typename T>
+static void sample(ostringstream &out, const char * name, T value,
+        const string &labels=string()) {
+    out << name;
+    if (!labels.empty())
+        out << '{' << labels << '}';
+    out << ' ' << value << '\n';
+}
+
+/** Write a metric which has outgoing and incoming samples **/
+static void directions(ostringstream &out, const char * name, const char * help,
+        Metrics::Counter outgoing, Metrics::Counter incoming) {
+    describe(out, name, "counter", help);
+    sample(out, name, Metrics::get(outgoing), "direction=\"outgoing\"");
+    sample(out, name, Metrics::get(incoming), "direction=\"incoming\"");
+}
+
+/******************************************************************************/
+
+MetricsServer::MetricsServer(const string &address, const char * plugin,
+        LogWriter &log) : listener(-1), plugin(plugin), log(log) {
+    struct sockaddr_storage endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    socklen_t length;
+    char * end;
+    unsigned long port=strtoul(address.c_str(), &end, 10);
+    if (!address.empty()&&!*end) {
+        // Metrics are not exposed beyond the host
+        if (port==0||port>65535)
+            throw "invalid --metrics port";
+        struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(endpoint);
+        in.sin_family=AF_INET;
+        in.sin_port=htons(uint16_t(port));
+        in.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        length=sizeof(in);
+    }
+    else {
+        struct sockaddr_un &un=reinterpret_cast<struct sockaddr_un &>(endpoint);
+        if (address.empty()||address.size()>=sizeof(un.sun_path))
+            throw "invalid --metrics path";
+        un.sun_family=AF_UNIX;
+        memcpy(un.sun_path, address.c_str(), address.size());
+        length=socklen_t(offsetof(struct sockaddr_un, sun_path)+address.size()+1);
+        // Socket left behind by a previous run
+        unlink(address.c_str());
+        path=address;
+    }
+
+    listener=socket(endpoint.ss_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (listener<0)
+        Error::raise("creating metrics socket");
+    int one=1;
+    if (endpoint.ss_family==AF_INET)
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, reinterpret_cast<struct sockaddr *>(&endpoint), length)<0||
+            listen(listener, 8)<0) {
+        int error=errno;
+        close(listener);
+        throw Error("listening for metrics scrapes", error);
+    }
+    thread=std::thread(&MetricsServer::threadFunc, this);
+}
+
+MetricsServer::~MetricsServer() {
+    // Wakes up accept()
+    shutdown(listener, SHUT_RDWR);
+    thread.join();
+    close(listener);
+    if (!path.empty())
+        unlink(path.c_str());
+}
+
+string MetricsServer::format() const {
+    ostringstream out;
+    uint64_t opened=Metrics::get(Metrics::CONNECTIONS_OPENED);
+    uint64_t closed=Metrics::get(Metrics::CONNECTIONS_CLOSED);
+    describe(out, "sniffer_connections_active", "gauge",
+        "Connections which are forwarded or dissected");
+    sample(out, "sniffer_connections_active", opened-closed);
+    describe(out, "sniffer_accepts_total", "counter",
+        "Accepted client connections and new datagram flows");
+    sample(out, "sniffer_accepts_total", Metrics::get(Metrics::ACCEPTS));
+    describe(out, "sniffer_upstream_connects_total", "counter",
+        "Connections to servers by address family of the winning attempt");
+    sample(out, "sniffer_upstream_connects_total", Connector::getWins(false), "family=\"ipv4\"");
+    sample(out, "sniffer_upstream_connects_total", Connector::getWins(true), "family=\"ipv6\"");
+
+    describe(out, "sniffer_socks_unresolved_datagrams_total", "counter",
+        "SOCKS UDP datagrams dropped as their destination name did not resolve");
+    sample(out, "sniffer_socks_unresolved_datagrams_total",
+        Metrics::get(Metrics::UNRESOLVED_DATAGRAMS));
+
+    directions(out, "sniffer_bytes_total", "Bytes received from clients and servers",
+        Metrics::BYTES_OUTGOING, Metrics::BYTES_INCOMING);
+    directions(out, "sniffer_chunks_total", "Reads or datagrams received from clients and servers",
+        Metrics::CHUNKS_OUTGOING, Metrics::CHUNKS_INCOMING);
+
+    describe(out, "sniffer_capture_queued_bytes", "gauge",
+        "Captured bytes waiting for dissectors");
+    sample(out, "sniffer_capture_queued_bytes", Channel::getTotalQueued());
+    describe(out, "sniffer_capture_pool_bytes", "gauge",
+        "Memory taken by the capture chunk pool");
+    sample(out, "sniffer_capture_pool_bytes", ChunkPool::getReservedBytes());
+    describe(out, "sniffer_capture_overflows_total", "counter",
+        "Times a capture memory limit was reached");
+    sample(out, "sniffer_capture_overflows_total", Channel::getOverflows());
+    describe(out, "sniffer_capture_dropped_bytes_total", "counter",
+        "Bytes forwarded but not captured because of memory limits");
+    sample(out, "sniffer_capture_dropped_bytes_total", Channel::getDroppedBytes());
+
+    // Taken before scheduled, so that a task moving between them is not
+    // counted as negative lag
+    uint64_t taken=Metrics::get(Metrics::TASKS_TAKEN);
+    uint64_t scheduled=Metrics::get(Metrics::TASKS_SCHEDULED);
+    describe(out, "sniffer_dissector_queue_tasks", "gauge",
+        "Connections waiting for a worker to run their dissectors");
+    sample(out, "sniffer_dissector_queue_tasks", scheduled>taken?scheduled-taken:0);
+    describe(out, "sniffer_output_backlog_bytes", "gauge",
+        "Dumped bytes not collected by the log writer yet");
+    sample(out, "sniffer_output_backlog_bytes", log.getBacklog());
+
+    string labels=string("plugin=\"")+plugin+'"';
+    describe(out, "sniffer_plugin_messages_total", "counter",
+        "Messages dumped by the protocol plugin");
+    sample(out, "sniffer_plugin_messages_total", Metrics::get(Metrics::MESSAGES), labels);
+    describe(out, "sniffer_plugin_errors_total", "counter",
+        "Exceptions thrown by the protocol plugin");
+    sample(out, "sniffer_plugin_errors_total", Metrics::get(Metrics::PLUGIN_ERRORS), labels);
+
+    describe(out, "sniffer_latency_seconds", "summary",
+        "Forwarding delay, dissector lag, connect and SOCKS handshake time");
+    Histogram histogram;
+    for (unsigned i=0; i<Latency::KINDS; i++) {
+        histogram.clear();
+        Latency::collect(Latency::Kind(i), histogram);
+        string name=Latency::getName(Latency::Kind(i));
+        size_t space=name.find(' ');
+        string kind=string("kind=\"")+name.substr(0, space)+'"';
+        if (space!=string::npos)
+            kind+=string(",direction=\"")+name.substr(space+1)+'"';
+        for (size_t j=0; j<sizeof(PERCENTILES)/sizeof(*PERCENTILES); j++) {
+            ostringstream quantile;
+            quantile << kind << ",quantile=\"" << PERCENTILES[j] << '"';
+            sample(out, "sniffer_latency_seconds",
+                histogram.getPercentile(PERCENTILES[j])/1e9, quantile.str());
+        }
+        sample(out, "sniffer_latency_seconds_sum", histogram.getSum()/1e9, kind);
+        sample(out, "sniffer_latency_seconds_count", histogram.getCount(), kind);
+    }
+    return out.str();
+}
+
+void MetricsServer::serve(int fd) {
+    // Read the request, if any, so that closing does not reset the connection
+    struct timeval timeout={REQUEST_TIMEOUT/1000, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    string request;
+    while (request.size()<MAX_REQUEST&&request.find("\r\n\r\n")==string::npos&&
+            request.find("\n\n")==string::npos) {
+        char buffer[512];
+        ssize_t retval=recv(fd, buffer, sizeof(buffer), 0);
+        if (retval<=0)
+            break;
+        request.append(buffer, retval);
+    }
+
+    string body=format(), response;
+    if (request.compare(0, 4, "GET ")==0) {
+        ostringstream header;
+        header << "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " << body.size() << "\r\n"
+            "Connection: close\r\n\r\n";
+        response=header.str();
+    }
+    response+=body;
+    for (size_t sent=0; sent<response.size();) {
+        ssize_t retval=send(fd, response.data()+sent, response.size()-sent, MSG_NOSIGNAL);
+        if (retval<=0)
+            break;
+        sent+=retval;
+    }
+}
+
+void MetricsServer::threadFunc() {
+    while (true) {
+        int fd=accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd<0) {
+            if (errno==EINTR||errno==ECONNABORTED)
+                continue;
+            // The listener was shut down
+            break;
+        }
+        serve(fd);
+        close(fd);
+    }
+}
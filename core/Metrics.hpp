@@ -0,0 +1,142 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Process-wide counters exported in Prometheus text format
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_METRICS_HPP
+#define __CORE_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <time.h>
+#include "../utils/Histogram.hpp"
+
+/** Counters of all sniffers in the process. Every thread increments its own
+    copy without locked instructions; copies are summed on scrape. **/
+class Metrics {
+public:
+    enum Counter {
+        /** Accepted client connections and new datagram flows **/
+        ACCEPTS,
+        /** Created and deleted connections **/
+        CONNECTIONS_OPENED, CONNECTIONS_CLOSED,
+        /** Bytes received from clients and from servers **/
+        BYTES_OUTGOING, BYTES_INCOMING,
+        /** Reads or datagrams received from clients and from servers **/
+        CHUNKS_OUTGOING, CHUNKS_INCOMING,
+        /** Dissector tasks put to and taken from worker run queues **/
+        TASKS_SCHEDULED, TASKS_TAKEN,
+        /** Messages dumped by the plugin and exceptions it threw **/
+        MESSAGES, PLUGIN_ERRORS,
+        /** SOCKS datagrams dropped as their destination name did not resolve **/
+        UNRESOLVED_DATAGRAMS,
+        COUNTERS
+    };
+
+    /** Add to counter of the calling thread **/
+    static void add(Counter counter, uint64_t value=1) {
+        std::atomic<uint64_t> &slot=block.values[counter];
+        slot.store(slot.load(std::memory_order_relaxed)+value, std::memory_order_relaxed);
+    }
+    /** Returns sum of counter over all threads (including finished ones) **/
+    static uint64_t get(Counter counter);
+
+private:
+    /** Counters of one thread **/
+    struct Block {
+        Block();
+        /** Fold values into the totals of finished threads **/
+        ~Block();
+        std::atomic<uint64_t> values[COUNTERS];
+    };
+    static thread_local Block block;
+};
+
+/** Latency histograms of all sniffers in the process. Like counters, every
+    thread records into its own histograms, which are merged on demand. **/
+class Latency {
+public:
+    enum Kind {
+        /** From receiving data to writing its last byte to the other side **/
+        FORWARD_OUTGOING, FORWARD_INCOMING,
+        /** From receiving data to the end of the dump which took it **/
+        DISSECT_OUTGOING, DISSECT_INCOMING,
+        /** From the start of resolving to a connected upstream socket **/
+        CONNECT,
+        /** From accepting a SOCKS client to the end of negotiation **/
+        HANDSHAKE,
+        KINDS
+    };
+    
+    /** Returns monotonic time in nanoseconds **/
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec)*1000000000+ts.tv_nsec;
+    }
+    /** Count time between start and end (from now()) in histogram of the
+        calling thread **/
+    static void record(Kind kind, uint64_t start, uint64_t end) {
+        Block * block=holder.block?holder.block:holder.create();
+        block->histograms[kind].record(end>start?end-start:0);
+    }
+    /** Count time elapsed since start **/
+    static void record(Kind kind, uint64_t start) { record(kind, start, now()); }
+    /** Add histograms of all threads (including finished ones) to result **/
+    static void collect(Kind kind, Histogram &result);
+    /** Returns name of histogram **/
+    static const char * getName(Kind kind);
+    /** Returns percentiles of all histograms as text lines **/
+    static std::string report();
+    
+private:
+    /** Histograms of one thread **/
+    struct Block {
+        Histogram histograms[KINDS];
+    };
+    /** Allocates the block of a thread when it records first **/
+    struct Holder {
+        Holder() : block(nullptr) {}
+        /** Fold histograms into the totals of finished threads **/
+        ~Holder();
+        Block * create();
+        Block * block;
+    };
+    static thread_local Holder holder;
+};
+
+class LogWriter;
+
+/** Serves metrics to anyone who connects to a local socket. HTTP requests
+    (Prometheus) get an HTTP response, other clients get plain text. **/
+class MetricsServer {
+public:
+    /** Listen at 127.0.0.1:address if it is a port number, otherwise at Unix
+        socket with path address **/
+    MetricsServer(const std::string &address, const char * plugin, LogWriter &log);
+    /** Stop serving (and remove the Unix socket) **/
+    ~MetricsServer();
+    /** Returns current metrics in Prometheus text format **/
+    std::string format() const;
+
+private:
+    int listener;
+    /** Path of the Unix socket (empty for TCP) **/
+    std::string path;
+    /** Name of the protocol plugin **/
+    const char * plugin;
+    LogWriter &log;
+    std::thread thread;
+
+    MetricsServer(const MetricsServer &)=delete;
+    MetricsServer &operator =(const MetricsServer &)=delete;
+    /** Answer one client **/
+    void serve(int fd);
+    void threadFunc();
+};
+
+#endif
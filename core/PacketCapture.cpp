@@ -0,0 +1,288 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Capture of forwarded data to pcapng files
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sys/socket.h>
+#include "../sniffer.hpp"
+#include "PacketCapture.hpp"
+#include "../utils/Utils.hpp"
+
+/** Block types and options of pcapng **/
+enum {
+    SECTION_HEADER_BLOCK=0x0A0D0D0A,
+    INTERFACE_DESCRIPTION_BLOCK=1,
+    ENHANCED_PACKET_BLOCK=6,
+    OPT_ENDOFOPT=0,
+    OPT_COMMENT=1,
+    SHB_USERAPPL=4,
+    IF_NAME=2,
+    IF_TSRESOL=9,
+    EPB_FLAGS=2,
+    EPB_INBOUND=1,
+    EPB_OUTBOUND=2,
+    BYTE_ORDER_MAGIC=0x1A2B3C4D,
+    /** Raw IPv4 or IPv6 packets **/
+    LINKTYPE_RAW=101
+};
+
+/** TCP flags **/
+enum { TCP_FIN=1, TCP_SYN=2, TCP_PSH=8, TCP_ACK=16 };
+
+static size_t pad4(size_t length) {
+    return (length+3)&~size_t(3);
+}
+
+/** Sequential writer of block fields **/
+class BlockBuilder {
+public:
+    explicit BlockBuilder(uint8_t * data) : data(data), position(data) {}
+    /** Put integer in host byte order (as required by pcapng) **/
+    template <typename T>
+    void put(T value) {
+        memcpy(position, &value, sizeof(value));
+        position+=sizeof(value);
+    }
+    /** Put 16-bit integer in network byte order **/
+    void putBE16(uint16_t value) {
+        *position++=value>>8;
+        *position++=value;
+    }
+    /** Put 32-bit integer in network byte order **/
+    void putBE32(uint32_t value) {
+        putBE16(value>>16);
+        putBE16(value);
+    }
+    /** Put bytes, padding them to 4-byte boundary **/
+    void putPadded(const void * bytes, size_t length) {
+        memcpy(position, bytes, length);
+        memset(position+length, 0, pad4(length)-length);
+        position+=pad4(length);
+    }
+    /** Put option with a value **/
+    void putOption(uint16_t code, const void * value, uint16_t length) {
+        put(code);
+        put(length);
+        putPadded(value, length);
+    }
+    uint8_t * getPosition() const { return position; }
+    size_t getLength() const { return position-data; }
+
+private:
+    uint8_t * data;
+    uint8_t * position;
+};
+
+/** Returns the Internet checksum of an IPv4 header **/
+static uint16_t checksum(const uint8_t * header, size_t length) {
+    uint32_t sum=0;
+    for (size_t i=0; i<length; i+=2)
+        sum+=(header[i]<<8)|header[i+1];
+    while (sum>>16)
+        sum=(sum&0xFFFF)+(sum>>16);
+    return ~sum;
+}
+
+/** Returns the current time in nanoseconds **/
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec)*1000000000+ts.tv_nsec;
+}
+
+/** Store the address of a socket peer in flow format **/
+static void getEndpoint(int fd, struct sockaddr_storage &address) {
+    socklen_t length=sizeof(address);
+    if (getpeername(fd, reinterpret_cast<struct sockaddr *>(&address), &length)<0)
+        address.ss_family=AF_UNSPEC;
+    
+    // IPv4 clients of dual-stack listeners have IPv4-mapped addresses
+    unmapAddress(address);
+}
+
+static void setEndpoint(const struct sockaddr_storage &address, bool ipv6,
+        uint8_t * result, uint16_t &port) {
+    memset(result, 0, 16);
+    port=0;
+    if (address.ss_family==AF_INET) {
+        const struct sockaddr_in &in=reinterpret_cast<const struct sockaddr_in &>(address);
+        if (ipv6) {
+            // IPv4-mapped IPv6 address
+            result[10]=result[11]=0xFF;
+            memcpy(result+12, &in.sin_addr, 4);
+        }
+        else
+            memcpy(result, &in.sin_addr, 4);
+        port=in.sin_port;
+    }
+    else if (address.ss_family==AF_INET6) {
+        const struct sockaddr_in6 &in6=reinterpret_cast<const struct sockaddr_in6 &>(address);
+        memcpy(result, &in6.sin6_addr, 16);
+        port=in6.sin6_port;
+    }
+}
+
+void Flow::initialize(unsigned id, int client, int server) {
+    struct sockaddr_storage clientAddress, serverAddress;
+    getEndpoint(client, clientAddress);
+    getEndpoint(server, serverAddress);
+    this->id=id;
+    ipv6=clientAddress.ss_family==AF_INET6||serverAddress.ss_family==AF_INET6;
+    setEndpoint(clientAddress, ipv6, this->clientAddress, clientPort);
+    setEndpoint(serverAddress, ipv6, this->serverAddress, serverPort);
+    sequence[0]=sequence[1]=0;
+}
+
+/******************************************************************************/
+
+PacketCapture::PacketCapture(RotatingFile &output) : output(output),
+        file(new MappedFile(output.getDescriptor())) {
+    writeHeader();
+}
+
+void PacketCapture::writeHeader() {
+    static const char APPLICATION[]="Advanced network sniffer";
+    static const char INTERFACE[]="sniffer";
+    static const uint8_t RESOLUTION=9;
+
+    // Section Header Block
+    uint8_t * block=file->reserve(256);
+    BlockBuilder builder(block);
+    builder.put(uint32_t(SECTION_HEADER_BLOCK));
+    builder.put(uint32_t(0));
+    builder.put(uint32_t(BYTE_ORDER_MAGIC));
+    builder.put(uint16_t(1));
+    builder.put(uint16_t(0));
+    builder.put(int64_t(-1));
+    builder.putOption(SHB_USERAPPL, APPLICATION, sizeof(APPLICATION)-1);
+    builder.put(uint32_t(OPT_ENDOFOPT));
+    uint32_t length=builder.getLength()+4;
+    builder.put(length);
+    memcpy(block+4, &length, 4);
+
+    // Interface Description Block
+    uint8_t * interface=builder.getPosition();
+    builder.put(uint32_t(INTERFACE_DESCRIPTION_BLOCK));
+    builder.put(uint32_t(0));
+    builder.put(uint16_t(LINKTYPE_RAW));
+    builder.put(uint16_t(0));
+    builder.put(uint32_t(0));
+    builder.putOption(IF_NAME, INTERFACE, sizeof(INTERFACE)-1);
+    builder.putOption(IF_TSRESOL, &RESOLUTION, 1);
+    builder.put(uint32_t(OPT_ENDOFOPT));
+    length=builder.getPosition()-interface+4;
+    builder.put(length);
+    memcpy(interface+4, &length, 4);
+
+    file->commit(builder.getLength());
+}
+
+void PacketCapture::open(Flow &flow) {
+    write(flow, false, TCP_SYN, nullptr, 0);
+    write(flow, true, TCP_SYN|TCP_ACK, nullptr, 0);
+    write(flow, false, TCP_ACK, nullptr, 0);
+}
+
+void PacketCapture::record(Flow &flow, bool incoming, const uint8_t * data,
+        size_t length) {
+    write(flow, incoming, TCP_PSH|TCP_ACK, data, length);
+}
+
+void PacketCapture::close(Flow &flow, bool incoming) {
+    write(flow, incoming, TCP_FIN|TCP_ACK, nullptr, 0);
+}
+
+void PacketCapture::write(Flow &flow, bool incoming, uint8_t flags,
+        const uint8_t * data, size_t length) {
+    uint64_t timestamp=now();
+    char comment[32];
+    size_t commentLength=snprintf(comment, sizeof(comment), "connection #%u", flow.id);
+    size_t ipLength=flow.ipv6?40:20;
+    size_t packetLength=ipLength+20+length;
+    size_t blockLength=28+pad4(packetLength)+8+4+pad4(commentLength)+4+4;
+    const uint8_t * source=incoming?flow.serverAddress:flow.clientAddress;
+    const uint8_t * destination=incoming?flow.clientAddress:flow.serverAddress;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (output.isDue(file->getSize())) {
+        // Every segment is a complete file with its own section
+        file.reset();
+        try {
+            file.reset(new MappedFile(output.rotate()));
+        }
+        catch (const Error &error) {
+            std::cerr << "Capture: " << error << std::endl;
+            file.reset(new MappedFile(output.getDescriptor()));
+        }
+        writeHeader();
+    }
+    uint8_t * block=file->reserve(blockLength);
+    BlockBuilder builder(block);
+    builder.put(uint32_t(ENHANCED_PACKET_BLOCK));
+    builder.put(uint32_t(blockLength));
+    builder.put(uint32_t(0));
+    builder.put(uint32_t(timestamp>>32));
+    builder.put(uint32_t(timestamp));
+    builder.put(uint32_t(packetLength));
+    builder.put(uint32_t(packetLength));
+
+    // IP header
+    uint8_t * ip=builder.getPosition();
+    if (flow.ipv6) {
+        builder.putBE32(0x60000000);
+        builder.putBE16(20+length);
+        builder.put(uint8_t(IPPROTO_TCP));
+        builder.put(uint8_t(64));
+        memcpy(builder.getPosition(), source, 16);
+        memcpy(builder.getPosition()+16, destination, 16);
+        builder=BlockBuilder(ip+40);
+    }
+    else {
+        builder.put(uint8_t(0x45));
+        builder.put(uint8_t(0));
+        builder.putBE16(packetLength);
+        builder.putBE32(0x00004000);
+        builder.put(uint8_t(64));
+        builder.put(uint8_t(IPPROTO_TCP));
+        builder.putBE16(0);
+        memcpy(ip+12, source, 4);
+        memcpy(ip+16, destination, 4);
+        uint16_t sum=checksum(ip, 20);
+        ip[10]=sum>>8;
+        ip[11]=sum;
+        builder=BlockBuilder(ip+20);
+    }
+
+    // TCP header (checksum is not calculated)
+    uint32_t &sequence=flow.sequence[incoming], &acknowledged=flow.sequence[!incoming];
+    builder.put(incoming?flow.serverPort:flow.clientPort);
+    builder.put(incoming?flow.clientPort:flow.serverPort);
+    builder.putBE32(sequence);
+    builder.putBE32(flags&TCP_ACK?acknowledged:0);
+    builder.put(uint8_t(5<<4));
+    builder.put(flags);
+    builder.putBE16(65535);
+    builder.putBE32(0);
+
+    // Payload, this is the only copy of the forwarded data
+    if (length)
+        builder.putPadded(data, length);
+
+    // Options
+    builder=BlockBuilder(block+28+pad4(packetLength));
+    builder.put(uint16_t(EPB_FLAGS));
+    builder.put(uint16_t(4));
+    builder.put(uint32_t(incoming?EPB_INBOUND:EPB_OUTBOUND));
+    builder.putOption(OPT_COMMENT, comment, commentLength);
+    builder.put(uint32_t(OPT_ENDOFOPT));
+    builder.put(uint32_t(blockLength));
+    file->commit(blockLength);
+
+    sequence+=length+(flags&(TCP_SYN|TCP_FIN)?1:0);
+}
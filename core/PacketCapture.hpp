@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Capture of forwarded data to pcapng files
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_PACKETCAPTURE_HPP
+#define __CORE_PACKETCAPTURE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include "../utils/MappedFile.hpp"
+#include "../utils/RotatingFile.hpp"
+
+/** Endpoints and TCP state of a captured conversation **/
+struct Flow {
+    Flow() : id(0), ipv6(false) {}
+    /** Take endpoints from connected client and server sockets **/
+    void initialize(unsigned id, int client, int server);
+
+    /** Connection identifier (written to packet comments) **/
+    unsigned id;
+    /** Both endpoints are written as IPv6 addresses **/
+    bool ipv6;
+    /** Addresses in network byte order (IPv4 uses the first 4 bytes) **/
+    uint8_t clientAddress[16], serverAddress[16];
+    /** Ports in network byte order **/
+    uint16_t clientPort, serverPort;
+    /** Next sequence number of client [0] and server [1] **/
+    uint32_t sequence[2];
+};
+
+/** Writes forwarded data as TCP segments in pcapng format. Each segment is
+    stored as an Enhanced Packet Block with synthesized IP and TCP headers,
+    nanosecond timestamp, direction flags and connection id in a comment. **/
+class PacketCapture {
+public:
+    /** Start a new section at the end of file (which must be open for
+        reading and writing) **/
+    explicit PacketCapture(RotatingFile &output);
+    /** Write the three-way handshake of a new flow **/
+    void open(Flow &flow);
+    /** Write a segment with data, may be called from any thread **/
+    void record(Flow &flow, bool incoming, const uint8_t * data, size_t length);
+    /** Write FIN in specified direction **/
+    void close(Flow &flow, bool incoming);
+
+private:
+    std::mutex mutex;
+    RotatingFile &output;
+    std::unique_ptr<MappedFile> file;
+    
+    /** Write Section Header and Interface Description blocks **/
+    void writeHeader();
+    /** Write Enhanced Packet Block with a TCP segment **/
+    void write(Flow &flow, bool incoming, uint8_t flags, const uint8_t * data,
+        size_t length);
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Asynchronous host name resolver with a TTL-respecting cache
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <cstring>
+#include <fstream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <sstream>
+#include <strings.h>
+#include "Resolver.hpp"
+
+using std::string;
+
+/** Parse numeric IPv4 or IPv6 address **/
+static bool parseNumeric(const string &name, struct sockaddr_storage &address) {
+    memset(&address, 0, sizeof(address));
+    struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(address);
+    struct sockaddr_in6 &in6=reinterpret_cast<struct sockaddr_in6 &>(address);
+    if (inet_pton(AF_INET, name.c_str(), &in.sin_addr)==1)
+        in.sin_family=AF_INET;
+    else if (inet_pton(AF_INET6, name.c_str(), &in6.sin6_addr)==1)
+        in6.sin6_family=AF_INET6;
+    else
+        return false;
+    return true;
+}
+
+/** Find name in /etc/hosts, returns true if it is there **/
+static bool lookupHosts(const string &name, AddressList &addresses) {
+    std::ifstream hosts("/etc/hosts");
+    string line;
+    while (std::getline(hosts, line)) {
+        std::istringstream fields(line.substr(0, line.find('#')));
+        string address, alias;
+        struct sockaddr_storage parsed;
+        if (!(fields >> address)||!parseNumeric(address, parsed))
+            continue;
+        while (fields >> alias)
+            if (!strcasecmp(alias.c_str(), name.c_str())) {
+                addresses.push_back(parsed);
+                break;
+            }
+    }
+    return !addresses.empty();
+}
+
+/** Put IPv4 addresses first, keeping the order within each family **/
+static void sortByFamily(AddressList &addresses) {
+    std::stable_sort(addresses.begin(), addresses.end(),
+        [](const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+            return a.ss_family==AF_INET&&b.ss_family!=AF_INET;
+        });
+}
+
+/** Ask DNS for records of specified type, returns the smallest TTL of them
+    and of the CNAME records leading to them (or the largest unsigned number
+    if there are no records) **/
+static unsigned query(struct __res_state &state, const string &name, int type,
+        AddressList &addresses) {
+    uint8_t answer[NS_PACKETSZ*4];
+    int length=res_nsearch(&state, name.c_str(), ns_c_in, type, answer, sizeof(answer));
+    ns_msg message;
+    if (length<0||ns_initparse(answer, std::min(length, int(sizeof(answer))), &message)<0)
+        return ~0u;
+
+    unsigned ttl=~0u;
+    for (int i=0; i<ns_msg_count(message, ns_s_an); i++) {
+        ns_rr record;
+        if (ns_parserr(&message, ns_s_an, i, &record)<0)
+            break;
+        struct sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        if (ns_rr_type(record)==ns_t_a&&ns_rr_rdlen(record)==4) {
+            struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(address);
+            in.sin_family=AF_INET;
+            memcpy(&in.sin_addr, ns_rr_rdata(record), 4);
+        }
+        else if (ns_rr_type(record)==ns_t_aaaa&&ns_rr_rdlen(record)==16) {
+            struct sockaddr_in6 &in6=reinterpret_cast<struct sockaddr_in6 &>(address);
+            in6.sin6_family=AF_INET6;
+            memcpy(&in6.sin6_addr, ns_rr_rdata(record), 16);
+        }
+        else {
+            // CNAME records lead to the addresses, their TTL counts as well
+            if (ns_rr_type(record)==ns_t_cname)
+                ttl=std::min(ttl, unsigned(ns_rr_ttl(record)));
+            continue;
+        }
+        addresses.push_back(address);
+        ttl=std::min(ttl, unsigned(ns_rr_ttl(record)));
+    }
+    return ttl;
+}
+
+/******************************************************************************/
+
+Resolver::Resolver(unsigned threads) : alive(true) {
+    for (unsigned i=0; i<threads; i++)
+        this->threads.emplace_back(&Resolver::threadFunc, this);
+}
+
+Resolver::~Resolver() {
+    alive=false;
+    queued.notify();
+    for (auto i=threads.begin(); i!=threads.end(); ++i)
+        i->join();
+}
+
+void Resolver::resolve(const string &name, Callback callback) {
+    AddressList addresses(1);
+    if (parseNumeric(name, addresses[0])) {
+        callback(addresses, 0);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto cached=cache.find(name);
+        if (cached!=cache.end()) {
+            if (Clock::now()<cached->second.expires) {
+                Entry entry=cached->second;
+                lock.unlock();
+                callback(entry.addresses, entry.error);
+                return;
+            }
+            cache.erase(cached);
+        }
+
+        // Concurrent requests for the same name share one lookup
+        std::vector<Callback> &callbacks=waiting[name];
+        callbacks.push_back(callback);
+        if (callbacks.size()>1)
+            return;
+        queue.push_back(name);
+    }
+    queued.notifyOne();
+}
+
+unsigned Resolver::lookup(const string &name, AddressList &addresses, int &error) {
+    static thread_local struct __res_state state;
+    static thread_local bool initialized=false;
+    if (!initialized) {
+        res_ninit(&state);
+        initialized=true;
+    }
+
+    // Local names are not sent to DNS (the rest of nsswitch.conf is only
+    // consulted when DNS knows nothing, so a name should not be in both)
+    error=0;
+    if (lookupHosts(name, addresses)) {
+        sortByFamily(addresses);
+        return DEFAULT_TTL;
+    }
+
+    // IPv4 addresses go first on every path (the connector interleaves
+    // families anyway)
+    unsigned ttl=query(state, name, ns_t_a, addresses);
+    ttl=std::min(ttl, query(state, name, ns_t_aaaa, addresses));
+    if (!addresses.empty())
+        return std::max(ttl, 1u);
+
+    // Fall back to the system resolver (mDNS, NIS, etc.)
+    struct addrinfo hints, * ai=nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    error=getaddrinfo(name.c_str(), nullptr, &hints, &ai);
+    if (error)
+        return NEGATIVE_TTL;
+    for (struct addrinfo * i=ai; i; i=i->ai_next) {
+        struct sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        memcpy(&address, i->ai_addr, std::min(size_t(i->ai_addrlen), sizeof(address)));
+        addresses.push_back(address);
+    }
+    freeaddrinfo(ai);
+    sortByFamily(addresses);
+    return DEFAULT_TTL;
+}
+
+void Resolver::threadFunc() {
+    while (alive) {
+        int ticket=queued.prepare();
+        string name;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!queue.empty()) {
+                name=queue.front();
+                queue.pop_front();
+            }
+        }
+        if (name.empty()) {
+            queued.wait(ticket);
+            continue;
+        }
+
+        Entry entry;
+        unsigned ttl=lookup(name, entry.addresses, entry.error);
+        entry.expires=Clock::now()+std::chrono::seconds(ttl);
+        if (entry.addresses.empty()&&!entry.error)
+            entry.error=EAI_NONAME;
+
+        std::vector<Callback> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cache[name]=entry;
+            callbacks.swap(waiting[name]);
+            waiting.erase(name);
+        }
+        if (alive)
+            for (auto i=callbacks.begin(); i!=callbacks.end(); ++i)
+                (*i)(entry.addresses, entry.error);
+    }
+}
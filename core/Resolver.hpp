@@ -0,0 +1,72 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Asynchronous host name resolver with a TTL-respecting cache
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_RESOLVER_HPP
+#define __CORE_RESOLVER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+#include "../utils/Event.hpp"
+
+/** List of resolved addresses (ports are not set) **/
+typedef std::vector<struct sockaddr_storage> AddressList;
+
+/** Resolves host names on background threads. Answers are cached for the
+    lifetime given by DNS; names which are not resolved through DNS (e.g.
+    from /etc/hosts, which is read first) are cached for a fixed time. **/
+class Resolver {
+public:
+    /** Receives addresses or error code (EAI_*) when resolution finishes **/
+    typedef std::function<void(const AddressList &addresses, int error)> Callback;
+    /** Lifetime of answers which do not come with a TTL, in seconds **/
+    static const unsigned DEFAULT_TTL=60;
+    /** Lifetime of failed lookups, in seconds **/
+    static const unsigned NEGATIVE_TTL=5;
+
+    /** Start resolver threads **/
+    explicit Resolver(unsigned threads=2);
+    /** Wait for running lookups, pending callbacks are dropped **/
+    ~Resolver();
+    /** Resolve name. Callback is called on the calling thread if the answer
+        is known, otherwise later on a resolver thread. **/
+    void resolve(const std::string &name, Callback callback);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    /** Cached answer **/
+    struct Entry {
+        AddressList addresses;
+        int error;
+        Clock::time_point expires;
+    };
+
+    std::atomic<bool> alive;
+    std::mutex mutex;
+    /** Answers by host name **/
+    std::map<std::string, Entry> cache;
+    /** Callbacks of lookups in progress (or queued) by host name **/
+    std::map<std::string, std::vector<Callback>> waiting;
+    /** Names waiting for a resolver thread **/
+    std::deque<std::string> queue;
+    /** Notified when a name is queued **/
+    Event queued;
+    std::vector<std::thread> threads;
+
+    /** Look name up, returns TTL in seconds **/
+    unsigned lookup(const std::string &name, AddressList &addresses, int &error);
+    void threadFunc();
+};
+
+#endif
@@ -5,25 +5,33 @@
  *  © 2013—2021, Sauron
  ******************************************************************************/
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
 #include <cerrno>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <climits>
 #include <cstring>
+#include <future>
 #include <iostream>
 #include <map>
 #include <netdb.h>
 #include <set>
 #include <sstream>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utility>
 #include <vector>
+#include "DatagramConnection.hpp"
+#include "Metrics.hpp"
 #include "Sniffer.hpp"
 #include "StreamConnection.hpp"
+#include "../utils/Affinity.hpp"
+#include "../utils/HexDump.hpp"
+#include "../utils/Utils.hpp"
 
 using std::cerr;
 using std::cout;
@@ -36,112 +44,63 @@ using std::set;
 using std::string;
 using std::vector;
 
-namespace posix {
-    int socket(int family, int type, int protocol) {
-        int result=::socket(family, type, protocol);
-        if (result<0)
-            Error::raise("creating socket");
-        return result;
-    }
-    
-    int accept(int socket, struct sockaddr * addr, socklen_t * len) {
-        int result=::accept(socket, addr, len);
-        if (result<0)
-            Error::raise("accepting a connection");
-        return result;
-    }
-    
-    void bind(int socket, const struct sockaddr * addr, socklen_t len) {
-        if (::bind(socket, addr, len)<0)
-            Error::raise("binding to port");
-    }
-    
-    void listen(int socket, int backlog) {
-        if (::listen(socket, backlog)<0)
-            Error::raise("listening to port");
-    }
-    
-    int poll(struct pollfd * fds, nfds_t nfds, int timeout) {
-        int retval=::poll(fds, nfds, timeout);
-        if (retval<0)
-            Error::raise("poll()");
-        return retval;
-    }
-    
-    template <class T>
-    void setsockopt(int socket, int level, int option, T value) {
-        if (::setsockopt(socket, level, option, &value, sizeof(T))<0)
-            Error::raise("setting socket option");
-    }
-    
-    ssize_t read(int fd, void * buffer, size_t length) {
-        ssize_t retval=::read(fd, buffer, length);
-        if (retval<0)
-            Error::raise("reading from network");
-        return retval;
+/** Create socket bound to the specified port at all local interfaces. IPv6
+    sockets accept IPv4 peers too; if IPv6 is not available, IPv4 is used. **/
+static int bindSocket(int type, uint16_t port, int family, bool reuseAddress,
+        bool reusePort) {
+    int fd=::socket(family, type|SOCK_CLOEXEC, 0);
+    if (fd<0&&family==AF_INET6&&errno==EAFNOSUPPORT)
+        family=AF_INET;
+    if (fd<0)
+        fd=posix::socket(family, type|SOCK_CLOEXEC, 0);
+    struct sockaddr_storage endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    socklen_t length;
+    if (family==AF_INET6) {
+        struct sockaddr_in6 &in6=reinterpret_cast<struct sockaddr_in6 &>(endpoint);
+        in6.sin6_family=AF_INET6;
+        in6.sin6_port=htons(port);
+        in6.sin6_addr=in6addr_any;
+        length=sizeof(in6);
+        posix::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, 0);
     }
-    
-    ssize_t write(int fd, const void * buffer, size_t length) {
-        ssize_t retval=::write(fd, buffer, length);
-        if (retval<0)
-            Error::raise("writing to network");
-        return retval;
+    else {
+        struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(endpoint);
+        in.sin_family=AF_INET;
+        in.sin_port=htons(port);
+        in.sin_addr.s_addr=htonl(INADDR_ANY);
+        length=sizeof(in);
     }
+    posix::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, int(reuseAddress));
+    // Sockets of all shards share the port, the kernel balances clients
+    if (reusePort)
+        posix::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, 1);
+    posix::bind(fd, reinterpret_cast<struct sockaddr *>(&endpoint), length);
+    return fd;
 }
 
 /** Listen at the specified port at all local interfaces **/
-int listenAt(uint16_t port, int family=AF_INET, bool reuseAddress=true) {
-    int listener=posix::socket(family, SOCK_STREAM, 0);
-    struct sockaddr_in endpoint;
-    memset(&endpoint, 0, sizeof(endpoint));
-    endpoint.sin_family=family;
-    endpoint.sin_port=htons(port);
-    endpoint.sin_addr.s_addr=htonl(INADDR_ANY);
-    posix::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, int(reuseAddress));
-    posix::bind(listener, (struct sockaddr *)&endpoint, sizeof(endpoint));
+int listenAt(uint16_t port, int family=AF_INET6, bool reuseAddress=true,
+        bool reusePort=false) {
+    int listener=bindSocket(SOCK_STREAM, port, family, reuseAddress, reusePort);
     posix::listen(listener, 50);
     return listener;
 }
 
 /** Bind to the specified port **/
-int bindTo(uint16_t port, int family=AF_INET, bool reuseAddress=true) {
-    int listener=posix::socket(family, SOCK_DGRAM, 0);
-    struct sockaddr_in endpoint;
-    memset(&endpoint, 0, sizeof(endpoint));
-    endpoint.sin_family=family;
-    endpoint.sin_port=htons(port);
-    endpoint.sin_addr.s_addr=htonl(INADDR_ANY);
-    posix::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, int(reuseAddress));
-    posix::bind(listener, (struct sockaddr *)&endpoint, sizeof(endpoint));
-    return listener;
+int bindTo(uint16_t port, int family=AF_INET6, bool reuseAddress=true,
+        bool reusePort=false) {
+    return bindSocket(SOCK_DGRAM, port, family, reuseAddress, reusePort);
 }
 
 /** Dump byte array to text stream **/
 ostream &operator <<(ostream &stream, const vector<uint8_t> &data) {
-    //stream << "DUMP (len=" << data.size() << ")\n";
     if (data.empty())
         stream << "EMPTY\n";
     else {
-        char buffer[4];
-        size_t length=data.size();
-        string hex, ascii;
-        for (size_t i=0; i<=length; i++) {
-            if (i<length) {
-                uint8_t b=data[i];
-                sprintf(buffer, "%02x ", b);
-                hex+=buffer;
-                if (i%8==7)
-                    hex+=' ';
-                ascii+=((b>=32&&b<127)?(char)b:'.');
-            }
-            if ((i%16==15)||(i==length)) {
-                for (unsigned i=hex.length(); i<50; i++)
-                    hex+=' ';
-                stream << hex << ascii << endl;
-                hex=string();
-                ascii=string();
-            }
-        }
+        string text(hexDumpLength(data.size()), '\0');
+        hexDump(&text[0], data.data(), data.size());
+        stream << text;
     }
     return stream;
 }
@@ -163,64 +122,6 @@ void readFully(int stream, void * _buffer, size_t length) {
     }
 }
 
-/** Read one byte from stream **/
-static uint8_t readByte(int stream) {
-    uint8_t result;
-    if (read(stream, &result, sizeof(result))!=sizeof(result))
-        Error::raise("reading byte");
-    return result;
-}
-
-/** Write one byte to stream **/
-static void writeByte(int stream, uint8_t value) {
-    posix::write(stream, &value, sizeof(uint8_t));
-}
-
-/** Read a word from stream **/
-static uint16_t readWord(int stream) {
-    uint16_t result;
-    readFully(stream, &result, sizeof(result));
-    return ntohs(result);
-}
-
-/** Write a word to stream **/
-static void writeWord(int stream, uint16_t value) {
-    value=htons(value);
-    posix::write(stream, &value, sizeof(value));
-}
-
-/** Read a long integer from stream **/
-static uint32_t readLong(int stream) {
-    uint32_t result;
-    readFully(stream, &result, sizeof(result));
-    return ntohl(result);
-}
-
-/** Write a long integer to stream **/
-static void writeLong(int stream, uint32_t value) {
-    value=htonl(value);
-    posix::write(stream, &value, sizeof(value));
-}
-
-/** Read a zero-terminated string from stream **/
-static string readStringZ(int stream) {
-    string result;
-    char ch=0;
-    do {
-        readFully(stream, &ch, 1);
-        if (ch)
-            result.push_back(ch);
-    } while (ch);
-    return result;
-}
-
-/** Read a string with prefixed length from stream **/
-static string readString(int stream) {
-    string result(readByte(stream), '\0');
-    readFully(stream, &result[0], result.length());
-    return result;
-}
-
 /******************************************************************************/
 
 OptionsImpl::OptionsImpl(const char * optarg) {
@@ -282,6 +183,82 @@ void Protocol::add(const char * name, const char * description, int version,
 
 /******************************************************************************/
 
+bool Reader::refill() {
+    stashed=false;
+    if (savedHead!=savedTail) {
+        head=savedHead;
+        tail=savedTail;
+        savedHead=savedTail=nullptr;
+        return true;
+    }
+    head=tail=nullptr;
+    return underflow();
+}
+
+void Reader::readFullySlow(void * buffer, size_t length) {
+    uint8_t * byteBuffer=reinterpret_cast<uint8_t *>(buffer);
+    while (length) {
+        size_t nRead=readSome(byteBuffer, length);
+        if (nRead==0)
+            throw End();
+        length-=nRead;
+        byteBuffer+=nRead;
+    }
+}
+
+void Reader::skipSlow(size_t length) {
+    while (length) {
+        if (head==tail&&!refill()) {
+            // Unbuffered reader, read data and drop it
+            uint8_t scratch[256];
+            size_t nRead=read(scratch, std::min(length, sizeof(scratch)));
+            if (nRead==0)
+                throw End();
+            length-=nRead;
+        }
+        else {
+            size_t nSkipped=std::min(length, size_t(tail-head));
+            head+=nSkipped;
+            length-=nSkipped;
+        }
+    }
+}
+
+void Reader::fill(size_t length) {
+    // Move the rest of the window to the beginning of the stash
+    if (stashed)
+        stash.erase(0, head-reinterpret_cast<const uint8_t *>(stash.data()));
+    else
+        stash.assign(reinterpret_cast<const char *>(head), tail-head);
+    head=tail=nullptr;
+    
+    while (stash.size()<length) {
+        if (head==tail&&!refill()) {
+            size_t offset=stash.size();
+            stash.resize(length);
+            size_t nRead=read(&stash[offset], length-offset);
+            stash.resize(offset+nRead);
+            if (nRead==0)
+                break;
+        }
+        else {
+            size_t nTaken=std::min(size_t(tail-head), length-stash.size());
+            stash.append(reinterpret_cast<const char *>(head), nTaken);
+            head+=nTaken;
+        }
+    }
+    
+    savedHead=head;
+    savedTail=tail;
+    head=reinterpret_cast<const uint8_t *>(stash.data());
+    tail=head+stash.size();
+    stashed=true;
+    if (stash.size()<length)
+        throw End();
+}
+
+/******************************************************************************/
+
 Error::Error(const char * stage) : stage(stage), error(errno) {}
 
 const char * Error::getError() const { return strerror(error); }
@@ -295,96 +272,408 @@ void Error::raise(const char * stage) {
 
 /******************************************************************************/
 
+/** epoll tag of the wakeup eventfd (never a valid connection slot) **/
+static const uint64_t WAKEUP_TAG=~uint64_t(0);
+
+/** Returns epoll tag of descriptor: generation, slot and index of the event **/
+static inline uint64_t makeTag(const Sniffer::Handle &handle, unsigned index) {
+    return (uint64_t(handle.generation)<<32)|(uint64_t(handle.slot)<<2)|index;
+}
+/** Maximum number of events taken from epoll at once **/
+static const int MAX_EVENTS=256;
+
 Sniffer::Sniffer(const Plugin &plugin, const OptionsImpl &options,
-    ostream &output) : plugin(plugin), options(options), output(output),
-    alive(true), pollThread(&Sniffer::pollThreadFunc, this) {}
+    LogWriter &log, const Configuration &configuration) : plugin(plugin),
+    options(options), log(log), configuration(configuration),
+    pool(configuration.workers), alive(true), polling(true), epoll(posix::epoll_create()),
+    wakeup(posix::eventfd()), epoch(Clock::now()), time(0),
+    throttleTimer([this]() { resumeThrottled(); }), pollThread() {
+    posix::epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, EPOLLIN, WAKEUP_TAG);
+    reaperThread=std::thread(&Sniffer::reaperThreadFunc, this);
+    pollThread=std::thread(&Sniffer::pollThreadFunc, this);
+}
 
 Sniffer::~Sniffer() {
-    alive=false;
+    {
+        // Resolver threads must not post anything from now on
+        std::unique_lock<std::mutex> lock(gcMutex);
+        alive=false;
+    }
     if (pollThread.joinable()) {
-        pthread_kill(pollThread.native_handle(), SIGTERM);
+        wake();
         pollThread.join();
     }
+    // Connections retired before are deleted by the reaper
+    if (reaperThread.joinable()) {
+        reaperEvent.notify();
+        reaperThread.join();
+    }
+    
+    // Close remaining connections and wait for their dissectors to finish
+    watchPending();
+    size_t remaining=connections.size();
+    connections.forEach([](ConnectionPtr connection) {
+        connection->getChannel(false).close();
+        connection->getChannel(true).close();
+    });
+    while (remaining) {
+        int ticket=retiredEvent.prepare();
+        vector<ConnectionPtr> finished;
+        {
+            std::unique_lock<std::mutex> lock(gcMutex);
+            finished.swap(retired);
+        }
+        if (finished.empty())
+            retiredEvent.wait(ticket);
+        for (auto i=finished.begin(); i!=finished.end(); ++i) {
+            connections.erase((*i)->handle);
+            (*i)->deactivate();
+            delete *i;
+            remaining--;
+        }
+    }
+    
+    close(wakeup);
+    close(epoll);
 }
 
 void Sniffer::add(Connection * connection) {
-    std::unique_lock<std::mutex> lock(gcMutex);
     if (connection) {
-        for (auto i=connections.begin(); i!=connections.end(); ++i) {
-            if (!*i) {
-                *i=connection;
-                return;
-            }
+        {
+            std::unique_lock<std::mutex> lock(gcMutex);
+            pending.push_back(connection);
         }
-        connections.push_back(connection);
+        wake();
     }
 }
 
+void Sniffer::wake() {
+    uint64_t one=1;
+    if (::write(wakeup, &one, sizeof(one))<0&&errno!=EAGAIN)
+        Error::raise("waking up polling thread");
+}
+
+void Sniffer::watchPending() {
+    uint64_t counter;
+    while (::read(wakeup, &counter, sizeof(counter))>0);
+    
+    vector<ConnectionPtr> added;
+    {
+        std::unique_lock<std::mutex> lock(gcMutex);
+        added.swap(pending);
+    }
+    
+    for (auto i=added.begin(); i!=added.end(); ++i) {
+        ConnectionPtr connection=*i;
+        connection->handle=connections.insert(connection);
+        
+        // Channels stay registered until their descriptors are closed
+        for (unsigned j=0; j<2; j++) {
+            Channel &channel=connection->getChannel(bool(j));
+            if (channel.isAlive()&&channel.getDescriptor()>=0)
+                watch(*connection, j, channel.getDescriptor(), EPOLLIN|EPOLLRDHUP|EPOLLET);
+        }
+        if (alive)
+            connection->activate();
+    }
+}
+
+void Sniffer::watch(Connection &connection, unsigned index, int fd, uint32_t events) {
+    posix::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, events, makeTag(connection.handle, index));
+}
+
+void Sniffer::rewatch(Connection &connection, unsigned index, int fd, uint32_t events) {
+    posix::epoll_ctl(epoll, EPOLL_CTL_MOD, fd, events, makeTag(connection.handle, index));
+}
+
+void Sniffer::unwatch(int fd) {
+    posix::epoll_ctl(epoll, EPOLL_CTL_DEL, fd, 0, 0);
+}
+
+void Sniffer::setTimer(TimerWheel::Timer &timer, unsigned milliseconds) {
+    timers.schedule(timer, getTime()+milliseconds);
+}
+
+bool Sniffer::post(const Handle &connection, std::function<void()> function) {
+    std::unique_lock<std::mutex> lock(gcMutex);
+    if (!alive||!polling)
+        return false;
+    messages.push_back(Message{connection, std::move(function)});
+    wake();
+    return true;
+}
+
+bool Sniffer::post(std::function<void()> function) {
+    // Generations start at 1, so this handle is never checked
+    return post(Handle{0, 0}, std::move(function));
+}
+
+Connection * Sniffer::find(const Handle &handle) const {
+    return connections.find(handle);
+}
+
+void Sniffer::runMessages() {
+    vector<Message> posted;
+    {
+        std::unique_lock<std::mutex> lock(gcMutex);
+        posted.swap(messages);
+    }
+    for (auto i=posted.begin(); i!=posted.end(); ++i)
+        if (i->connection.generation==0||find(i->connection))
+            i->function();
+}
+
+uint64_t Sniffer::updateTime() {
+    uint64_t now=std::chrono::duration_cast<std::chrono::milliseconds>(
+        Clock::now()-epoch).count();
+    time.store(now, std::memory_order_relaxed);
+    return now;
+}
+
+int Sniffer::runTimers() {
+    uint64_t now=updateTime();
+    timers.advance(now);
+    uint64_t next=timers.getNextExpiry();
+    if (next==TimerWheel::NEVER)
+        return -1;
+    return int(std::min(next-now, uint64_t(INT_MAX)));
+}
+
+void Sniffer::throttle(Connection &connection) {
+    throttled.push_back(connection.handle);
+    if (!throttleTimer.isScheduled())
+        setTimer(throttleTimer, THROTTLE_INTERVAL);
+}
+
+void Sniffer::resumeThrottled() {
+    // Memory under --capture-total may be freed by any other connection,
+    // which does not know who waits for it
+    auto last=std::remove_if(throttled.begin(), throttled.end(),
+        [this](const Handle &handle) {
+            Connection * connection=find(handle);
+            if (!connection)
+                return true;
+            bool waiting=false;
+            for (unsigned j=0; j<2; j++) {
+                Channel &channel=connection->getChannel(bool(j));
+                channel.wakeReader();
+                waiting|=channel.throttled.load(std::memory_order_relaxed);
+            }
+            return !waiting;
+        });
+    throttled.erase(last, throttled.end());
+    if (!throttled.empty())
+        setTimer(throttleTimer, THROTTLE_INTERVAL);
+}
+
+void Sniffer::retire(Connection * connection) {
+    // The destructor may delete us as soon as the lock is released
+    std::unique_lock<std::mutex> lock(gcMutex);
+    retired.push_back(connection);
+    retiredEvent.notify();
+    wake();
+}
+
+void Sniffer::collectRetired() {
+    vector<ConnectionPtr> finished;
+    {
+        std::unique_lock<std::mutex> lock(gcMutex);
+        finished.swap(retired);
+    }
+    if (finished.empty())
+        return;
+    for (auto i=finished.begin(); i!=finished.end(); ++i) {
+        connections.erase((*i)->handle);
+        (*i)->deactivate();
+    }
+    {
+        std::unique_lock<std::mutex> lock(reaperMutex);
+        doomed.insert(doomed.end(), finished.begin(), finished.end());
+    }
+    reaperEvent.notify();
+}
+
 void Sniffer::pollThreadFunc() {
-    try {
-        while (alive) {
-            vector<pollfd> pollfds;
-            vector<std::reference_wrapper<Channel>> channels;
-            {
-                std::unique_lock<std::mutex> lock(gcMutex);
-                for (size_t i=0; i<connections.size(); i++) {
-                    ConnectionPtr connection=connections[i];
-                    if (connection) {
-                        for (unsigned j=0; j<2; j++) {
-                            Channel &channel=connection->getChannel(bool(j));
-                            if (channel.isAlive()) {
-                                channels.emplace_back(channel);
-                                pollfds.push_back(pollfd{channel.getDescriptor(), POLLIN, 0});
-                            }
-                        }
-                    }
+    struct epoll_event events[MAX_EVENTS];
+    while (alive) {
+        try {
+            int count=posix::epoll_wait(epoll, events, MAX_EVENTS, runTimers());
+            // Activity is stamped with the time after the wait
+            updateTime();
+            for (int i=0; i<count; i++) {
+                uint64_t tag=events[i].data.u64;
+                if (tag==WAKEUP_TAG) {
+                    watchPending();
+                    runMessages();
+                    collectRetired();
                 }
-                // TODO: do not rebuild database each time
-            }
-            
-            int retval=posix::poll(pollfds.data(), pollfds.size(), 5000);
-            if (retval)
-                for (size_t i=0; i<pollfds.size(); i++)
-                    if (pollfds[i].revents)
-                        channels[i].get().notify();
-            
-            // Delete connections which are not alive
-            std::unique_lock<std::mutex> lock(gcMutex);
-            for (auto i=connections.begin(); i!=connections.end(); ++i) {
-                ConnectionPtr connection=*i;
-                if (connection&&!connection->isAlive()) {
-                    delete connection;
-                    *i=nullptr;
+                else {
+                    // Events of a deleted connection carry an old generation
+                    Handle handle{uint32_t(tag)>>2, uint32_t(tag>>32)};
+                    if (ConnectionPtr connection=connections.find(handle))
+                        connection->notify(unsigned(tag&3));
                 }
             }
         }
+        catch (const Interrupt &e) {
+            // A signal arrived, check whether we are still alive
+        }
+        catch (const Error &e) {
+            cerr << "pollThread: " << e << endl;
+            break;
+        }
+        catch (...) {
+            cerr << "pollThread: unknown error" << endl;
+            break;
+        }
     }
-    catch (const Interrupt &e) {
-        cerr << "pollThread: program was terminated" << endl;
+
+    // Nothing is accepted from now on, and nobody waits forever for what
+    // was posted before
+    {
+        std::unique_lock<std::mutex> lock(gcMutex);
+        polling=false;
     }
-    catch (const Error &e) {
-        cerr << "pollThread: " << e << endl;
+    runMessages();
+}
+
+void Sniffer::reaperThreadFunc() {
+    vector<ConnectionPtr> finished;
+    while (true) {
+        int ticket=reaperEvent.prepare();
+        {
+            std::unique_lock<std::mutex> lock(reaperMutex);
+            finished.swap(doomed);
+        }
+        if (finished.empty()) {
+            if (!alive)
+                break;
+            reaperEvent.wait(ticket);
+            continue;
+        }
+        for (auto i=finished.begin(); i!=finished.end(); ++i)
+            delete *i;
+        finished.clear();
     }
-    catch (...) {
-        cerr << "pollThread: unknown error" << endl;
+}
+
+/******************************************************************************/
+
+/** Capture memory which must be free before a paused reader resumes **/
+static const size_t RESUME_MARGIN=1<<16;
+
+std::atomic<size_t> Channel::totalQueued(0);
+std::atomic<unsigned long> Channel::overflows(0);
+std::atomic<unsigned long long> Channel::droppedBytes(0);
+
+Channel::~Channel() {
+    totalQueued-=queued;
+}
+
+bool Channel::admit(size_t length, bool pausable) {
+    if (!owner)
+        return true;
+    OverflowPolicy policy=owner->sniffer.getConfiguration().overflow;
+    if (policy==OVERFLOW_PAUSE&&!pausable)
+        policy=OVERFLOW_DROP;
+    if (isTruncated()||(policy!=OVERFLOW_PAUSE&&isOverBudget(length))) {
+        if (policy==OVERFLOW_TRUNCATE&&!isTruncated()) {
+            overflow("stopping capture");
+            truncated.store(true, std::memory_order_release);
+            wakeDissector();
+        }
+        else if (policy==OVERFLOW_DROP&&!overflowing)
+            overflow("dropping data");
+        overflowing=true;
+        droppedBytes+=length;
+        return false;
+    }
+    overflowing=false;
+    queued+=length;
+    totalQueued+=length;
+    return true;
+}
+
+bool Channel::isThrottled() {
+    if (!owner||owner->sniffer.getConfiguration().overflow!=OVERFLOW_PAUSE||
+            !isOverBudget(0))
+        return false;
+    bool registered=throttled.exchange(true);
+    // The dissector may have caught up before it could see the flag
+    if (!isOverBudget(0)) {
+        throttled=false;
+        return false;
     }
+    if (!registered)
+        owner->sniffer.throttle(*owner);
+    if (!overflowing)
+        overflow("pausing");
+    overflowing=true;
+    return true;
+}
+
+void Channel::taken(size_t length) {
+    queued-=length;
+    totalQueued-=length;
+    // Either direction may be paused by the backlog of this one
+    wakeReader();
+    owner->getChannel(!incoming).wakeReader();
+}
+
+void Channel::wakeReader() {
+    if (throttled.load(std::memory_order_relaxed)&&!isOverBudget(RESUME_MARGIN)&&
+            throttled.exchange(false)) {
+        // Reading is resumed on the polling thread
+        Connection * owner=this->owner;
+        unsigned index=incoming;
+        owner->sniffer.post(owner->sniffer.getHandle(*owner),
+            [owner, index]() { owner->notify(index); });
+    }
+}
+
+bool Channel::isOverBudget(size_t length) const {
+    const Configuration &configuration=owner->sniffer.getConfiguration();
+    size_t connection=owner->getChannel(false).getQueued()+
+        owner->getChannel(true).getQueued();
+    return (configuration.captureLimit&&connection+length>configuration.captureLimit)||
+        (configuration.captureTotal&&getTotalQueued()+length>configuration.captureTotal);
+}
+
+void Channel::overflow(const char * action) {
+    overflows++;
+    if (reported)
+        return;
+    reported=true;
+    owner->error() << "capture memory limit reached in "
+        << (incoming?"incoming":"outgoing") << " direction, " << action << endl;
+}
+
+void Channel::account(size_t length) {
+    if (owner)
+        lastActive.store(owner->sniffer.getTime(), std::memory_order_relaxed);
+    Metrics::add(incoming?Metrics::BYTES_INCOMING:Metrics::BYTES_OUTGOING, length);
+    Metrics::add(incoming?Metrics::CHUNKS_INCOMING:Metrics::CHUNKS_OUTGOING);
+}
+
+void Channel::wakeDissector() {
+    if (owner)
+        owner->wake(incoming);
 }
 
 /******************************************************************************/
 
-Connection::Connection(Sniffer &sniffer) : sniffer(sniffer),
-        instanceId(++maxInstanceId),
-        protocol(sniffer.newProtocol()) {
+Connection::Connection(Sniffer &sniffer) : Task(sniffer.getPool()),
+        sniffer(sniffer), instanceId(++maxInstanceId),
+        protocol(sniffer.newProtocol()), c2sDissector(*this, false),
+        s2cDissector(*this, true), pendingDirections(0), handle{0, 0} {
     if (!protocol)
         throw "failed to instantiate protocol plugin";
+    Metrics::add(Metrics::CONNECTIONS_OPENED);
 }
 
 Connection::~Connection() {
-    if (c2sThread.joinable())
-        c2sThread.join();
-    if (s2cThread.joinable())
-        s2cThread.join();
     delete protocol;
+    Metrics::add(Metrics::CONNECTIONS_CLOSED);
 }
 
 bool Connection::isAlive() {
@@ -394,45 +683,79 @@ bool Connection::isAlive() {
     //return getChannel(true).isAlive()&&getChannel(false).isAlive();
 }
 
-void Connection::dump(ostream &log, bool incoming, Reader &reader) {
+void Connection::dump(bool incoming, Reader &reader) {
     string dumpText;
+    bool dumped=false;
     try {
         dumpText=protocol->dump(incoming, reader);
+        Metrics::add(Metrics::MESSAGES);
+        dumped=true;
     }
     catch (Reader::End) {
         throw;
     }
     catch (...) {
         dumpText="UNHANDLED EXCEPTION";
+        Metrics::add(Metrics::PLUGIN_ERRORS);
     }
     
-    std::lock_guard<std::mutex> logLock(logMutex);
     ostringstream header;
     time_t now=time(0);
-    const char * timestamp=ctime(&now);
+    char timestamp[32];
+    ctime_r(&now, timestamp);
     header << "==[" << instanceId << " " << (incoming?"▼":"▲") << "]==[";
     header << string(timestamp, strchrnul(timestamp, '\n')-timestamp) << "]==";
-    string headerStr=header.str();
-    log << headerStr;
-    for (unsigned i=headerStr.length(); i<80; i++)
-        log << '=';
-    log << endl << dumpText << endl;
+    string record=header.str();
+    if (record.length()<80)
+        record.append(80-record.length(), '=');
+    record+='\n';
+    record+=dumpText;
+    record+='\n';
+    sniffer.getLog().append(std::move(record));
+    
+    // The stamp belongs to the newest data of the window, so the lag of the
+    // beginning of a long message is not seen
+    uint64_t arrival=getChannel(incoming).getArrival();
+    if (dumped&&arrival)
+        Latency::record(incoming?Latency::DISSECT_INCOMING:Latency::DISSECT_OUTGOING,
+            arrival);
 }
 
 void Connection::start(Sniffer &sniffer) {
-    c2sThread=std::thread(&Connection::_threadFunc, this, std::ref(sniffer), false);
-    s2cThread=std::thread(&Connection::_threadFunc, this, std::ref(sniffer), true);
+    getChannel(false).attach(*this, false);
+    getChannel(true).attach(*this, true);
+    wake(false);
+    wake(true);
+}
+
+void Connection::wake(bool incoming) {
+    pendingDirections.fetch_or(incoming?2:1);
+    Task::wake();
+}
+
+bool Connection::run() {
+    // Dissectors of one connection never run concurrently
+    unsigned directions=pendingDirections.exchange(0);
+    if (directions&1)
+        c2sDissector.resume();
+    if (directions&2)
+        s2cDissector.resume();
+    return !(c2sDissector.isFinished()&&s2cDissector.isFinished());
+}
+
+void Connection::done() {
+    sniffer.retire(this);
 }
 
 ostream &Connection::error() const {
     return cerr << "Connection #" << getInstanceId() << ": ";
 }
 
-unsigned Connection::maxInstanceId=0;
+std::atomic<unsigned> Connection::maxInstanceId(0);
 
-void Connection::_threadFunc(Sniffer &sniffer, bool incoming) {
+void Connection::_threadFunc(bool incoming) {
     try {
-        threadFunc(sniffer.getStream(), incoming);
+        threadFunc(incoming);
     }
     catch (Reader::End) {
         error() << "disconnected from " << (incoming?"server":"client") << endl;
@@ -442,119 +765,7 @@ void Connection::_threadFunc(Sniffer &sniffer, bool incoming) {
     }
     catch (...) {
         error() << "unknown exception was thrown by the plugin" << endl;
-    }
-}
-
-std::mutex Connection::logMutex;
-
-/******************************************************************************/
-
-int StreamConnection::acceptSocksConnection(int client) {
-    uint8_t version=readByte(client);
-    if (version==4) {
-        // Process SOCKS4 request
-        struct Socks4Request {
-            uint8_t command;
-            uint16_t port;
-            uint32_t address;
-        } __attribute__((packed)) rq;
-        readFully(client, &rq, sizeof(rq));
-        string username=readStringZ(client);
-        
-        uint8_t status=0x5a;
-        if (rq.command!=1) {
-            error() << "SOCKSv4: unknown command " << int(rq.command) << endl;
-            status=0x5b;
-        }
-        char addressBuf[32];
-        if (!inet_ntop(AF_INET, &(rq.address), addressBuf, 32)) {
-            error() << "SOCKSv4: inet_pton() failed" << endl;
-            status=0x5b;
-        }
-        if (!username.empty())
-            error() << "SOCKSv4: client sent username: " << username << endl;
-        
-        // Send SOCKS4 response
-        struct Socks4Response {
-            uint8_t null;
-            uint8_t status;
-            uint8_t reserved[6];
-        } __attribute__((packed)) rs;
-        memset(&rs, 0, sizeof(rs));
-        rs.status=status;
-        posix::write(client, &rs, sizeof(rs));
-        if (rs.status!=0x5a)
-            throw Error("SOCKSv4 connection", EPROTO);
-        
-        return initialize({addressBuf, ntohs(rq.port)});
-    }
-    else if (version==5) {
-        // Process initial SOCKS5 request
-        string authMethods=readString(client);
-        uint8_t preferredMethod=authMethods.find('\0')==string::npos?0xff:0x00;
-        error() << "SOCKSv5: authentication methods: ";
-        for (size_t i=0; i<authMethods.size(); i++) {
-            if (i>0)
-                cerr << ", ";
-            cerr << unsigned(authMethods[i]);
-        }
-        cerr << endl;
-        
-        // Send response about authentication method
-        writeByte(client, 5);
-        writeByte(client, preferredMethod);
-        
-        // Process SOCKS5 connection request
-        readByte(client);
-        uint8_t command=readByte(client), status=0x00;
-        if (command!=1) {
-            error() << "SOCKSv5: unknown command " << int(command) << endl;
-            status=0x07;
-        }
-        readByte(client);
-        uint8_t addressType=readByte(client);
-        HostAddress remote;
-        if (addressType==1) {
-            char buffer[32];
-            uint32_t address=htonl(readLong(client));
-            if (!inet_ntop(AF_INET, &address, buffer, 32)) {
-                error() << "SOCKSv5: inet_pton() failed" << endl;
-                status=0x04;
-            }
-            remote.first=buffer;
-        }
-        else if (addressType==3) {
-            remote.first=readString(client);
-        }
-        else {
-            error() << "SOCKSv5: unknown address type " << int(addressType) << endl;
-            status=0x08;
-        }
-        remote.second=readWord(client);
-        
-        if (status==0) {
-            // Connect to the target server
-            int result=initialize(remote);
-            
-            // Send SOCKS5 connection response
-            writeByte(client, 5);
-            writeByte(client, status);
-            writeByte(client, 0);
-            writeByte(client, 1);
-            writeLong(client, 0x7f000001);
-            writeWord(client, remote.second);
-            // TODO: send NACK in case of bad connection
-            return result;
-        }
-        else {
-            writeByte(client, 5);
-            writeByte(client, status);
-            throw Error("SOCKSv5 connection", EPROTO);
-        }
-    }
-    else {
-        error() << "SOCKSv" << (int)version << " is not supported" << endl;
-        throw Error("SOCKS version mismatch", EPROTO);
+        Metrics::add(Metrics::PLUGIN_ERRORS);
     }
 }
 
@@ -569,6 +780,7 @@ int mainLoop(const char * program, Sniffer &sniffer, int listener, T ... args) {
         int client=-1;
         try {
             client=posix::accept(listener, 0, 0);
+            Metrics::add(Metrics::ACCEPTS);
             cerr << "New connection from client" << endl; // TODO print ip:port
             sniffer.add<StreamConnection>(client, args...);
         }
@@ -576,7 +788,8 @@ int mainLoop(const char * program, Sniffer &sniffer, int listener, T ... args) {
             cerr << endl << program << ": shutting down..." << endl;
         }
         catch (const Error &e) {
-            if (e.getErrno()!=EINTR) {
+            // Listeners of shards are shut down when a signal arrives
+            if (e.getErrno()!=EINTR&&working) {
                 cerr << program << ": " << e << endl;
                 if (client>=0)
                     close(client);
@@ -587,6 +800,44 @@ int mainLoop(const char * program, Sniffer &sniffer, int listener, T ... args) {
     return 0;
 }
 
+/** Resolve address of server **/
+static struct sockaddr_storage resolve(Sniffer &sniffer, const HostAddress &remote) {
+    std::promise<std::pair<AddressList, int>> promise;
+    sniffer.getResolver().resolve(remote.first,
+        [&promise](const AddressList &addresses, int error) {
+            promise.set_value(std::make_pair(addresses, error));
+        });
+    std::pair<AddressList, int> result=promise.get_future().get();
+    if (result.second||result.first.empty())
+        throw Error("resolving server address", EHOSTUNREACH);
+    struct sockaddr_storage address=result.first.front();
+    if (address.ss_family==AF_INET)
+        reinterpret_cast<struct sockaddr_in &>(address).sin_port=htons(remote.second);
+    else
+        reinterpret_cast<struct sockaddr_in6 &>(address).sin6_port=htons(remote.second);
+    return address;
+}
+
+int mainLoopUdp(const char * program, Sniffer &sniffer, int listener, HostAddress remote) {
+    {
+        DatagramServer server(sniffer, listener, resolve(sniffer, remote));
+        while (working) {
+            try {
+                server.receive();
+            }
+            catch (const Interrupt &e) {
+                if (!working)
+                    cerr << endl << program << ": shutting down..." << endl;
+            }
+            catch (const Error &e) {
+                cerr << program << ": " << e << endl;
+            }
+        }
+    }
+    close(listener);
+    return 0;
+}
+
 int mainLoopTcp(const char * program, Sniffer &sniffer, int listener, HostAddress remote) {
     return mainLoop(program, sniffer, listener, remote);
 }
@@ -595,6 +846,39 @@ int mainLoopSocks(const char * program, Sniffer &sniffer, int listener) {
     return mainLoop(program, sniffer, listener);
 }
 
+int runShards(const char * program, const vector<int> &listeners,
+        const vector<cpu_set_t> &placement, std::function<int(int listener)> serve) {
+    vector<std::thread> threads;
+    vector<int> results(listeners.size(), 0);
+    for (size_t i=0; i<listeners.size(); i++)
+        threads.emplace_back([&, i]() {
+            try {
+                // Everything the shard starts inherits the affinity
+                pinThread(placement[i]);
+                results[i]=serve(listeners[i]);
+            }
+            catch (const Error &e) {
+                cerr << program << ": shard " << i << ": " << e << endl;
+                results[i]=1;
+            }
+            catch (const char * e) {
+                cerr << program << ": shard " << i << ": " << e << endl;
+                results[i]=1;
+            }
+            working=0;
+        });
+    
+    // A signal may be delivered to any thread, so check the flag regularly
+    while (working)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    cerr << endl << program << ": shutting down..." << endl;
+    for (auto i=listeners.begin(); i!=listeners.end(); ++i)
+        shutdown(*i, SHUT_RDWR);
+    for (auto i=threads.begin(); i!=threads.end(); ++i)
+        i->join();
+    return *std::max_element(results.begin(), results.end());
+}
+
 void sighandler(int sigNo) {
     working=0;
 }
@@ -8,12 +8,20 @@
 #ifndef __CORE_SNIFFER_HPP
 #define __CORE_SNIFFER_HPP
 
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <mutex>
 #include <set>
 #include <thread>
 #include <vector>
 #include "../sniffer.hpp"
+#include "../utils/Coroutine.hpp"
+#include "../utils/TimerWheel.hpp"
+#include "ConnectionTable.hpp"
+#include "LogWriter.hpp"
+#include "Resolver.hpp"
+#include "WorkerPool.hpp"
 
 /**/
 struct Plugin {
@@ -52,16 +60,139 @@ private:
     std::map<std::string, std::string> options;
 };
 
+/** What happens to data which does not fit into capture memory limits.
+    Forwarding goes on in any case. **/
+enum OverflowPolicy {
+    /** Skip data until the dissector catches up (it sees a gap) **/
+    OVERFLOW_DROP,
+    /** Stop capturing the direction, the dissector sees end of stream **/
+    OVERFLOW_TRUNCATE,
+    /** Stop reading from the source until the dissector catches up **/
+    OVERFLOW_PAUSE
+};
+
+/** Run-time settings of the sniffer core **/
+struct Configuration {
+    Configuration() : zeroCopy(false), workers(0), capture(nullptr),
+        connectTimeout(10000), handshakeTimeout(10000), idleTimeout(3600),
+        maxLifetime(0), upstream(nullptr), datagramTimeout(60),
+        captureLimit(16<<20), captureTotal(256<<20), overflow(OVERFLOW_DROP) {}
+    /** Forward stream data with splice() and capture it with tee() **/
+    bool zeroCopy;
+    /** Number of dissector threads (0 means one per CPU) **/
+    unsigned workers;
+    /** Write forwarded data here instead of dissecting it (may be null) **/
+    class PacketCapture * capture;
+    /** Time limit of connecting to one address of upstream in milliseconds **/
+    unsigned connectTimeout;
+    /** Time limit of SOCKS negotiation with a client in milliseconds **/
+    unsigned handshakeTimeout;
+    /** Time in seconds after which stream connections which have not
+        received anything are closed (0 means never) **/
+    unsigned idleTimeout;
+    /** Time in seconds after which stream connections are closed in any
+        case (0 means never) **/
+    unsigned maxLifetime;
+    /** Pre-connected sockets to the --tcp-server host (may be null) **/
+    class UpstreamPool * upstream;
+    /** Idle time after which datagram flows are closed in seconds **/
+    unsigned datagramTimeout;
+    /** Captured bytes one connection may keep waiting for its dissectors
+        (0 means unlimited) **/
+    size_t captureLimit;
+    /** Captured bytes all connections may keep waiting (0 means unlimited) **/
+    size_t captureTotal;
+    /** What to do when a limit is reached **/
+    OverflowPolicy overflow;
+};
+
 /**/
 class Channel {
 public:
+    Channel() : owner(nullptr), incoming(false), queued(0), truncated(false),
+        overflowing(false), reported(false), throttled(false), lastActive(0), arrival(0) {}
+    /** Give back capture memory which was not taken by the dissector **/
+    virtual ~Channel();
     virtual bool isAlive() const=0;
     virtual int getDescriptor() const=0;
     virtual void notify()=0;
+    /** Close the channel and its peer **/
+    virtual void close()=0;
+    /** Link channel to the connection which dissects its data **/
+    void attach(class Connection &owner, bool incoming) {
+        this->owner=&owner;
+        this->incoming=incoming;
+    }
+    /** Returns number of captured bytes not taken by the dissector yet **/
+    size_t getQueued() const { return queued.load(std::memory_order_relaxed); }
+    /** Returns number of captured bytes in all channels **/
+    static size_t getTotalQueued() { return totalQueued.load(std::memory_order_relaxed); }
+    /** Returns how many times capture memory limits were reached **/
+    static unsigned long getOverflows() { return overflows.load(std::memory_order_relaxed); }
+    /** Returns number of bytes which were forwarded but not captured **/
+    static unsigned long long getDroppedBytes() { return droppedBytes.load(std::memory_order_relaxed); }
+    /** [consumer] Returns Latency::now() when the data given to the
+        dissector last arrived (0 if unknown) **/
+    uint64_t getArrival() const { return arrival; }
+    /** Returns Sniffer::getTime() when data was received last (0 if never) **/
+    uint64_t getLastActive() const { return lastActive.load(std::memory_order_relaxed); }
+    /** Count received data (one read or datagram) in metrics and remember
+        when it arrived **/
+    void account(size_t length);
+    
+protected:
+    /** Tell the dissector that new data (or end of stream) is available **/
+    void wakeDissector();
+    /** Returns true if the channel carries data from server to client **/
+    bool isIncoming() const { return incoming; }
+    /** [producer] Account bytes about to be captured, returns false if they
+        must be dropped because of capture memory limits (channels which do
+        not call isThrottled() drop data under OVERFLOW_PAUSE too) **/
+    bool admit(size_t length, bool pausable=true);
+    /** [producer] Returns true if reading should stop until the dissector
+        catches up (notify() is called again then) **/
+    bool isThrottled();
+    /** [consumer] Account bytes taken by the dissector, resume readers which
+        may continue now **/
+    void taken(size_t length);
+    /** [consumer] Returns true if nothing more will be captured **/
+    bool isTruncated() const { return truncated.load(std::memory_order_acquire); }
+    /** [consumer] Remember arrival time of data given to the dissector **/
+    void setArrival(uint64_t arrival) { this->arrival=arrival; }
+    
+private:
+    Connection * owner;
+    bool incoming;
+    /** Captured bytes waiting for the dissector **/
+    std::atomic<size_t> queued;
+    /** Capture was stopped by OVERFLOW_TRUNCATE **/
+    std::atomic<bool> truncated;
+    /** The last data was dropped (producer only) **/
+    bool overflowing;
+    /** The first overflow was logged (producer only) **/
+    bool reported;
+    /** Reading is stopped by OVERFLOW_PAUSE **/
+    std::atomic<bool> throttled;
+    /** When data was received last **/
+    std::atomic<uint64_t> lastActive;
+    /** Arrival time of the current window of the dissector (consumer only) **/
+    uint64_t arrival;
+    static std::atomic<size_t> totalQueued;
+    static std::atomic<unsigned long> overflows;
+    static std::atomic<unsigned long long> droppedBytes;
+    
+    /** Returns true if length more bytes would exceed a limit **/
+    bool isOverBudget(size_t length) const;
+    /** Resume reading on the polling thread if it was stopped and enough
+        capture memory is free again (any thread) **/
+    void wakeReader();
+    /** Count the start of an overflow (only the first one is logged) **/
+    void overflow(const char * action);
+    friend class Sniffer;
 };
 
-/** Abstract protocol sniffer **/
-class Connection {
+/** Abstract protocol sniffer (a task which runs both dissectors) **/
+class Connection : public Task {
 public:
     /** Create a sniffer connection and protocol handler instance **/
     explicit Connection(class Sniffer &controller);
@@ -77,64 +208,215 @@ public:
     std::ostream &error() const;
     
 protected:
+    /** Returns sniffer which owns the connection **/
+    Sniffer &getSniffer() const { return sniffer; }
     /** Dump next packet **/
-    void dump(std::ostream &log, bool incoming, Reader &reader);
-    /** Start incoming and outgoing threads **/
+    void dump(bool incoming, Reader &reader);
+    /** Attach channels and start incoming and outgoing dissectors **/
     void start(Sniffer &sniffer);
     /** This function should be overridden by subclasses **/
-    virtual void threadFunc(std::ostream &log, bool incoming)=0;
+    virtual void threadFunc(bool incoming)=0;
+    /** Called on the polling thread when the connection was put to the table **/
+    virtual void activate() {}
+    /** Called on the polling thread when the connection was removed from the
+        table (it is deleted on another thread, so timers of the polling
+        thread must be cancelled here) **/
+    virtual void deactivate() {}
+    /** Called on the polling thread when a watched descriptor has events
+        (indexes 0 and 1 are the channels) **/
+    virtual void notify(unsigned index) { getChannel(index).notify(); }
     
 private:
+    /** Coroutine running a dissector for one direction **/
+    class Dissector : public Coroutine {
+    public:
+        Dissector(Connection &connection, bool incoming) :
+            connection(connection), incoming(incoming) {}
+        
+    private:
+        Connection &connection;
+        bool incoming;
+        void run() { connection._threadFunc(incoming); }
+    };
+    
     Sniffer &sniffer;
-    static unsigned maxInstanceId;
+    static std::atomic<unsigned> maxInstanceId;
     unsigned instanceId;
     /** Protocol handler instance **/
     Protocol * protocol;
-    /** Mutex for synchronization of access to output log **/
-    static std::mutex logMutex;
-    /** Thread for interception outgoing data **/
-    std::thread c2sThread;
-    /** Thread for interception incoming data **/
-    std::thread s2cThread;
+    /** Dissector of outgoing data **/
+    Dissector c2sDissector;
+    /** Dissector of incoming data **/
+    Dissector s2cDissector;
+    /** Directions which have new data (bit 0 outgoing, bit 1 incoming) **/
+    std::atomic<unsigned> pendingDirections;
+    /** Position in the connection table of the sniffer **/
+    ConnectionTable::Handle handle;
     
     /** Private thread function **/
-    void _threadFunc(Sniffer &sniffer, bool incoming);
+    void _threadFunc(bool incoming);
+    /** Resume dissectors which have data to process **/
+    bool run();
+    /** Hand the finished connection over to the sniffer for deletion **/
+    void done();
+    /** Wake up dissector of specified direction **/
+    void wake(bool incoming);
+    friend class Channel;
+    friend class Sniffer;
+};
+
+/** Timer of the polling thread which calls a function **/
+class Timeout : public TimerWheel::Timer {
+public:
+    explicit Timeout(std::function<void()> function) : function(function) {}
+    
+private:
+    std::function<void()> function;
+    void expired() { function(); }
 };
 
 /** Object for controlling life cycle of sniffed connections **/
 class Sniffer {
 public:
+    /** Reference to connection which can be checked after it is deleted **/
+    typedef ConnectionTable::Handle Handle;
     /**/
-    Sniffer(const Plugin &plugin, const OptionsImpl &options, std::ostream &output);
+    Sniffer(const Plugin &plugin, const OptionsImpl &options, LogWriter &log,
+        const Configuration &configuration=Configuration());
     /**/
     ~Sniffer();
-    /** Returns stream where sniffers should write to **/
-    std::ostream &getStream() const { return output; }
+    /** Returns log where sniffers should write to **/
+    LogWriter &getLog() const { return log; }
+    /** Returns the protocol plugin **/
+    const Plugin &getPlugin() const { return plugin; }
+    /** Returns run-time settings **/
+    const Configuration &getConfiguration() const { return configuration; }
+    /** Returns pool running the dissectors **/
+    WorkerPool &getPool() { return pool; }
+    /** Returns host name resolver **/
+    Resolver &getResolver() { return resolver; }
     /** Create protocol plugin instance **/
     Protocol * newProtocol() const { return plugin.factory(options); }
     /** Add a new connection **/
     template <class T, class... A>
-    void add(A... args) {
-        Connection * connection=new T(*this, args...);
+    T * add(A... args) {
+        T * connection=new T(*this, args...);
         add(connection);
+        return connection;
     }
+    /** Watch descriptor of connection, events are passed to
+        Connection::notify() with specified index (polling thread only) **/
+    void watch(Connection &connection, unsigned index, int fd, uint32_t events);
+    /** Change events or index of a watched descriptor (polling thread only) **/
+    void rewatch(Connection &connection, unsigned index, int fd, uint32_t events);
+    /** Stop watching descriptor (polling thread only) **/
+    void unwatch(int fd);
+    /** Fire timer after specified number of milliseconds, scheduling it
+        again moves the deadline (polling thread only) **/
+    void setTimer(TimerWheel::Timer &timer, unsigned milliseconds);
+    /** Returns milliseconds since the sniffer was created, as of the last
+        wakeup of the polling thread **/
+    uint64_t getTime() const { return time.load(std::memory_order_relaxed); }
+    /** Returns handle of a connection which is in the table **/
+    Handle getHandle(const Connection &connection) const {
+        return connection.handle;
+    }
+    /** Run function on the polling thread unless the connection is deleted
+        before, may be called from any thread. Returns false if the polling
+        thread has stopped, the function is not run then. **/
+    bool post(const Handle &connection, std::function<void()> function);
+    /** Run function on the polling thread, may be called from any thread
+        (returns false if it has stopped) **/
+    bool post(std::function<void()> function);
     
 private:
+    /** Interval of rechecking paused channels in milliseconds **/
+    static const unsigned THROTTLE_INTERVAL=50;
     typedef Connection * ConnectionPtr;
+    typedef std::chrono::steady_clock Clock;
+    /** Function posted to the polling thread **/
+    struct Message {
+        Handle connection;
+        std::function<void()> function;
+    };
     const Plugin &plugin;
     OptionsImpl options;
-    std::ostream &output;
-    bool alive;
+    LogWriter &log;
+    Configuration configuration;
+    WorkerPool pool;
+    std::atomic<bool> alive;
+    /** The polling thread takes posted functions (protected by gcMutex) **/
+    bool polling;
+    /** epoll instance watching all channels **/
+    int epoll;
+    /** eventfd used to wake up the polling thread **/
+    int wakeup;
+    /** Protects the lists of new and finished connections **/
     std::mutex gcMutex;
+    /** Connections added since the last wakeup **/
+    std::vector<ConnectionPtr> pending;
+    /** Connections whose dissectors have finished **/
+    std::vector<ConnectionPtr> retired;
+    /** Functions posted to the polling thread **/
+    std::vector<Message> messages;
+    /** Timers of connections in milliseconds (polling thread only) **/
+    TimerWheel timers;
+    /** Zero of getTime() **/
+    Clock::time_point epoch;
+    /** Time of the last wakeup of the polling thread **/
+    std::atomic<uint64_t> time;
+    /** Connections with channels paused by capture memory limits, which may
+        be freed by any connection (polling thread only) **/
+    std::vector<Handle> throttled;
+    /** Rechecks paused channels while there are any **/
+    Timeout throttleTimer;
+    /** Notified when a connection is retired **/
+    Event retiredEvent;
+    /** Connections owned by the polling thread **/
+    ConnectionTable connections;
     std::thread pollThread;
-    std::vector<ConnectionPtr> connections;
+    /** Protects the list of connections to be deleted **/
+    std::mutex reaperMutex;
+    /** Connections removed from the table, waiting for deletion **/
+    std::vector<ConnectionPtr> doomed;
+    /** Notified when connections are doomed and at shutdown **/
+    Event reaperEvent;
+    /** Deletes connections, so that closing them never delays polling **/
+    std::thread reaperThread;
+    Resolver resolver;
     
     Sniffer(const Sniffer &)=delete;
     Sniffer &operator =(const Sniffer &)=delete;
     /** Called by sniffer to inform that it was created **/
     void add(Connection * connection);
+    /** Wake up the polling thread **/
+    void wake();
+    /** Put pending connections to the table and start watching them **/
+    void watchPending();
+    /** Called by connection when its dissectors have finished **/
+    void retire(Connection * connection);
+    /** Remove retired connections from the table and pass them to the
+        reaper thread **/
+    void collectRetired();
+    /** Returns connection if it still exists **/
+    Connection * find(const Handle &handle) const;
+    /** Run posted functions **/
+    void runMessages();
+    /** Take current time after a wakeup of the polling thread **/
+    uint64_t updateTime();
+    /** Run expired timers, returns milliseconds until the next one or -1 **/
+    int runTimers();
+    /** Recheck paused channels of connection until they are resumed
+        (polling thread only) **/
+    void throttle(Connection &connection);
+    /** Resume paused channels which fit into the limits again **/
+    void resumeThrottled();
     /** Polling thread worker **/
     void pollThreadFunc();
+    /** Reaper thread worker **/
+    void reaperThreadFunc();
+    friend class Channel;
+    friend class Connection;
 };
 
 #endif
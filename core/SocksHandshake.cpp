@@ -0,0 +1,194 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Incremental parser of SOCKS4/4a/5 handshakes
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include "SocksHandshake.hpp"
+
+using std::string;
+
+/** Find the end of a zero-terminated string, returns its length or -1 **/
+static ssize_t findStringZ(const uint8_t * data, size_t length) {
+    const void * end=memchr(data, 0, length);
+    return end?static_cast<const uint8_t *>(end)-data:-1;
+}
+
+/** Append word in network byte order **/
+static void appendWord(string &output, uint16_t value) {
+    output.push_back(char(value>>8));
+    output.push_back(char(value));
+}
+
+/** Append SOCKS4 reply (clients ignore the address) **/
+static void appendSocks4Reply(string &output, uint8_t status) {
+    static const char REPLY[8]={0};
+    output.append(REPLY, sizeof(REPLY));
+    output[output.size()-sizeof(REPLY)+1]=char(status);
+}
+
+/** Append SOCKS5 reply with bound address 127.0.0.1 **/
+static void appendSocks5Reply(string &output, uint8_t status, uint16_t port) {
+    static const char HEADER[]={5, 0, 0, 1, 127, 0, 0, 1};
+    output.append(HEADER, sizeof(HEADER));
+    output[output.size()-sizeof(HEADER)+1]=char(status);
+    appendWord(output, port);
+}
+
+/** Append successful SOCKS5 reply with specified bound address **/
+static void appendSocks5Reply(string &output, const struct sockaddr_storage &bound) {
+    output.append("\5\0\0", 3);
+    if (bound.ss_family==AF_INET6) {
+        const struct sockaddr_in6 &in6=reinterpret_cast<const struct sockaddr_in6 &>(bound);
+        output.push_back(4);
+        output.append(reinterpret_cast<const char *>(&in6.sin6_addr), 16);
+        appendWord(output, ntohs(in6.sin6_port));
+    }
+    else {
+        const struct sockaddr_in &in=reinterpret_cast<const struct sockaddr_in &>(bound);
+        output.push_back(1);
+        output.append(reinterpret_cast<const char *>(&in.sin_addr), 4);
+        appendWord(output, ntohs(in.sin_port));
+    }
+}
+
+/******************************************************************************/
+
+size_t SocksHandshake::parse(const uint8_t * data, size_t length, string &reply) {
+    if (length==0)
+        return 0;
+    if (state==GREETING) {
+        if (data[0]==4)
+            return parseSocks4(data, length, reply);
+        else if (data[0]==5)
+            return parseGreeting(data, length, reply);
+        fail("unsupported SOCKS version", 0, reply);
+        return length;
+    }
+    else if (state==REQUEST)
+        return parseRequest(data, length, reply);
+    return 0;
+}
+
+size_t SocksHandshake::parseSocks4(const uint8_t * data, size_t length, string &reply) {
+    // VN, CD, DSTPORT, DSTIP, USERID, NUL [, HOST, NUL]
+    if (length<8)
+        return 0;
+    ssize_t userLength=findStringZ(data+8, length-8);
+    if (userLength<0)
+        return 0;
+    size_t taken=8+userLength+1;
+    version=4;
+    command=data[1];
+    target.second=uint16_t(data[2]<<8|data[3]);
+
+    // SOCKS4a: address 0.0.0.x (x>0) means that the host name follows
+    if (!data[4]&&!data[5]&&!data[6]&&data[7]) {
+        ssize_t hostLength=findStringZ(data+taken, length-taken);
+        if (hostLength<0)
+            return 0;
+        target.first.assign(reinterpret_cast<const char *>(data+taken), hostLength);
+        taken+=hostLength+1;
+    }
+    else {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, data+4, address, sizeof(address));
+        target.first=address;
+    }
+
+    if (command!=CONNECT)
+        fail("unknown command", 0x5b, reply);
+    else
+        state=DONE;
+    return taken;
+}
+
+size_t SocksHandshake::parseGreeting(const uint8_t * data, size_t length, string &reply) {
+    // VER, NMETHODS, METHODS
+    if (length<2||length<2+size_t(data[1]))
+        return 0;
+    version=5;
+    uint8_t method=memchr(data+2, 0, data[1])?0x00:0xff;
+    reply.push_back(5);
+    reply.push_back(char(method));
+    if (method==0xff) {
+        state=FAILED;
+        problem="no acceptable authentication method";
+    }
+    else
+        state=REQUEST;
+    return 2+data[1];
+}
+
+size_t SocksHandshake::parseRequest(const uint8_t * data, size_t length, string &reply) {
+    // VER, CMD, RSV, ATYP, DST.ADDR, DST.PORT
+    if (length<5)
+        return 0;
+    size_t addressLength;
+    if (data[3]==1)
+        addressLength=4;
+    else if (data[3]==3)
+        addressLength=1+data[4];
+    else if (data[3]==4)
+        addressLength=16;
+    else {
+        fail("unknown address type", 0x08, reply);
+        return length;
+    }
+    size_t taken=4+addressLength+2;
+    if (length<taken)
+        return 0;
+
+    command=data[1];
+    if (data[3]==3)
+        target.first.assign(reinterpret_cast<const char *>(data+5), data[4]);
+    else {
+        char address[INET6_ADDRSTRLEN];
+        inet_ntop(data[3]==1?AF_INET:AF_INET6, data+4, address, sizeof(address));
+        target.first=address;
+    }
+    target.second=uint16_t(data[taken-2]<<8|data[taken-1]);
+
+    if (data[0]!=5)
+        fail("malformed request", 0x01, reply);
+    else if (command!=CONNECT&&command!=UDP_ASSOCIATE)
+        fail("unknown command", 0x07, reply);
+    else
+        state=DONE;
+    return taken;
+}
+
+void SocksHandshake::fail(const char * problem, uint8_t status, string &reply) {
+    state=FAILED;
+    this->problem=problem;
+    if (version==4)
+        appendSocks4Reply(reply, status);
+    else if (version==5)
+        appendSocks5Reply(reply, status, 0);
+}
+
+void SocksHandshake::finish(int error, string &reply,
+        const struct sockaddr_storage * bound) const {
+    if (version==4)
+        appendSocks4Reply(reply, error?0x5b:0x5a);
+    else if (version==5&&bound&&!error)
+        appendSocks5Reply(reply, *bound);
+    else if (version==5) {
+        uint8_t status;
+        if (!error)
+            status=0x00;
+        else if (error==ECONNREFUSED)
+            status=0x05;
+        else if (error==ENETUNREACH)
+            status=0x03;
+        else if (error==EHOSTUNREACH||error==ETIMEDOUT)
+            status=0x04;
+        else
+            status=0x01;
+        appendSocks5Reply(reply, status, target.second);
+    }
+}
@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Incremental parser of SOCKS4/4a/5 handshakes
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_SOCKSHANDSHAKE_HPP
+#define __CORE_SOCKSHANDSHAKE_HPP
+
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include "../sniffer.hpp"
+
+/** Parser of the client side of a SOCKS handshake. It does no I/O: it is
+    given everything the client has sent so far, tells how many bytes belong
+    to the handshake and what should be sent back. **/
+class SocksHandshake {
+public:
+    enum State {
+        /** Waiting for SOCKS5 method selection or SOCKS4 request **/
+        GREETING,
+        /** Waiting for SOCKS5 request **/
+        REQUEST,
+        /** Request was accepted, the reply is sent with the result **/
+        DONE,
+        /** Handshake was rejected, the client should be disconnected **/
+        FAILED
+    };
+    /** SOCKS commands **/
+    enum Command { CONNECT=1, BIND=2, UDP_ASSOCIATE=3 };
+    /** Longest handshake: SOCKS5 greeting followed by a request with
+        a host name **/
+    static const size_t MAX_LENGTH=2+255+7+255;
+
+    SocksHandshake() : state(GREETING), version(0), command(0), problem(nullptr) {}
+    /** Returns state of the handshake **/
+    State getState() const { return state; }
+    /** Returns SOCKS version used by the client (0 if not known yet) **/
+    uint8_t getVersion() const { return version; }
+    /** Returns requested command **/
+    uint8_t getCommand() const { return command; }
+    /** Returns requested destination **/
+    const HostAddress &getTarget() const { return target; }
+    /** Returns why the handshake failed **/
+    const char * getProblem() const { return problem; }
+    /** Parse the next message at the start of data. Returns number of bytes
+        taken (0 if the message is not complete yet) and appends bytes to
+        be sent to reply. **/
+    size_t parse(const uint8_t * data, size_t length, std::string &reply);
+    /** Append final reply with result of the request (errno value) and
+        the address where the proxy waits for the client's data **/
+    void finish(int error, std::string &reply,
+        const struct sockaddr_storage * bound=nullptr) const;
+
+private:
+    State state;
+    uint8_t version;
+    uint8_t command;
+    HostAddress target;
+    const char * problem;
+
+    size_t parseSocks4(const uint8_t * data, size_t length, std::string &reply);
+    size_t parseGreeting(const uint8_t * data, size_t length, std::string &reply);
+    size_t parseRequest(const uint8_t * data, size_t length, std::string &reply);
+    /** Reject the request with a reply of specified status **/
+    void fail(const char * problem, uint8_t status, std::string &reply);
+};
+
+#endif
@@ -0,0 +1,339 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Relay of SOCKS5 UDP associations
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+#include "Metrics.hpp"
+#include "SocksRelay.hpp"
+#include "../utils/Utils.hpp"
+
+using std::endl;
+
+/** Length of SOCKS UDP header with IPv6 address **/
+static const size_t MAX_HEADER=4+16+2;
+
+/** Returns whether both addresses have the same family and host **/
+static bool isSameHost(const struct sockaddr_storage &a, const struct sockaddr_storage &b) {
+    if (a.ss_family!=b.ss_family)
+        return false;
+    if (a.ss_family==AF_INET)
+        return reinterpret_cast<const struct sockaddr_in &>(a).sin_addr.s_addr==
+            reinterpret_cast<const struct sockaddr_in &>(b).sin_addr.s_addr;
+    return !memcmp(&reinterpret_cast<const struct sockaddr_in6 &>(a).sin6_addr,
+        &reinterpret_cast<const struct sockaddr_in6 &>(b).sin6_addr, 16);
+}
+
+/** Returns port of address (in network byte order) **/
+static uint16_t &getPort(struct sockaddr_storage &address) {
+    if (address.ss_family==AF_INET)
+        return reinterpret_cast<struct sockaddr_in &>(address).sin_port;
+    return reinterpret_cast<struct sockaddr_in6 &>(address).sin6_port;
+}
+
+/** Write SOCKS UDP header for datagram from source, returns its length **/
+static size_t formatHeader(uint8_t * header, struct sockaddr_storage &source) {
+    header[0]=header[1]=header[2]=0;
+    size_t length;
+    if (source.ss_family==AF_INET) {
+        header[3]=1;
+        memcpy(header+4, &reinterpret_cast<struct sockaddr_in &>(source).sin_addr, 4);
+        length=4+4;
+    }
+    else {
+        header[3]=4;
+        memcpy(header+4, &reinterpret_cast<struct sockaddr_in6 &>(source).sin6_addr, 16);
+        length=4+16;
+    }
+    memcpy(header+length, &getPort(source), 2);
+    return length+2;
+}
+
+/******************************************************************************/
+
+/** Create relay socket at the local address of control connection (IPv4
+    clients get an IPv4 relay, even if they came to an IPv6 listener) **/
+static int bindRelay(int control, struct sockaddr_storage &address) {
+    socklen_t length=sizeof(address);
+    memset(&address, 0, sizeof(address));
+    if (getsockname(control, reinterpret_cast<struct sockaddr *>(&address), &length)<0)
+        Error::raise("getting local address");
+    unmapAddress(address);
+    getPort(address)=0;
+    int fd=socket(address.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd<0)
+        Error::raise("creating relay socket");
+    length=sizeof(address);
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&address), getAddressLength(address))<0||
+            getsockname(fd, reinterpret_cast<struct sockaddr *>(&address), &length)<0) {
+        int error=errno;
+        close(fd);
+        throw Error("binding relay socket", error);
+    }
+    return fd;
+}
+
+/******************************************************************************/
+
+SocksRelay::SocksRelay(Sniffer &sniffer, int control, uint16_t clientPort) :
+        Connection(sniffer), control(control), client(bindRelay(control, address)),
+        dissect(sniffer.getPlugin().flags&Protocol::DATAGRAM), deferred(0) {
+    socklen_t length=sizeof(clientAddress);
+    if (getpeername(control, reinterpret_cast<struct sockaddr *>(&clientAddress), &length)<0)
+        Error::raise("getting client address");
+    unmapAddress(clientAddress);
+    getPort(clientAddress)=htons(clientPort);
+    Connection::start(sniffer);
+}
+
+SocksRelay::~SocksRelay() {
+    if (control>=0)
+        ::close(control);
+}
+
+void SocksRelay::activate() {
+    getSniffer().watch(*this, CONTROL, control, EPOLLIN|EPOLLRDHUP|EPOLLET);
+}
+
+void SocksRelay::notify(unsigned index) {
+    if (index==0) {
+        relay();
+        return;
+    }
+    else if (index!=CONTROL)
+        return;
+
+    // Nothing is expected on the control connection but its end
+    while (control>=0) {
+        char buffer[256];
+        ssize_t retval=::recv(control, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (retval==0||(retval<0&&errno!=EAGAIN&&errno!=EINTR))
+            close();
+        else if (retval<0&&errno==EAGAIN)
+            break;
+    }
+}
+
+bool SocksRelay::isFromClient(struct sockaddr_storage &source,
+        const uint8_t * data, size_t length) {
+    if (!isSameHost(source, clientAddress))
+        return false;
+    uint16_t &port=getPort(clientAddress);
+    if (!port) {
+        // The first datagram with a SOCKS header from the client's host tells
+        // its port (replies from servers on that host have no header)
+        if (length<4||data[0]||data[1]||data[2])
+            return false;
+        port=getPort(source);
+    }
+    return port==getPort(source);
+}
+
+size_t SocksRelay::parseHeader(const uint8_t * data, size_t length,
+        struct sockaddr_storage &destination) {
+    // RSV, FRAG, ATYP, DST.ADDR, DST.PORT (fragments are not supported)
+    if (length<5||data[0]||data[1]||data[2])
+        return 0;
+    memset(&destination, 0, sizeof(destination));
+    size_t header;
+    if (data[3]==1&&length>=4+4+2) {
+        struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(destination);
+        in.sin_family=AF_INET;
+        memcpy(&in.sin_addr, data+4, 4);
+        header=4+4;
+    }
+    else if (data[3]==4&&length>=4+16+2) {
+        struct sockaddr_in6 &in6=reinterpret_cast<struct sockaddr_in6 &>(destination);
+        in6.sin6_family=AF_INET6;
+        memcpy(&in6.sin6_addr, data+4, 16);
+        header=4+16;
+    }
+    else if (data[3]==3&&length>=4+1+size_t(data[4])+2) {
+        // Cached names are used right away. The answer of a new lookup comes
+        // on another thread, so the datagram waits for it in a copy.
+        std::string name(reinterpret_cast<const char *>(data+5), data[4]);
+        std::thread::id caller=std::this_thread::get_id();
+        sa_family_t family=address.ss_family;
+        bool cached=false;
+        getSniffer().getResolver().resolve(name,
+            [&destination, &cached, caller, family](const AddressList &addresses, int error) {
+                if (std::this_thread::get_id()!=caller)
+                    return;
+                cached=true;
+                for (auto i=addresses.begin(); i!=addresses.end(); ++i)
+                    if (i->ss_family==family) {
+                        destination=*i;
+                        break;
+                    }
+            });
+        header=4+1+data[4];
+        if (!cached) {
+            uint16_t port;
+            memcpy(&port, data+header, 2);
+            defer(name, port, data+header+2, length-header-2);
+            return 0;
+        }
+        if (destination.ss_family!=address.ss_family) {
+            Metrics::add(Metrics::UNRESOLVED_DATAGRAMS);
+            return 0;
+        }
+    }
+    else
+        return 0;
+
+    // The relay socket reaches only addresses of its own family
+    if (destination.ss_family!=address.ss_family)
+        return 0;
+    memcpy(&getPort(destination), data+header, 2);
+    return header+2;
+}
+
+void SocksRelay::defer(const std::string &name, uint16_t port,
+        const uint8_t * data, size_t length) {
+    if (deferred>=MAX_DEFERRED) {
+        Metrics::add(Metrics::UNRESOLVED_DATAGRAMS);
+        return;
+    }
+    deferred++;
+
+    // The answer may come on a resolver thread, so it is posted to the
+    // polling thread, where it is dropped if the association is gone
+    Sniffer &sniffer=getSniffer();
+    Sniffer::Handle handle=sniffer.getHandle(*this);
+    SocksRelay * self=this;
+    std::shared_ptr<std::vector<uint8_t>> payload=
+        std::make_shared<std::vector<uint8_t>>(data, data+length);
+    sniffer.getResolver().resolve(name,
+        [&sniffer, handle, self, port, payload](const AddressList &addresses, int error) {
+            sniffer.post(handle, [self, addresses, port, payload]() {
+                self->resolved(addresses, port, *payload);
+            });
+        });
+}
+
+void SocksRelay::resolved(const AddressList &addresses, uint16_t port,
+        const std::vector<uint8_t> &payload) {
+    deferred--;
+    if (!client.isAlive())
+        return;
+    sa_family_t family=address.ss_family;
+    auto found=std::find_if(addresses.begin(), addresses.end(),
+        [family](const struct sockaddr_storage &address) {
+            return address.ss_family==family;
+        });
+    if (found==addresses.end()) {
+        Metrics::add(Metrics::UNRESOLVED_DATAGRAMS);
+        return;
+    }
+    struct sockaddr_storage destination=*found;
+    getPort(destination)=port;
+    ::sendto(client.getDescriptor(), payload.data(), payload.size(), MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr *>(&destination), getAddressLength(destination));
+    if (dissect)
+        client.push(payload.data(), payload.size());
+    else
+        client.account(payload.size());
+}
+
+void SocksRelay::relay() {
+    // The polling thread reuses one batch for all associations
+    static thread_local DatagramBatch batch;
+    struct mmsghdr messages[DatagramBatch::SIZE];
+    struct iovec iov[DatagramBatch::SIZE][2];
+    struct sockaddr_storage destinations[DatagramBatch::SIZE];
+    uint8_t headers[DatagramBatch::SIZE][MAX_HEADER];
+
+    while (client.isAlive()) {
+        int fd=client.getDescriptor();
+        batch.prepare();
+        int count=recvmmsg(fd, batch.messages, DatagramBatch::SIZE, MSG_DONTWAIT, nullptr);
+        if (count<0) {
+            // ICMP errors of earlier datagrams do not end the association
+            if (errno==ECONNREFUSED)
+                continue;
+            if (errno!=EAGAIN&&errno!=EINTR)
+                error() << "receiving datagrams: " << strerror(errno) << endl;
+            break;
+        }
+
+        // Headers are stripped and added with I/O vectors, payloads stay
+        // where they were received
+        unsigned n=0;
+        for (int i=0; i<count; i++) {
+            uint8_t * data=static_cast<uint8_t *>(batch.iov[i].iov_base);
+            size_t length=batch.messages[i].msg_len;
+            struct msghdr &message=messages[n].msg_hdr;
+            memset(&messages[n], 0, sizeof(messages[n]));
+            message.msg_iov=iov[n];
+            if (isFromClient(batch.addresses[i], data, length)) {
+                size_t header=parseHeader(data, length, destinations[n]);
+                if (!header)
+                    continue;
+                iov[n][0].iov_base=data+header;
+                iov[n][0].iov_len=length-header;
+                message.msg_iovlen=1;
+                message.msg_name=&destinations[n];
+                message.msg_namelen=getAddressLength(destinations[n]);
+                if (dissect)
+                    client.push(data+header, length-header);
+                else
+                    client.account(length-header);
+            }
+            else {
+                // Until the client tells its port, replies have nowhere to go
+                if (!getPort(clientAddress))
+                    continue;
+                iov[n][0].iov_base=headers[n];
+                iov[n][0].iov_len=formatHeader(headers[n], batch.addresses[i]);
+                iov[n][1].iov_base=data;
+                iov[n][1].iov_len=length;
+                message.msg_iovlen=2;
+                message.msg_name=&clientAddress;
+                message.msg_namelen=getAddressLength(clientAddress);
+                if (dissect)
+                    server.push(data, length);
+                else
+                    server.account(length);
+            }
+            n++;
+        }
+
+        // A datagram which fails (e.g. to an unreachable network) does not
+        // take the rest of the batch with it
+        sendDatagrams(fd, messages, n);
+        if (count<int(DatagramBatch::SIZE))
+            break;
+    }
+}
+
+void SocksRelay::close() {
+    if (control>=0) {
+        ::close(control);
+        control=-1;
+    }
+    client.close();
+    server.close();
+}
+
+void SocksRelay::threadFunc(bool incoming) {
+    DatagramChannel &channel=incoming?server:client;
+    while (channel.next()) {
+        try {
+            dump(incoming, channel);
+        }
+        catch (Reader::End) {
+            // The plugin wanted more than the datagram contains
+        }
+    }
+}
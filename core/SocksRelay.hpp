@@ -0,0 +1,76 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Relay of SOCKS5 UDP associations
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_SOCKSRELAY_HPP
+#define __CORE_SOCKSRELAY_HPP
+
+#include <string>
+#include <vector>
+#include "DatagramConnection.hpp"
+
+/** UDP relay of one SOCKS5 association. Datagrams from the client start with
+    a SOCKS header naming the destination, which is stripped before they are
+    sent on; replies get a header with their source. The association ends
+    when the client closes its control connection. **/
+class SocksRelay : public Connection {
+public:
+    /** Bind relay socket at the local address of the control connection.
+        The client will send from its address and specified port (0 if not
+        known yet). Takes over the control socket. **/
+    SocksRelay(Sniffer &sniffer, int control, uint16_t clientPort);
+    ~SocksRelay();
+    Channel &getChannel(bool incoming) { return incoming?server:client; }
+    /** Returns address of the relay socket **/
+    const struct sockaddr_storage &getAddress() const { return address; }
+
+private:
+    /** Index of the control connection in events **/
+    static const unsigned CONTROL=2;
+    /** Most datagrams waiting for names to be resolved **/
+    static const unsigned MAX_DEFERRED=64;
+    /** Control connection of the client **/
+    int control;
+    /** Address of the relay socket **/
+    struct sockaddr_storage address;
+    /** Address of the client (the port is 0 until it is known) **/
+    struct sockaddr_storage clientAddress;
+    /** Datagrams sent by the client (owns the relay socket) **/
+    DatagramChannel client;
+    /** Datagrams sent to the client **/
+    DatagramChannel server;
+    /** The plugin dissects datagrams **/
+    bool dissect;
+    /** Number of datagrams waiting for names to be resolved (polling thread
+        only) **/
+    unsigned deferred;
+
+    /** Start watching the control connection **/
+    void activate();
+    void notify(unsigned index);
+    /** Forward datagrams which arrived to the relay socket (replies are
+        dropped until the port of the client is known) **/
+    void relay();
+    /** Returns whether datagram comes from the client **/
+    bool isFromClient(struct sockaddr_storage &source, const uint8_t * data,
+        size_t length);
+    /** Find destination in SOCKS header, returns length of the header (0 if
+        the datagram should be dropped) **/
+    size_t parseHeader(const uint8_t * data, size_t length,
+        struct sockaddr_storage &destination);
+    /** Keep a copy of datagram to a name which is not cached and send it
+        when the name is resolved (port in network byte order) **/
+    void defer(const std::string &name, uint16_t port, const uint8_t * data,
+        size_t length);
+    /** Send datagram kept by defer() (polling thread) **/
+    void resolved(const AddressList &addresses, uint16_t port,
+        const std::vector<uint8_t> &payload);
+    /** End the association **/
+    void close();
+    void threadFunc(bool incoming);
+};
+
+#endif
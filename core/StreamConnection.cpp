@@ -5,86 +5,321 @@
  *  © 2013—2021, Sauron
  ******************************************************************************/
 
+#include <cerrno>
 #include <cstdio>
+#include <algorithm>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
-#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include "Metrics.hpp"
+#include "SocksRelay.hpp"
 #include "StreamConnection.hpp"
+#include "UpstreamPool.hpp"
+#include "../utils/Utils.hpp"
 
 using std::cerr;
 using std::endl;
 using std::ostream;
 
-#define BUFFER_SIZE 4096
+/******************************************************************************/
+
+/** Queued bytes above which the source is not read until the destination
+    takes them **/
+static const size_t HIGH_WATER=1<<18;
+/** Maximum number of chunks written with one writev() **/
+static const size_t MAX_IOV=64;
 
-// TODO: move to Utils.hpp
-namespace posix {
-    ssize_t read(int fd, void * buffer, size_t length);
-    ssize_t write(int fd, const void * buffer, size_t length);
+/** Create a pipe which does not block on either end **/
+static void createPipe(int fds[2]) {
+    if (pipe2(fds, O_NONBLOCK|O_CLOEXEC)<0)
+        Error::raise("creating pipe");
 }
 
-/******************************************************************************/
+/** Close both ends of a pipe **/
+static void closePipe(int fds[2]) {
+    for (unsigned i=0; i<2; i++)
+        if (fds[i]>=0) {
+            ::close(fds[i]);
+            fds[i]=-1;
+        }
+}
 
-StreamReader::StreamReader(int fd, StreamReader &destination) : fd(fd), destination(destination) {}
+StreamReader::StreamReader(int fd, StreamReader &destination) : fd(fd),
+        destination(destination), window(0), closed(false), paused(false),
+        outboundLength(0), sentBytes(0), ended(false), capture(nullptr), flow(nullptr) {
+    forwardPipe[0]=forwardPipe[1]=capturePipe[0]=capturePipe[1]=-1;
+}
 
 StreamReader::~StreamReader() {
     close();
-    cv.notify_all();
 }
 
 void StreamReader::notify() {
-    if (isAlive()) {
+    // Both readiness events of the socket arrive here
+    destination.drain();
+    receive();
+}
+
+void StreamReader::receive() {
+    if (paused||ended)
+        return;
+    if (forwardPipe[0]>=0) {
+        splice();
+        return;
+    }
+    
+    // The descriptor is watched in edge-triggered mode, so drain it completely
+    // (unless the dissector or the destination has to catch up first), end of
+    // stream with data still queued leaves the descriptor open until flushed
+    while (isAlive()&&!ended&&!isThrottled()&&!isBacklogged()) {
         try {
-            char tempBuffer[BUFFER_SIZE];
-            auto retval=posix::read(fd, tempBuffer, sizeof(tempBuffer));
+            // Receive straight into the capture chunk and forward from there
+            size_t length;
+            uint8_t * data=buffer.reserve(length);
+            auto retval=posix::recv(fd, data, length);
             if (retval>0) {
-                {
-                    std::unique_lock<std::mutex> lock(mutex);
-                    buffer.append(tempBuffer, retval);
-                }
-                posix::write(destination.getDescriptor(), tempBuffer, retval);
+                uint64_t arrived=Latency::now();
+                account(retval);
+                received(data, retval, arrived);
+                forward(data, retval, arrived);
             }
+            else if (retval==0)
+                finish();
             else
-                close();
+                break;
         }
         catch (const Error &error) {
             cerr << "error: " << error << endl;
             close();
         }
     }
-    cv.notify_all();
 }
 
-size_t StreamReader::read(void * destination, size_t length) {
-    size_t result=0;
-    if (length>0) {
-        std::unique_lock<std::mutex> lock(mutex);
-        if (buffer.length()<length) {
+void StreamReader::resume() {
+    paused=false;
+    receive();
+}
+
+void StreamReader::forward(const uint8_t * data, size_t length, uint64_t arrived) {
+    // Queued data goes first, otherwise try to write directly
+    if (!outboundLength) {
+        ssize_t retval=::write(destination.getDescriptor(), data, length);
+        if (retval<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR)
+            Error::raise("writing to network");
+        if (retval>0) {
+            data+=retval;
+            length-=retval;
+            sentBytes+=retval;
+        }
+        if (!length) {
+            Latency::record(isIncoming()?Latency::FORWARD_INCOMING:
+                Latency::FORWARD_OUTGOING, arrived);
+            return;
+        }
+    }
+    departures.push_back(std::make_pair(sentBytes+outboundLength+length, arrived));
+    
+    // The rest is written when EPOLLOUT arrives
+    outboundLength+=length;
+    while (length) {
+        size_t space;
+        uint8_t * tail=outbound.reserve(space, 1);
+        if (space>length)
+            space=length;
+        memcpy(tail, data, space);
+        outbound.commit(space);
+        data+=space;
+        length-=space;
+    }
+}
+
+void StreamReader::flush() {
+    int fd=destination.getDescriptor();
+    while (outboundLength&&fd>=0) {
+        ssize_t retval;
+        if (forwardPipe[0]>=0)
+            retval=::splice(forwardPipe[0], nullptr, fd, nullptr, outboundLength,
+                SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        else {
+            // Chunks are coalesced into one system call
+            struct iovec iov[MAX_IOV];
+            retval=::writev(fd, iov, int(outbound.gather(iov, MAX_IOV)));
+        }
+        if (retval<0&&errno==EINTR)
+            continue;
+        else if (retval<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK) {
+            cerr << "error: " << Error("writing to network", errno) << endl;
+            close();
+            return;
+        }
+        else if (retval<=0)
+            return;
+        if (forwardPipe[0]<0)
+            outbound.skip(retval);
+        outboundLength-=retval;
+        sentBytes+=retval;
+        if (!departures.empty()&&departures.front().first<=sentBytes) {
+            uint64_t now=Latency::now();
+            Latency::Kind kind=isIncoming()?Latency::FORWARD_INCOMING:
+                Latency::FORWARD_OUTGOING;
             do {
-                cv.wait(lock);
-            } while (isAlive()&&(buffer.length()==0));
-        }
-        if (isAlive()) {
-            if (buffer.length()<=length) {
-                memcpy(destination, buffer.data(), buffer.length());
-                result=buffer.length();
-                buffer.clear();
+                Latency::record(kind, departures.front().second, now);
+                departures.pop_front();
+            } while (!departures.empty()&&departures.front().first<=sentBytes);
+        }
+    }
+    if (ended&&!outboundLength)
+        close();
+}
+
+void StreamReader::drain() {
+    if (!outboundLength)
+        return;
+    bool backlogged=isBacklogged();
+    flush();
+    if (backlogged&&!isBacklogged())
+        receive();
+}
+
+bool StreamReader::isBacklogged() const {
+    // The forwarding pipe must be empty before more is read, as tee() copies
+    // from its start
+    return forwardPipe[0]>=0?outboundLength>0:outboundLength>HIGH_WATER;
+}
+
+void StreamReader::finish() {
+    if (outboundLength)
+        ended=true;
+    else
+        close();
+}
+
+void StreamReader::enableZeroCopy() {
+    try {
+        createPipe(forwardPipe);
+        createPipe(capturePipe);
+    }
+    catch (...) {
+        closePipe(forwardPipe);
+        closePipe(capturePipe);
+        throw;
+    }
+}
+
+void StreamReader::enableCapture(PacketCapture &capture, Flow &flow) {
+    this->capture=&capture;
+    this->flow=&flow;
+}
+
+void StreamReader::received(const uint8_t * data, size_t length, uint64_t arrived) {
+    if (capture)
+        // The reserved space is reused, so the dissector never sees the data
+        capture->record(*flow, isIncoming(), data, length);
+    else if (admit(length)) {
+        buffer.commit(length, arrived);
+        wakeDissector();
+    }
+}
+
+void StreamReader::splice() {
+    // The descriptor is watched in edge-triggered mode, so drain it completely
+    while (isAlive()&&!isThrottled()&&!isBacklogged()) {
+        try {
+            ssize_t retval=::splice(fd, nullptr, forwardPipe[1], nullptr,
+                1<<16, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if (retval<0) {
+                if (errno==EAGAIN)
+                    break;
+                Error::raise("reading from network");
+            }
+            else if (retval==0) {
+                finish();
+                break;
             }
-            else {
-                memcpy(destination, buffer.data(), length);
-                buffer.erase(0, length);
-                result=length;
+            
+            uint64_t arrived=Latency::now();
+            account(retval);
+            
+            // Duplicate pipe contents for the dissector before they are moved
+            ssize_t captured=tee(forwardPipe[0], capturePipe[1], retval,
+                SPLICE_F_NONBLOCK);
+            if (captured<0)
+                Error::raise("duplicating data");
+            
+            // What destination cannot take stays in the pipe until EPOLLOUT
+            outboundLength=retval;
+            departures.push_back(std::make_pair(sentBytes+retval, arrived));
+            flush();
+            
+            // The dissector still gets its own copy in user space
+            while (captured>0) {
+                size_t length;
+                uint8_t * data=buffer.reserve(length);
+                ssize_t nRead=::read(capturePipe[0], data,
+                    std::min(length, size_t(captured)));
+                if (nRead<=0)
+                    break;
+                received(data, nRead, arrived);
+                captured-=nRead;
+            }
+        }
+        catch (const Error &error) {
+            cerr << "error: " << error << endl;
+            close();
+        }
+    }
+}
+
+size_t StreamReader::read(void * destination, size_t length) {
+    if (head==tail&&!refill())
+        return 0;
+    if (length>size_t(tail-head))
+        length=tail-head;
+    memcpy(destination, head, length);
+    head+=length;
+    return length;
+}
+
+bool StreamReader::underflow() {
+    buffer.consume(window);
+    taken(window);
+    window=0;
+    while (true) {
+        const uint8_t * data;
+        size_t length=buffer.peek(data);
+        if (length==0) {
+            if (!closed&&!isTruncated()) {
+                // Give the worker back until the poll thread has more data
+                Coroutine::current()->yield();
+                continue;
             }
+            length=buffer.peek(data);
+            if (length==0)
+                return false;
         }
+        head=data;
+        tail=data+length;
+        window=length;
+        setArrival(buffer.getStamp());
+        return true;
     }
-    return result;
 }
 
 void StreamReader::close() {
-    if (fd>=0) {
-        ::close(fd);
-        fd=-1;
+    // The server side may be closed before it was ever connected
+    if (!closed.exchange(true)) {
+        if (fd>=0) {
+            ::close(fd);
+            fd=-1;
+        }
+        closePipe(forwardPipe);
+        closePipe(capturePipe);
+        if (capture)
+            capture->close(*flow, isIncoming());
+        wakeDissector();
         destination.close();
     }
 }
@@ -93,43 +328,234 @@ void StreamReader::close() {
 
 StreamConnection::StreamConnection(Sniffer &sniffer, int clientfd,
         HostAddress remote) : Connection(sniffer), client(clientfd, server),
-        server(initialize(remote), client) {
-    start(sniffer);
+        server(-1, client), connector(sniffer, *this, CONNECTOR),
+        remote(remote), started(0), accepted(Latency::now()),
+        handshakeTimer([this]() { handshakeExpired(); }),
+        idleTimer([this]() { idleExpired(); }),
+        lifetimeTimer([this]() { lifetimeExpired(); }) {
+    client.pause();
+    Connection::start(sniffer);
 }
 
 StreamConnection::StreamConnection(Sniffer &sniffer, int clientfd) :
-        Connection(sniffer), client(clientfd, server),
-        server(acceptSocksConnection(clientfd), client) {
-    start(sniffer);
+        Connection(sniffer), client(clientfd, server), server(-1, client),
+        connector(sniffer, *this, CONNECTOR), socks(new SocksHandshake),
+        started(0), accepted(Latency::now()),
+        handshakeTimer([this]() { handshakeExpired(); }),
+        idleTimer([this]() { idleExpired(); }),
+        lifetimeTimer([this]() { lifetimeExpired(); }) {
+    // The client sends the handshake first, the reader waits for its end
+    client.pause();
+    Connection::start(sniffer);
 }
 
 StreamConnection::~StreamConnection() {}
 
-int StreamConnection::initialize(HostAddress remote) {
-    // Get server network address
-    char service[16];
-    sprintf(service, "%d", remote.second);
-    struct addrinfo hints, * ai;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family=AF_INET; /* IPv4 only */
-    hints.ai_socktype=SOCK_STREAM; /* TCP */
-    int ret=getaddrinfo(remote.first.c_str(), service, &hints, &ai);
-    if (ret!=0)
-        throw Error("connecting", EHOSTUNREACH);
+void StreamConnection::activate() {
+    Sniffer &sniffer=getSniffer();
+    const Configuration &configuration=sniffer.getConfiguration();
+    started=sniffer.getTime();
+    if (configuration.idleTimeout)
+        sniffer.setTimer(idleTimer, configuration.idleTimeout*1000);
+    if (configuration.maxLifetime)
+        sniffer.setTimer(lifetimeTimer, configuration.maxLifetime*1000);
+    if (socks) {
+        sniffer.setTimer(handshakeTimer, configuration.handshakeTimeout);
+        negotiate();
+        return;
+    }
     
-    // Connect to server
-    error() << "connecting to " << remote.first << ':' << remote.second << "…" << endl;
-    int result=socket(AF_INET, SOCK_STREAM, 0);
-    if (result<0)
-        Error::raise("creating socket");
-    if (connect(result, ai->ai_addr, ai->ai_addrlen)<0)
-        Error::raise("connecting to host");
-    freeaddrinfo(ai);
+    // The pool is connected to the --tcp-server host only
+    UpstreamPool * upstream=configuration.upstream;
+    if (upstream) {
+        int fd=upstream->acquire();
+        if (fd>=0) {
+            connected(fd, 0);
+            return;
+        }
+    }
+    connect();
+}
+
+void StreamConnection::connect() {
+    connector.connect(remote, [this](int fd, int error) { connected(fd, error); });
+}
+
+void StreamConnection::notify(unsigned index) {
+    if (index==CONNECTOR)
+        connector.notify();
+    else if (index==0&&socks&&socks->getState()<SocksHandshake::DONE)
+        negotiate();
+    else
+        Connection::notify(index);
+}
+
+void StreamConnection::deactivate() {
+    handshakeTimer.cancel();
+    idleTimer.cancel();
+    lifetimeTimer.cancel();
+    connector.abort();
+}
+
+void StreamConnection::handshakeExpired() {
+    if (socks->getState()<SocksHandshake::DONE) {
+        error() << "SOCKS handshake timed out" << endl;
+        client.close();
+    }
+}
+
+void StreamConnection::idleExpired() {
+    // Activity only moves the deadline, the timer is not touched per read
+    Sniffer &sniffer=getSniffer();
+    uint64_t active=std::max(started,
+        std::max(client.getLastActive(), server.getLastActive()));
+    uint64_t deadline=active+uint64_t(sniffer.getConfiguration().idleTimeout)*1000;
+    if (deadline>sniffer.getTime()) {
+        sniffer.setTimer(idleTimer, unsigned(deadline-sniffer.getTime()));
+        return;
+    }
+    error() << "idle for " << sniffer.getConfiguration().idleTimeout
+        << " s, closing" << endl;
+    client.close();
+}
+
+void StreamConnection::lifetimeExpired() {
+    error() << "session lifetime of " << getSniffer().getConfiguration().maxLifetime
+        << " s exceeded, closing" << endl;
+    client.close();
+}
+
+void StreamConnection::negotiate() {
+    // Data is only peeked, so that bytes sent after the handshake are
+    // left for the reader
+    uint8_t buffer[SocksHandshake::MAX_LENGTH];
+    int fd=client.getDescriptor();
+    ssize_t length=::recv(fd, buffer, sizeof(buffer), MSG_PEEK|MSG_DONTWAIT);
+    if (length<0&&(errno==EAGAIN||errno==EWOULDBLOCK||errno==EINTR))
+        return;
+    if (length<=0) {
+        // The client gave up before the handshake was finished
+        client.close();
+        return;
+    }
+    
+    // Messages which have arrived together are answered together
+    std::string reply;
+    size_t taken=0;
+    while (socks->getState()<SocksHandshake::DONE) {
+        size_t count=socks->parse(buffer+taken, length-taken, reply);
+        if (!count)
+            break;
+        taken+=count;
+    }
     
-    return result;
+    try {
+        if (taken)
+            posix::recv(fd, buffer, taken);
+        if (!reply.empty())
+            posix::write(fd, reply.data(), reply.size());
+    }
+    catch (const Error &e) {
+        error() << "SOCKSv" << int(socks->getVersion()) << ": " << e << endl;
+        client.close();
+        return;
+    }
+    
+    if (socks->getState()>=SocksHandshake::DONE)
+        handshakeTimer.cancel();
+    if (socks->getState()==SocksHandshake::DONE)
+        Latency::record(Latency::HANDSHAKE, accepted);
+    if (socks->getState()==SocksHandshake::FAILED) {
+        error() << "SOCKSv" << int(socks->getVersion()) << ": "
+            << socks->getProblem() << endl;
+        client.close();
+    }
+    else if (socks->getState()==SocksHandshake::DONE) {
+        if (socks->getCommand()==SocksHandshake::UDP_ASSOCIATE)
+            associate();
+        else {
+            // The reply is sent when the server is connected
+            remote=socks->getTarget();
+            connect();
+        }
+    }
+    else if (size_t(length)==sizeof(buffer)) {
+        error() << "SOCKS handshake is too long" << endl;
+        client.close();
+    }
+}
+
+void StreamConnection::associate() {
+    int fd=client.getDescriptor();
+    std::string reply;
+    try {
+        // The relay watches the client socket from now on
+        getSniffer().unwatch(fd);
+        SocksRelay * relay=getSniffer().add<SocksRelay>(fd, socks->getTarget().second);
+        client.release();
+        socks->finish(0, reply, &relay->getAddress());
+    }
+    catch (const Error &e) {
+        error() << "SOCKSv5: " << e << endl;
+        socks->finish(e.getErrno(), reply);
+    }
+    ::send(fd, reply.data(), reply.size(), MSG_DONTWAIT|MSG_NOSIGNAL);
+    client.close();
+}
+
+void StreamConnection::replySocks(int error) {
+    if (socks) {
+        std::string reply;
+        socks->finish(error, reply);
+        posix::write(client.getDescriptor(), reply.data(), reply.size());
+    }
+}
+
+void StreamConnection::connected(int fd, int error) {
+    if (fd<0) {
+        this->error() << "connecting to " << remote.first << ':' << remote.second
+            << ": " << strerror(error) << endl;
+        try {
+            replySocks(error);
+        }
+        catch (const Error &) {}
+        client.close();
+        return;
+    }
+    if (!client.isAlive()) {
+        // The client gave up while the server was being connected
+        ::close(fd);
+        return;
+    }
+    
+    try {
+        server.setDescriptor(fd);
+        const Configuration &configuration=getSniffer().getConfiguration();
+        if (configuration.zeroCopy) {
+            client.enableZeroCopy();
+            server.enableZeroCopy();
+        }
+        if (configuration.capture) {
+            flow.initialize(getInstanceId(), client.getDescriptor(), fd);
+            configuration.capture->open(flow);
+            client.enableCapture(*configuration.capture, flow);
+            server.enableCapture(*configuration.capture, flow);
+        }
+        // Both sockets are written without blocking, EPOLLOUT resumes
+        // writing of queued data
+        getSniffer().rewatch(*this, 0, client.getDescriptor(),
+            EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET);
+        getSniffer().watch(*this, 1, fd, EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET);
+        replySocks(0);
+        client.resume();
+    }
+    catch (const Error &e) {
+        this->error() << e << endl;
+        client.close();
+    }
 }
 
-void StreamConnection::threadFunc(ostream &log, bool incoming) {
+void StreamConnection::threadFunc(bool incoming) {
     while (true)
-        dump(log, incoming, incoming?server:client);
+        dump(incoming, incoming?server:client);
 }
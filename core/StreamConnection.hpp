@@ -8,7 +8,14 @@
 #ifndef __CORE_STREAMCONNECTION_HPP
 #define __CORE_STREAMCONNECTION_HPP
 
+#include <deque>
+#include <memory>
+#include <utility>
+#include "Connector.hpp"
+#include "PacketCapture.hpp"
 #include "Sniffer.hpp"
+#include "SocksHandshake.hpp"
+#include "../utils/ChunkQueue.hpp"
 
 class StreamReader : public Reader, public Channel {
 public:
@@ -17,19 +24,83 @@ public:
     ~StreamReader();
     bool isAlive() const { return fd>=0; }
     int getDescriptor() const { return fd; }
+    /** Set socket after it was connected **/
+    void setDescriptor(int fd) { this->fd=fd; }
+    /** Give up socket without closing it **/
+    int release() {
+        int result=fd;
+        fd=-1;
+        return result;
+    }
+    /** Write data queued by the other direction to the descriptor and read
+        from it **/
     void notify();
+    /** Stop reading until resume() is called (polling thread only) **/
+    void pause() { paused=true; }
+    /** Read data which arrived while paused (polling thread only) **/
+    void resume();
+    /** Forward data with splice() and capture it with tee() **/
+    void enableZeroCopy();
+    /** Write received data to capture file instead of the dissector **/
+    void enableCapture(PacketCapture &capture, Flow &flow);
+    /** Close both directions and wake up the dissector **/
+    void close();
     
 private:
     StreamReader(const StreamReader &)=delete;
     StreamReader &operator =(const StreamReader &)=delete;
     size_t read(void * destination, size_t length);
-    void close();
+    /** Expose the next chunk of captured data as the window **/
+    bool underflow();
+    /** Read from the descriptor unless reading is suspended **/
+    void receive();
+    /** Forward data through pipes without copying it to user space **/
+    void splice();
+    /** Send data to destination, queue what it cannot take now **/
+    void forward(const uint8_t * data, size_t length, uint64_t arrived);
+    /** Write as much queued data as destination takes without blocking **/
+    void flush();
+    /** Flush and read again if the queue has fallen below the high-water
+        mark (called when destination becomes writable) **/
+    void drain();
+    /** Returns true if reading waits for the queue to be written **/
+    bool isBacklogged() const;
+    /** Close after the queued data is written (end of stream) **/
+    void finish();
     
     int fd;
     StreamReader &destination;
-    std::string buffer;
-    std::mutex mutex;
-    std::condition_variable cv;
+    /** Forwarding pipe (zero-copy mode only) **/
+    int forwardPipe[2];
+    /** Pipe receiving a duplicate of forwarded data (zero-copy mode only) **/
+    int capturePipe[2];
+    /** Captured data waiting for the dissector **/
+    ChunkQueue buffer;
+    /** Length of the last window given to the dissector **/
+    size_t window;
+    /** Set after the last byte was put to buffer **/
+    std::atomic<bool> closed;
+    /** Reading is suspended (until the other side is connected) **/
+    bool paused;
+    /** Data which destination could not take yet (in zero-copy mode it
+        stays in the forwarding pipe and only its length is kept) **/
+    ChunkQueue outbound;
+    /** Number of bytes in the outbound queue **/
+    size_t outboundLength;
+    /** Number of bytes written to destination **/
+    uint64_t sentBytes;
+    /** Value of sentBytes after which a queued read is written, and its
+        arrival time **/
+    std::deque<std::pair<uint64_t, uint64_t>> departures;
+    /** End of stream was read, the queue is being written **/
+    bool ended;
+    /** Capture file (pcapng mode only) **/
+    PacketCapture * capture;
+    /** Captured conversation (pcapng mode only) **/
+    Flow * flow;
+    
+    /** Pass received data to the dissector or to the capture file **/
+    void received(const uint8_t * data, size_t length, uint64_t arrived);
 };
 
 /** Stream protocol sniffer **/
@@ -45,16 +116,54 @@ public:
     Channel &getChannel(bool incoming) { return incoming?server:client; }
     
 private:
+    /** Index of the upstream connector in events of this connection **/
+    static const unsigned CONNECTOR=2;
+    /** Endpoints of the conversation for the capture file **/
+    Flow flow;
     /** Client to server reader **/
     StreamReader client;
     /** Server socket descriptor **/
     StreamReader server;
-    /** Connect to server **/
-    int initialize(HostAddress remote);
-    /** Accept SOCKS connection and connect to the target server **/
-    int acceptSocksConnection(int client);
+    /** Connects to the server in background **/
+    Connector connector;
+    /** Address of the server **/
+    HostAddress remote;
+    /** SOCKS negotiation with the client (null if not a proxy) **/
+    std::unique_ptr<SocksHandshake> socks;
+    /** Time of activation (Sniffer::getTime()) **/
+    uint64_t started;
+    /** Time of creation (Latency::now()) **/
+    uint64_t accepted;
+    /** Limits SOCKS negotiation **/
+    Timeout handshakeTimer;
+    /** Closes the connection when nothing was received for a while **/
+    Timeout idleTimer;
+    /** Closes the connection when it has existed for too long **/
+    Timeout lifetimeTimer;
+    /** Read available part of SOCKS handshake and answer it **/
+    void negotiate();
+    /** Send SOCKS reply with status of connection to the server **/
+    void replySocks(int error);
+    /** Start timers and connecting to the server (or negotiating with SOCKS
+        client) **/
+    void activate();
+    /** Stop timers and connecting **/
+    void deactivate();
+    /** Start connecting to the server **/
+    void connect();
+    /** Hand the client over to a SOCKS5 UDP relay **/
+    void associate();
+    void notify(unsigned index);
+    /** Called by handshake timer **/
+    void handshakeExpired();
+    /** Called by idle timer, which is not moved on activity **/
+    void idleExpired();
+    /** Called by lifetime timer **/
+    void lifetimeExpired();
+    /** Called by connector with the server socket or error **/
+    void connected(int fd, int error);
     /** Thread function **/
-    void threadFunc(std::ostream &log, bool incoming);
+    void threadFunc(bool incoming);
 };
 
 #endif
@@ -0,0 +1,196 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Pool of pre-connected sockets to the upstream server
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include "UpstreamPool.hpp"
+#include "../utils/Utils.hpp"
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+/** Delay before dialing again after a failure, in milliseconds **/
+static const int RETRY_INTERVAL=1000;
+
+UpstreamPool::UpstreamPool(const HostAddress &remote, const PoolPolicy &policy,
+        unsigned connectTimeout) : remote(remote), policy(policy),
+        connectTimeout(connectTimeout), resolver(1), alive(true),
+        wakeup(posix::eventfd()), target(policy.minimum) {
+    this->policy.maximum=std::max(policy.minimum, policy.maximum);
+    thread=std::thread(&UpstreamPool::threadFunc, this);
+}
+
+UpstreamPool::~UpstreamPool() {
+    alive=false;
+    wake();
+    thread.join();
+    for (auto i=idle.begin(); i!=idle.end(); ++i)
+        close(i->fd);
+    close(wakeup);
+}
+
+int UpstreamPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!idle.empty()) {
+        int fd=idle.back().fd;
+        idle.pop_back();
+        
+        // Skip sockets which were closed by server since the last sweep
+        char byte;
+        ssize_t peeked=recv(fd, &byte, 1, MSG_PEEK|MSG_DONTWAIT);
+        if (peeked>0||(peeked<0&&errno==EAGAIN)) {
+            lock.unlock();
+            wake();
+            return fd;
+        }
+        close(fd);
+    }
+    
+    // Demand exceeds the pool, let it grow
+    if (target<policy.maximum)
+        target++;
+    lock.unlock();
+    wake();
+    return -1;
+}
+
+void UpstreamPool::wake() {
+    uint64_t one=1;
+    if (::write(wakeup, &one, sizeof(one))<0&&errno!=EAGAIN)
+        Error::raise("waking up upstream pool");
+}
+
+int UpstreamPool::dial() {
+    std::promise<std::pair<AddressList, int>> promise;
+    std::future<std::pair<AddressList, int>> answer=promise.get_future();
+    resolver.resolve(remote.first, [&promise](const AddressList &addresses, int error) {
+        promise.set_value(std::make_pair(addresses, error));
+    });
+    std::pair<AddressList, int> result=answer.get();
+    if (result.second) {
+        cerr << "upstream pool: resolving " << remote.first << ": "
+            << gai_strerror(result.second) << endl;
+        return -1;
+    }
+    
+    int error=EHOSTUNREACH;
+    for (auto i=result.first.begin(); i!=result.first.end()&&alive; ++i) {
+        struct sockaddr_storage address=*i;
+        socklen_t length;
+        if (address.ss_family==AF_INET) {
+            reinterpret_cast<struct sockaddr_in &>(address).sin_port=htons(remote.second);
+            length=sizeof(struct sockaddr_in);
+        }
+        else {
+            reinterpret_cast<struct sockaddr_in6 &>(address).sin6_port=htons(remote.second);
+            length=sizeof(struct sockaddr_in6);
+        }
+        
+        int fd=socket(address.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd<0) {
+            error=errno;
+            continue;
+        }
+        if (connect(fd, reinterpret_cast<struct sockaddr *>(&address), length)<0) {
+            error=errno;
+            if (errno==EINPROGRESS) {
+                struct pollfd pfd={fd, POLLOUT, 0};
+                int ready=poll(&pfd, 1, connectTimeout);
+                socklen_t size=sizeof(error);
+                if (ready<0)
+                    error=errno;
+                else if (ready==0)
+                    error=ETIMEDOUT;
+                else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size)<0)
+                    error=errno;
+            }
+            if (error) {
+                close(fd);
+                continue;
+            }
+        }
+        return fd;
+    }
+    cerr << "upstream pool: connecting to " << remote.first << ':'
+        << remote.second << ": " << strerror(error) << endl;
+    return -1;
+}
+
+void UpstreamPool::sweep(const struct pollfd * fds, size_t count) {
+    Clock::time_point expired=Clock::now()-std::chrono::seconds(policy.idle);
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto i=idle.begin(); i!=idle.end();) {
+        // Only this thread adds sockets, so descriptors in fds are not reused
+        const struct pollfd * polled=std::find_if(fds, fds+count,
+            [i](const struct pollfd &pfd) { return pfd.fd==i->fd; });
+        bool closed=polled!=fds+count&&(polled->revents&(POLLRDHUP|POLLHUP|POLLERR));
+        if (closed||(policy.idle&&i->since<=expired)) {
+            // Sockets which expire unused are not needed above the minimum
+            if (!closed&&target>policy.minimum)
+                target--;
+            close(i->fd);
+            i=idle.erase(i);
+        }
+        else
+            ++i;
+    }
+}
+
+void UpstreamPool::threadFunc() {
+    vector<struct pollfd> fds;
+    while (alive) {
+        // Sockets are checked by poll() of the previous iteration
+        sweep(fds.data()+std::min(fds.size(), size_t(1)), fds.size()>1?fds.size()-1:0);
+        
+        bool failed=false;
+        while (alive) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (idle.size()>=target)
+                    break;
+            }
+            int fd=dial();
+            if (fd<0) {
+                failed=true;
+                break;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.push_back(Idle{fd, Clock::now()});
+        }
+        
+        // Wait for a client, a server closing connection or expiry
+        int timeout=failed?RETRY_INTERVAL:-1;
+        fds.assign(1, pollfd{wakeup, POLLIN, 0});
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (auto i=idle.begin(); i!=idle.end(); ++i)
+                fds.push_back(pollfd{i->fd, POLLRDHUP, 0});
+            if (policy.idle&&!idle.empty()) {
+                int left=std::chrono::duration_cast<std::chrono::milliseconds>(
+                    idle.front().since+std::chrono::seconds(policy.idle)-Clock::now()).count()+1;
+                left=std::max(left, 0);
+                timeout=timeout<0?left:std::min(timeout, left);
+            }
+        }
+        if (poll(fds.data(), fds.size(), timeout)<0&&errno!=EINTR) {
+            cerr << "upstream pool: " << strerror(errno) << endl;
+            break;
+        }
+        uint64_t counter;
+        while (::read(wakeup, &counter, sizeof(counter))>0);
+    }
+}
@@ -0,0 +1,79 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Pool of pre-connected sockets to the upstream server
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_UPSTREAMPOOL_HPP
+#define __CORE_UPSTREAMPOOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "Resolver.hpp"
+#include "../sniffer.hpp"
+
+/** Size limits of the pool **/
+struct PoolPolicy {
+    PoolPolicy() : minimum(0), maximum(0), idle(0) {}
+    /** Number of idle sockets kept ready **/
+    unsigned minimum;
+    /** Number of idle sockets the pool may grow to when it runs dry **/
+    unsigned maximum;
+    /** Close sockets which were not used for this many seconds (0 means
+        never), sockets below the minimum are replaced with fresh ones **/
+    unsigned idle;
+};
+
+/** Keeps sockets connected to a fixed server, so that new clients do not
+    wait for a handshake. A background thread dials new sockets, drops the
+    ones closed by the server and expires idle ones. **/
+class UpstreamPool {
+public:
+    /** Start connecting to remote **/
+    UpstreamPool(const HostAddress &remote, const PoolPolicy &policy,
+        unsigned connectTimeout);
+    /** Close all idle sockets **/
+    ~UpstreamPool();
+    /** Take a connected socket (in non-blocking mode), returns -1 if none
+        is ready. May be called from any thread. **/
+    int acquire();
+    
+private:
+    UpstreamPool(const UpstreamPool &)=delete;
+    UpstreamPool &operator =(const UpstreamPool &)=delete;
+    typedef std::chrono::steady_clock Clock;
+    /** Connected socket waiting for a client **/
+    struct Idle {
+        int fd;
+        Clock::time_point since;
+    };
+    
+    HostAddress remote;
+    PoolPolicy policy;
+    unsigned connectTimeout;
+    Resolver resolver;
+    std::atomic<bool> alive;
+    /** eventfd which wakes the pool thread up **/
+    int wakeup;
+    /** Protects idle sockets and target **/
+    std::mutex mutex;
+    /** Idle sockets, the most recently connected last **/
+    std::deque<Idle> idle;
+    /** Number of idle sockets the thread maintains **/
+    unsigned target;
+    std::thread thread;
+    
+    /** Wake up the pool thread **/
+    void wake();
+    /** Connect to remote, returns -1 on error **/
+    int dial();
+    /** Close sockets which were closed by server or expired **/
+    void sweep(const struct pollfd * fds, size_t count);
+    void threadFunc();
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Fixed pool of worker threads running protocol dissectors
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include "Metrics.hpp"
+#include "WorkerPool.hpp"
+#include "../utils/Affinity.hpp"
+
+/** Index of the worker running on this thread **/
+static thread_local int currentWorker=-1;
+
+Task::Task(WorkerPool &pool) : pool(pool), state(IDLE),
+        home(pool.nextHome++%pool.size()) {}
+
+void Task::wake() {
+    int current=state.load();
+    while (true) {
+        if (current==IDLE) {
+            if (state.compare_exchange_weak(current, QUEUED)) {
+                pool.schedule(this);
+                return;
+            }
+        }
+        else if (current==RUNNING) {
+            // The worker will run the task once more when run() returns
+            if (state.compare_exchange_weak(current, RERUN))
+                return;
+        }
+        else
+            return;
+    }
+}
+
+/******************************************************************************/
+
+WorkerPool::WorkerPool(unsigned count) : running(true), nextHome(0) {
+    // Workers inherit CPU affinity of the creating thread
+    if (count==0)
+        count=getCpuCount();
+    for (unsigned i=0; i<count; i++)
+        workers.emplace_back(new Worker());
+    for (unsigned i=0; i<count; i++)
+        workers[i]->thread=std::thread(&WorkerPool::workerFunc, this, i);
+}
+
+WorkerPool::~WorkerPool() {
+    running=false;
+    idle.notify();
+    for (auto i=workers.begin(); i!=workers.end(); ++i)
+        (*i)->thread.join();
+}
+
+void WorkerPool::schedule(Task * task) {
+    // Tasks woken up by a worker stay there, others go to their home
+    unsigned index=currentWorker>=0?unsigned(currentWorker):task->home;
+    Worker &worker=*workers[index];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queue.push_back(task);
+    }
+    Metrics::add(Metrics::TASKS_SCHEDULED);
+    idle.notifyOne();
+}
+
+Task * WorkerPool::take(unsigned self) {
+    for (unsigned i=0; i<workers.size(); i++) {
+        Worker &worker=*workers[(self+i)%workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.queue.empty()) {
+            Task * task;
+            if (i==0) {
+                task=worker.queue.front();
+                worker.queue.pop_front();
+            }
+            else {
+                task=worker.queue.back();
+                worker.queue.pop_back();
+            }
+            Metrics::add(Metrics::TASKS_TAKEN);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void WorkerPool::execute(Task * task) {
+    task->state=Task::RUNNING;
+    if (!task->run()) {
+        task->state=Task::DONE;
+        task->done();
+        return;
+    }
+    
+    int expected=Task::RUNNING;
+    if (!task->state.compare_exchange_strong(expected, Task::IDLE)) {
+        // Woken up while running, queue it again behind other tasks
+        task->state=Task::QUEUED;
+        schedule(task);
+    }
+}
+
+void WorkerPool::workerFunc(unsigned index) {
+    currentWorker=int(index);
+    while (running) {
+        int ticket=idle.prepare();
+        Task * task=take(index);
+        if (task)
+            execute(task);
+        else if (running)
+            idle.wait(ticket);
+    }
+}
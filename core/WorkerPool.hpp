@@ -0,0 +1,79 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Fixed pool of worker threads running protocol dissectors
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __CORE_WORKERPOOL_HPP
+#define __CORE_WORKERPOOL_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../utils/Event.hpp"
+
+/** Unit of work which is run on the worker pool again and again **/
+class Task {
+public:
+    /** Create an idle task **/
+    explicit Task(class WorkerPool &pool);
+    virtual ~Task() {}
+    /** Make sure the task runs (again) soon, may be called from any thread **/
+    void wake();
+    
+protected:
+    /** Do all work which is possible now, return false when done forever **/
+    virtual bool run()=0;
+    /** Called after run() returned false, the task may delete itself **/
+    virtual void done() {}
+    
+private:
+    enum State { IDLE, QUEUED, RUNNING, RERUN, DONE };
+    WorkerPool &pool;
+    std::atomic<int> state;
+    /** Worker which receives the task when it is woken up from outside **/
+    unsigned home;
+    friend class WorkerPool;
+};
+
+/** Worker threads with own run queues, idle workers steal from others **/
+class WorkerPool {
+public:
+    /** Start threads (one per allowed CPU if count is zero) **/
+    explicit WorkerPool(unsigned count=0);
+    /** Stop threads, tasks which are still queued are not run **/
+    ~WorkerPool();
+    /** Returns number of worker threads **/
+    unsigned size() const { return unsigned(workers.size()); }
+    
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task *> queue;
+        std::thread thread;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> running;
+    /** Round robin counter for home workers **/
+    std::atomic<unsigned> nextHome;
+    /** Idle workers sleep here **/
+    Event idle;
+    
+    WorkerPool(const WorkerPool &)=delete;
+    WorkerPool &operator =(const WorkerPool &)=delete;
+    /** Put task to a run queue **/
+    void schedule(Task * task);
+    /** Take a task from own queue or steal one **/
+    Task * take(unsigned self);
+    /** Run task and decide what to do with it **/
+    void execute(Task * task);
+    /** Worker thread function **/
+    void workerFunc(unsigned index);
+    friend class Task;
+};
+
+#endif
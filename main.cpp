@@ -1,13 +1,20 @@
 #include <arpa/inet.h>
+#include <climits>
 #include <clocale>
 #include <csignal>
 #include <cstring>
-#include <fstream>
+#include <fcntl.h>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <streambuf>
+#include <thread>
 #include <unistd.h>
+#include "core/Metrics.hpp"
+#include "core/PacketCapture.hpp"
 #include "core/Sniffer.hpp"
+#include "core/UpstreamPool.hpp"
+#include "utils/Affinity.hpp"
 
 using std::cerr;
 using std::cout;
@@ -26,17 +33,40 @@ void sighandler(int sigNo);
 static int help(const char * program) {
     cout << "Usage: " << program << " [OPTIONS]" << endl;
     cout << "\t--append                 Append to FILE" << endl;
+    cout << "\t--capture-limit=SIZE     Keep at most SIZE captured bytes per connection (0: no limit)" << endl;
+    cout << "\t--capture-total=SIZE     Keep at most SIZE captured bytes in all connections (0: no limit)" << endl;
+    cout << "\t--connect-timeout=MS     Give up connecting to an address after MS ms" << endl;
     cout << "\t--daemon                 Daemonize process" << endl;
+    cout << "\t--flush-interval=MS      Write log at least every MS milliseconds" << endl;
     cout << "\t--help                   *Show this help" << endl;
+    cout << "\t--idle-timeout=SEC       Close connections which received nothing for SEC seconds (0: never)" << endl;
+    cout << "\t--keep-bytes=SIZE        Keep at most SIZE bytes of old segments" << endl;
+    cout << "\t--keep-segments=COUNT    Keep at most COUNT old segments" << endl;
+    cout << "\t--max-lifetime=SEC       Close connections after SEC seconds (0: never)" << endl;
+    cout << "\t--metrics=PORT|PATH      Serve metrics at 127.0.0.1:PORT or Unix socket PATH" << endl;
     cout << "\t--options=OPTIONS        Pass OPTIONS to protocol plugin" << endl;
     cout << "\t--output=FILE            Output dump to FILE" << endl;
+    cout << "\t--output-format=FORMAT   Write dump as text (default) or pcapng" << endl;
+    cout << "\t--overflow=POLICY        When a capture limit is hit: drop (default), truncate or pause" << endl;
+    cout << "\t--pin=cpu|numa           Bind shards to blocks of CPUs or to NUMA nodes" << endl;
+    cout << "\t--pool-idle=SEC          Reconnect pooled sockets unused for SEC seconds" << endl;
+    cout << "\t--pool-max=COUNT         Let the pool grow to COUNT idle sockets" << endl;
+    cout << "\t--pool-min=COUNT         Keep COUNT sockets to --tcp-server HOST ready" << endl;
     cout << "\t--port=PORT              Listen at specified PORT" << endl;
     cout << "\t--protocol=PROTOCOL      Use specified PROTOCOL" << endl;
+    cout << "\t--rotate-interval=SEC    Start new segment of FILE every SEC seconds" << endl;
+    cout << "\t--rotate-size=SIZE       Start new segment of FILE after SIZE bytes" << endl;
+    cout << "\t--shards=COUNT           Accept and forward on COUNT independent shards" << endl;
     cout << "\t--socks-server           *Act as a SOCKS5 proxy" << endl;
+    cout << "\t--socks-timeout=MS       Drop SOCKS clients not done in MS ms" << endl;
     cout << "\t--tcp-server=HOST:PORT   *Route connections to HOST" << endl;
     cout << "\t--udp-server=HOST:PORT   *Route datagrams to HOST" << endl;
+    cout << "\t--udp-timeout=SEC        Forget UDP clients idle for SEC seconds" << endl;
+    cout << "\t--workers=COUNT          Run dissectors on COUNT threads (in all shards)" << endl;
+    cout << "\t--zero-copy              Forward stream data with splice()" << endl;
     cout << endl;
     cout << "One and only one option marked with * SHOULD be used." << endl;
+    cout << "Send SIGUSR1 to print latency percentiles to stderr." << endl;
     cout << endl;
     cout << "Supported PROTOCOLs:" << endl;
     Registry &registry=Registry::instance();
@@ -58,9 +88,52 @@ static HostAddress parseHostAddress(const char * address) {
     return HostAddress(string(address, colon-address), remotePort);
 }
 
-int listenAt(uint16_t port, int family, bool reuseAddress);
+/** Parse size with optional K, M or G suffix **/
+static off_t parseSize(const char * size) {
+    char * end;
+    off_t result=strtoll(size, &end, 10);
+    if (*end=='K')
+        result<<=10;
+    else if (*end=='M')
+        result<<=20;
+    else if (*end=='G')
+        result<<=30;
+    if (result<=0||(*end&&end[1])||(*end&&!strchr("KMG", *end)))
+        throw "invalid size";
+    return result;
+}
+
+/** Parse number of seconds which fits into a timer, returns unsigned(-1) if
+    it is invalid **/
+static unsigned parseSeconds(const char * seconds) {
+    char * end;
+    long result=strtol(seconds, &end, 10);
+    if (*seconds=='\0'||*end||result<0||result>long(UINT_MAX/1000))
+        return unsigned(-1);
+    return unsigned(result);
+}
+
+/** Print latency percentiles to cerr whenever SIGUSR1 arrives. The signal is
+    blocked in all threads started afterwards, so only this thread takes it. **/
+static void reportOnSignal() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([signals]() {
+        int signal;
+        while (sigwait(&signals, &signal)==0)
+            cerr << Latency::report() << std::flush;
+    }).detach();
+}
+
+int listenAt(uint16_t port, int family, bool reuseAddress, bool reusePort);
+int bindTo(uint16_t port, int family, bool reuseAddress, bool reusePort);
 int mainLoopTcp(const char * program, Sniffer &controller, int listener, HostAddress remote);
 int mainLoopSocks(const char * program, Sniffer &controller, int listener);
+int mainLoopUdp(const char * program, Sniffer &controller, int listener, HostAddress remote);
+int runShards(const char * program, const std::vector<int> &listeners,
+    const std::vector<cpu_set_t> &placement, std::function<int(int listener)> serve);
 ostream &operator <<(ostream &stream, const Error &error);
 
 int main(int argc, char ** argv) {
@@ -78,19 +151,43 @@ int main(int argc, char ** argv) {
         sigaction(SIGTERM, &sa, nullptr);
         
         // Parse command line arguments
-        int help=0, append=0, daemonize=0, c;
-        const char * protocol="raw", * output=nullptr;
+        int help=0, append=0, daemonize=0, zeroCopy=0, c;
+        unsigned flushInterval=LogWriter::FLUSH_INTERVAL;
+        bool pcapng=false;
+        const char * protocol="raw", * output=nullptr, * metricsAddress=nullptr;
         static struct option OPTIONS[]={
             {   "append",       no_argument,        &append,    1   },
+            {   "capture-limit", required_argument, 0,          'L' },
+            {   "capture-total", required_argument, 0,          'G' },
+            {   "connect-timeout", required_argument, 0,        'c' },
             {   "daemon",       no_argument,        &daemonize, 1   },
+            {   "flush-interval", required_argument, 0,         'f' },
             {   "help",         no_argument,        &help,      1   },
+            {   "idle-timeout", required_argument,  0,          'd' },
+            {   "keep-bytes",   required_argument,  0,          'B' },
+            {   "keep-segments", required_argument, 0,          'N' },
+            {   "max-lifetime", required_argument,  0,          'l' },
+            {   "metrics",      required_argument,  0,          'X' },
             {   "options",      optional_argument,  0,          '*' },
             {   "output",       required_argument,  0,          'o' },
+            {   "output-format", required_argument, 0,          'F' },
+            {   "overflow",     required_argument,  0,          'O' },
+            {   "pin",          required_argument,  0,          'P' },
+            {   "pool-idle",    required_argument,  0,          'i' },
+            {   "pool-max",     required_argument,  0,          'M' },
+            {   "pool-min",     required_argument,  0,          'm' },
             {   "port",         required_argument,  0,          'p' },
             {   "protocol",     required_argument,  0,          '_' },
+            {   "rotate-interval", required_argument, 0,        'I' },
+            {   "rotate-size",  required_argument,  0,          'S' },
+            {   "shards",       required_argument,  0,          'n' },
             {   "socks-server", no_argument,        0,          's' },
+            {   "socks-timeout", required_argument, 0,          'H' },
             {   "tcp-server",   required_argument,  0,          't' },
             {   "udp-server",   required_argument,  0,          'u' },
+            {   "udp-timeout",  required_argument,  0,          'T' },
+            {   "workers",      required_argument,  0,          'w' },
+            {   "zero-copy",    no_argument,        &zeroCopy,  1   },
             {   0                                                   }
         };
         
@@ -102,17 +199,116 @@ int main(int argc, char ** argv) {
             bool reuseAddress;
             OptionsImpl aux;
         } options;
+        Configuration configuration;
+        RotationPolicy rotation;
+        PoolPolicy pool;
+        unsigned shards=1;
+        Pinning pinning=PIN_NONE;
         
         do {
             c=getopt_long(argc, argv, "", OPTIONS, 0);
             if (c=='*') {
                 options.aux=OptionsImpl(optarg);
             }
+            else if (c=='c') {
+                configuration.connectTimeout=atoi(optarg);
+                if (configuration.connectTimeout==0)
+                    throw "invalid --connect-timeout";
+            }
+            else if (c=='L')
+                configuration.captureLimit=strcmp(optarg, "0")?parseSize(optarg):0;
+            else if (c=='G')
+                configuration.captureTotal=strcmp(optarg, "0")?parseSize(optarg):0;
+            else if (c=='O') {
+                if (!strcmp(optarg, "drop"))
+                    configuration.overflow=OVERFLOW_DROP;
+                else if (!strcmp(optarg, "truncate"))
+                    configuration.overflow=OVERFLOW_TRUNCATE;
+                else if (!strcmp(optarg, "pause"))
+                    configuration.overflow=OVERFLOW_PAUSE;
+                else
+                    throw "invalid --overflow";
+            }
+            else if (c=='H') {
+                configuration.handshakeTimeout=atoi(optarg);
+                if (configuration.handshakeTimeout==0)
+                    throw "invalid --socks-timeout";
+            }
+            else if (c=='d') {
+                configuration.idleTimeout=parseSeconds(optarg);
+                if (configuration.idleTimeout==unsigned(-1))
+                    throw "invalid --idle-timeout";
+            }
+            else if (c=='l') {
+                configuration.maxLifetime=parseSeconds(optarg);
+                if (configuration.maxLifetime==unsigned(-1))
+                    throw "invalid --max-lifetime";
+            }
+            else if (c=='T') {
+                configuration.datagramTimeout=atoi(optarg);
+                if (configuration.datagramTimeout==0)
+                    throw "invalid --udp-timeout";
+            }
+            else if (c=='f') {
+                flushInterval=atoi(optarg);
+                if (flushInterval==0)
+                    throw "invalid --flush-interval";
+            }
             else if (c=='o') {
                 if (output)
                     throw "--output is already set";
                 output=optarg;
             }
+            else if (c=='B')
+                rotation.keepBytes=parseSize(optarg);
+            else if (c=='N') {
+                rotation.keepSegments=atoi(optarg);
+                if (rotation.keepSegments==0)
+                    throw "invalid number of --keep-segments";
+            }
+            else if (c=='X')
+                metricsAddress=optarg;
+            else if (c=='I') {
+                rotation.interval=atoi(optarg);
+                if (rotation.interval==0)
+                    throw "invalid --rotate-interval";
+            }
+            else if (c=='S')
+                rotation.size=parseSize(optarg);
+            else if (c=='F') {
+                if (!strcmp(optarg, "pcapng"))
+                    pcapng=true;
+                else if (strcmp(optarg, "text"))
+                    throw "unknown --output-format";
+            }
+            else if (c=='n') {
+                shards=atoi(optarg);
+                if (shards==0)
+                    throw "invalid number of --shards";
+            }
+            else if (c=='P') {
+                if (!strcmp(optarg, "cpu"))
+                    pinning=PIN_CPU;
+                else if (!strcmp(optarg, "numa"))
+                    pinning=PIN_NUMA;
+                else
+                    throw "unknown --pin mode";
+            }
+            else if (c=='i') {
+                pool.idle=atoi(optarg);
+                if (pool.idle==0)
+                    throw "invalid --pool-idle";
+            }
+            else if (c=='M') {
+                pool.maximum=atoi(optarg);
+                if (pool.maximum==0)
+                    throw "invalid --pool-max";
+            }
+            else if (c=='m') {
+                pool.minimum=atoi(optarg);
+                if (pool.minimum==0)
+                    throw "invalid --pool-min";
+            }
             else if (c=='p') {
                 options.localPort=atoi(optarg);
                 if (options.localPort==0)
@@ -129,6 +325,11 @@ int main(int argc, char ** argv) {
                 SETMODE(Options::UDP);
                 options.remote=parseHostAddress(optarg);
             }
+            else if (c=='w') {
+                configuration.workers=atoi(optarg);
+                if (configuration.workers==0)
+                    throw "invalid number of --workers";
+            }
             else if (c=='_')
                 protocol=optarg;
             else if (c=='?')
@@ -143,48 +344,107 @@ int main(int argc, char ** argv) {
             // Find protocol by name
             const Plugin &plugin=Registry::instance()[protocol];
             
-            // Open log
-            std::ostream * outputStream=&cout;
-            std::fstream fstream;
-            if (output) {
-                using namespace std;
-                fstream.open(output, ios::out|(append?ios::app:ios::trunc));
-                outputStream=&fstream;
-            }
-            
-            Sniffer controller(plugin, options.aux, *outputStream);
+            if (!output&&pcapng)
+                throw "--output-format=pcapng requires --output";
+            if (!output&&(rotation.size||rotation.interval))
+                throw "rotation requires --output";
+            if ((pool.minimum||pool.maximum||pool.idle)&&options.type!=Options::TCP)
+                throw "upstream pool requires --tcp-server";
+            if (pool.idle&&!pool.minimum&&!pool.maximum)
+                throw "--pool-idle requires --pool-min or --pool-max";
             
-            // Daemonize sniffer
+            // Daemonize sniffer (before any thread is started)
             if (daemonize) {
                 cerr << "Daemonizing sniffer" << endl;
                 daemon(1, 1);
             }
+            reportOnSignal();
             
-            if (options.type==Options::TCP) {
-                if (!(plugin.flags&Protocol::STREAM))
-                    throw "plugin does not support stream connections";
-                if (options.localPort==0)
-                    options.localPort=options.remote.second;
-                int listener=listenAt(options.localPort, AF_INET, options.reuseAddress);
-                return mainLoopTcp(argv[0], controller, listener, options.remote);
+            // Open log (capture file is mapped, so it must be readable too)
+            std::unique_ptr<RotatingFile> file;
+            if (output)
+                file.reset(new RotatingFile(output, pcapng?O_RDWR:O_WRONLY,
+                    append, rotation));
+            std::unique_ptr<LogWriter> log;
+            if (file&&!pcapng)
+                log.reset(new LogWriter(*file, flushInterval));
+            else
+                log.reset(new LogWriter(STDOUT_FILENO, flushInterval));
+            std::unique_ptr<MetricsServer> metrics;
+            if (metricsAddress)
+                metrics.reset(new MetricsServer(metricsAddress, plugin.name, *log));
+            std::unique_ptr<PacketCapture> capture;
+            if (pcapng) {
+                capture.reset(new PacketCapture(*file));
+                configuration.capture=capture.get();
+            }
+            
+            // Dial the upstream server before clients arrive
+            std::unique_ptr<UpstreamPool> upstream;
+            if (pool.minimum||pool.maximum) {
+                upstream.reset(new UpstreamPool(options.remote, pool,
+                    configuration.connectTimeout));
+                configuration.upstream=upstream.get();
             }
-            else if (options.type==Options::UDP) {
+            
+            configuration.zeroCopy=zeroCopy;
+            
+            if (options.type==Options::UDP) {
                 if (!(plugin.flags&Protocol::DATAGRAM))
                     throw "plugin does not support datagram connections";
                 if (options.localPort==0)
                     options.localPort=options.remote.second;
-                throw "UDP is not implemented yet";
+                if (pcapng)
+                    throw "--output-format=pcapng does not support UDP yet";
+            }
+            else if (options.type==Options::TCP) {
+                if (options.localPort==0)
+                    options.localPort=options.remote.second;
             }
             else if (options.type==Options::SOCKS) {
-                if (!(plugin.flags&Protocol::STREAM))
-                    throw "plugin does not support stream connections";
                 if (options.localPort==0)
                     throw "--port must be specified";
-                int listener=listenAt(options.localPort, AF_INET, options.reuseAddress);
-                return mainLoopSocks(argv[0], controller, listener);
             }
             else
                 throw "this cannot happens";
+            if (options.type!=Options::UDP&&!(plugin.flags&Protocol::STREAM))
+                throw "plugin does not support stream connections";
+            auto open=[&](bool reusePort) {
+                if (options.type==Options::UDP)
+                    return bindTo(options.localPort, AF_INET6, options.reuseAddress, reusePort);
+                else
+                    return listenAt(options.localPort, AF_INET6, options.reuseAddress, reusePort);
+            };
+            auto serve=[&](Sniffer &controller, int listener) {
+                if (options.type==Options::UDP)
+                    return mainLoopUdp(argv[0], controller, listener, options.remote);
+                else if (options.type==Options::TCP)
+                    return mainLoopTcp(argv[0], controller, listener, options.remote);
+                else
+                    return mainLoopSocks(argv[0], controller, listener);
+            };
+            
+            if (shards==1&&pinning==PIN_NONE) {
+                Sniffer controller(plugin, options.aux, *log, configuration);
+                return serve(controller, open(false));
+            }
+            
+            // Each shard has its own listener, polling thread, connection
+            // table and workers; pinned shards get one worker per CPU
+            Configuration shardConfiguration=configuration;
+            unsigned workers=configuration.workers;
+            if (workers==0&&pinning==PIN_NONE)
+                workers=getCpuCount();
+            if (workers)
+                shardConfiguration.workers=std::max(1u, workers/shards);
+            std::vector<int> listeners;
+            for (unsigned i=0; i<shards; i++)
+                listeners.push_back(open(true));
+            return runShards(argv[0], listeners, placeShards(shards, pinning),
+                [&](int listener) {
+                    Sniffer controller(plugin, options.aux, *log, shardConfiguration);
+                    return serve(controller, listener);
+                });
         }
     }
     catch (const Registry::PluginNotFoundException &e) {
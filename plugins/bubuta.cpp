@@ -90,7 +90,7 @@ private:
 };
 
 size_t BubutaReader::read(void * buffer, size_t length) {
-    size_t result=reader.read(buffer, length);
+    size_t result=reader.readSome(buffer, length);
     if (!key.empty()) {
         uint8_t * plaintext=static_cast<uint8_t *>(buffer);
         for (size_t i=0; i<result; i++, shift++)
@@ -116,7 +116,7 @@ string BubutaSniffer::dump(bool incoming, Reader &rawInput) {
     extern ostream &operator <<(ostream &, const vector<uint8_t> &);
     
     BubutaReader input(rawInput, key);
-    uint32_t length=ntohl(uint32_t(input));
+    uint32_t length=input.readBE<uint32_t>();
     //((length>>24)&0xff)+((length>>16)&0xff+((length>>8)&0xff)+length&0xff;
     uint8_t checksum=uint8_t(input);
     (void)checksum;
@@ -59,5 +59,5 @@ REGISTER_PROTOCOL(
     "raw",
     "Universal raw sniffer",
     1,
-    Protocol::STREAM
+    Protocol::STREAM|Protocol::DATAGRAM
 );
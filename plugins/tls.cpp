@@ -44,7 +44,7 @@ public:
         
         uint8_t type=uint8_t(input);
         uint8_t major=uint8_t(input), minor=uint8_t(input);
-        uint16_t length=__builtin_bswap16(uint16_t(input));
+        uint16_t length=input.readBE<uint16_t>();
         vector<uint8_t> data(length);
         input.readFully(data.data(), length);
         
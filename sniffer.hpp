@@ -8,6 +8,8 @@
 #ifndef __SNIFFER_HPP
 #define __SNIFFER_HPP
 
+#include <cstdint>
+#include <cstring>
 #include <map>
 #include <ostream>
 #include <string>
@@ -42,25 +44,45 @@ std::ostream &operator <<(std::ostream &stream, const Error &error);
 /** A system call was interrupted **/
 class Interrupt {};
 
-/** Abstract data source **/
+/** View of contiguous bytes **/
+struct Span {
+    const uint8_t * data;
+    size_t length;
+};
+
+/** Abstract data source
+    
+    Buffered readers expose their data through the window [head, tail), so
+    that fixed-size fields are read inline, without a virtual call. Readers
+    which do not buffer leave the window empty and implement only read(). **/
 class Reader {
 public:
     /** End of stream was reached **/
     class End {};
+    Reader() : head(nullptr), tail(nullptr), stashed(false),
+        savedHead(nullptr), savedTail(nullptr) {}
+    virtual ~Reader() {}
     /** Read up to specified number of bytes to buffer **/
     virtual size_t read(void * buffer, size_t length)=0;
+    /** Read up to specified number of bytes, including ones buffered by
+        peek() (use this instead of read() on readers of other readers) **/
+    size_t readSome(void * buffer, size_t length) {
+        if (head==tail&&!refill())
+            return read(buffer, length);
+        if (length>size_t(tail-head))
+            length=tail-head;
+        memcpy(buffer, head, length);
+        head+=length;
+        return length;
+    }
     /** Read exact number of bytes from the stream **/
     void readFully(void * buffer, size_t length) {
-        uint8_t * byteBuffer=reinterpret_cast<uint8_t *>(buffer);
-        while (length) {
-            size_t nRead=read(byteBuffer, length);
-            if (nRead>0) {
-                length-=nRead;
-                byteBuffer+=nRead;
-            }
-            else
-                throw End();
+        if (size_t(tail-head)>=length) {
+            memcpy(buffer, head, length);
+            head+=length;
         }
+        else
+            readFullySlow(buffer, length);
     }
     /** Read primitive value **/
     template <typename T>
@@ -69,6 +91,75 @@ public:
         readFully(&result, sizeof(result));
         return result;
     }
+    /** Returns next length bytes as contiguous memory without consuming them **/
+    const uint8_t * peek(size_t length) {
+        if (size_t(tail-head)<length)
+            fill(length);
+        return head;
+    }
+    /** Consume bytes without copying them **/
+    void skip(size_t length) {
+        if (size_t(tail-head)>=length)
+            head+=length;
+        else
+            skipSlow(length);
+    }
+    /** Returns bytes which are already buffered (may be empty) **/
+    Span span() const {
+        Span result={head, size_t(tail-head)};
+        return result;
+    }
+    /** Read unsigned big-endian integer **/
+    template <typename T>
+    T readBE() {
+        const uint8_t * data=peek(sizeof(T));
+        T result=0;
+        for (size_t i=0; i<sizeof(T); i++)
+            result=T(result<<8)|data[i];
+        head+=sizeof(T);
+        return result;
+    }
+    /** Read unsigned little-endian integer **/
+    template <typename T>
+    T readLE() {
+        const uint8_t * data=peek(sizeof(T));
+        T result=0;
+        for (size_t i=sizeof(T); i>0; i--)
+            result=T(result<<8)|data[i-1];
+        head+=sizeof(T);
+        return result;
+    }
+    
+protected:
+    /** Buffered bytes which were not consumed yet **/
+    const uint8_t * head, * tail;
+    /** Make the next portion of data available in the window. It is called
+        only after the previous window was consumed completely, returns false
+        at end of stream. Unbuffered readers keep the default. **/
+    virtual bool underflow() { return false; }
+    /** Restore data set aside by peek() or call underflow() **/
+    bool refill();
+    /** Expose a new window and drop whatever is buffered, including data
+        set aside by peek() (for readers of separate messages) **/
+    void resetWindow(const uint8_t * data, size_t length) {
+        stash.clear();
+        stashed=false;
+        savedHead=savedTail=nullptr;
+        head=data;
+        tail=data+length;
+    }
+    
+private:
+    /** Copy of data gathered by peek() across windows **/
+    std::string stash;
+    /** Whether the window points to the stash **/
+    bool stashed;
+    /** Rest of the window of underflow() while the stash is used **/
+    const uint8_t * savedHead, * savedTail;
+    
+    void readFullySlow(void * buffer, size_t length);
+    void skipSlow(size_t length);
+    void fill(size_t length);
 };
 
 /** Abstract option provider **/
@@ -0,0 +1,226 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Test of resuming readers paused by capture memory limits
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include "../core/Sniffer.hpp"
+#include "../core/StreamConnection.hpp"
+
+using std::cout;
+using std::endl;
+using std::string;
+
+/** Capture limit of the scenarios **/
+static const size_t LIMIT=1<<20;
+
+/** Holds dissectors of outgoing data until it is opened **/
+static struct Gate {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool open;
+
+    void set(bool open) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->open=open;
+        }
+        cv.notify_all();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]() { return open; });
+    }
+} gate;
+
+/** Plugin which stops taking client data while the gate is closed, so that
+    the captured backlog of that direction grows up to the limit **/
+class GateSniffer : public Protocol {
+public:
+    GateSniffer(const Options &options) {}
+    string dump(bool incoming, Reader &input) {
+        char buffer[1<<16];
+        if (!input.read(buffer, sizeof(buffer)))
+            throw Reader::End();
+        if (!incoming)
+            gate.wait();
+        return string();
+    }
+};
+
+REGISTER_PROTOCOL(
+    GateSniffer,
+    "gate",
+    "Test plugin holding outgoing data",
+    1,
+    Protocol::STREAM
+);
+
+/** Listen on a free port of the loopback interface **/
+static int listenLoopback(uint16_t &port) {
+    int fd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family=AF_INET;
+    address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    socklen_t length=sizeof(address);
+    if (fd<0||bind(fd, reinterpret_cast<struct sockaddr *>(&address), length)<0||
+            listen(fd, 16)<0||
+            getsockname(fd, reinterpret_cast<struct sockaddr *>(&address), &length)<0)
+        Error::raise("listening on loopback");
+    port=ntohs(address.sin_port);
+    return fd;
+}
+
+/** Connect to a port of the loopback interface **/
+static int connectLoopback(uint16_t port) {
+    int fd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family=AF_INET;
+    address.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    address.sin_port=htons(port);
+    if (fd<0||connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address))<0)
+        Error::raise("connecting to loopback");
+    return fd;
+}
+
+/** Returns true if data arrives on the socket within specified time **/
+static bool receives(int fd, unsigned milliseconds) {
+    struct pollfd pfd={fd, POLLIN, 0};
+    char buffer[16];
+    return poll(&pfd, 1, int(milliseconds))>0&&recv(fd, buffer, sizeof(buffer), 0)>0;
+}
+
+/** Client and upstream ends of a connection relayed by the sniffer **/
+class Relayed {
+public:
+    Relayed(Sniffer &sniffer, int listener, uint16_t port, int upstream,
+            uint16_t upstreamPort) {
+        // The test accepts clients in place of the main loop
+        client=connectLoopback(port);
+        int accepted=accept4(listener, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (accepted<0)
+            Error::raise("accepting a connection");
+        sniffer.add<StreamConnection>(accepted, HostAddress("127.0.0.1", upstreamPort));
+        server=accept(upstream, nullptr, nullptr);
+        if (server<0)
+            Error::raise("accepting a connection");
+        // Upstream takes everything, so only the dissector can hold data back
+        drain=std::thread([this]() {
+            char buffer[1<<16];
+            while (recv(server, buffer, sizeof(buffer), 0)>0);
+        });
+    }
+    ~Relayed() {
+        shutdown(server, SHUT_RDWR);
+        shutdown(client, SHUT_RDWR);
+        drain.join();
+        close(client);
+        close(server);
+    }
+    /** Send from client until the captured data of all connections reaches
+        the limit, returns false if it does not **/
+    bool fill() {
+        static const char data[1<<16]={};
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL)|O_NONBLOCK);
+        auto deadline=std::chrono::steady_clock::now()+std::chrono::seconds(5);
+        while (Channel::getTotalQueued()<LIMIT) {
+            if (std::chrono::steady_clock::now()>deadline)
+                return false;
+            if (send(client, data, sizeof(data), MSG_NOSIGNAL)<0) {
+                if (errno!=EAGAIN)
+                    return false;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        return true;
+    }
+    /** Send a reply from upstream **/
+    void reply() {
+        if (send(server, "pong", 4, MSG_NOSIGNAL)!=4)
+            Error::raise("replying");
+    }
+    /** Returns true if the reply reaches the client within specified time **/
+    bool delivered(unsigned milliseconds) { return receives(client, milliseconds); }
+
+private:
+    int client;
+    int server;
+    std::thread drain;
+};
+
+/** Fill the backlog of one client, check that the reply of the second
+    relayed connection (which may be the same one) waits until the backlog
+    is taken by the dissector **/
+static bool run(const char * name, const Configuration &configuration, bool shared) {
+    int output=open("/dev/null", O_WRONLY|O_CLOEXEC);
+    uint16_t port, upstreamPort;
+    int listener=listenLoopback(port), upstream=listenLoopback(upstreamPort);
+    string failure;
+    gate.set(false);
+    {
+        LogWriter log(output);
+        Sniffer sniffer(Registry::instance()["gate"], OptionsImpl(), log, configuration);
+        Relayed first(sniffer, listener, port, upstream, upstreamPort);
+        Relayed * second=shared?&first:
+            new Relayed(sniffer, listener, port, upstream, upstreamPort);
+        if (!first.fill())
+            failure="backlog did not reach the limit";
+        else {
+            second->reply();
+            if (second->delivered(300))
+                failure="reply was not paused";
+            else {
+                gate.set(true);
+                if (!second->delivered(3000))
+                    failure="reply was not resumed";
+            }
+        }
+        gate.set(true);
+        if (!shared)
+            delete second;
+    }
+    close(listener);
+    close(upstream);
+    close(output);
+
+    if (failure.empty())
+        cout << name << ": ok" << endl;
+    else
+        cout << name << ": FAILED, " << failure << endl;
+    return failure.empty();
+}
+
+int main() {
+    Configuration configuration;
+    configuration.workers=2;
+    configuration.overflow=OVERFLOW_PAUSE;
+    bool ok=true;
+
+    // Server to client is paused by the backlog from client to server
+    configuration.captureLimit=LIMIT;
+    configuration.captureTotal=0;
+    ok&=run("paused by the other direction", configuration, true);
+
+    // Another connection is paused by the backlog under --capture-total
+    configuration.captureLimit=0;
+    configuration.captureTotal=LIMIT;
+    ok&=run("paused by another connection", configuration, false);
+
+    return ok?0:1;
+}
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Placement of threads on CPUs and NUMA nodes
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <string>
+#include "Affinity.hpp"
+#include "../sniffer.hpp"
+
+/** Returns CPUs which the process may use, in ascending order **/
+static std::vector<int> getAllowedCpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set)<0)
+        Error::raise("getting CPU affinity");
+    std::vector<int> result;
+    for (int i=0; i<CPU_SETSIZE; i++)
+        if (CPU_ISSET(i, &set))
+            result.push_back(i);
+    return result;
+}
+
+/** Parse list like "0-3,8-11" from sysfs into set, returns false on error **/
+static bool readCpuList(const std::string &path, cpu_set_t &set) {
+    FILE * file=fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+    char line[4096];
+    bool ok=fgets(line, sizeof(line), file)!=nullptr;
+    fclose(file);
+    CPU_ZERO(&set);
+    for (char * p=line; ok&&*p&&*p!='\n';) {
+        char * end;
+        long first=strtol(p, &end, 10), last=first;
+        if (end==p)
+            return false;
+        if (*end=='-')
+            last=strtol(end+1, &end, 10);
+        for (long i=first; i<=last&&i<CPU_SETSIZE; i++)
+            CPU_SET(i, &set);
+        p=*end==','?end+1:end;
+    }
+    return ok;
+}
+
+std::vector<cpu_set_t> placeShards(unsigned count, Pinning pinning) {
+    cpu_set_t empty;
+    CPU_ZERO(&empty);
+    std::vector<cpu_set_t> result(count, empty);
+    if (pinning==PIN_NONE)
+        return result;
+    
+    std::vector<int> cpus=getAllowedCpus();
+    if (pinning==PIN_NUMA) {
+        cpu_set_t allowed, node;
+        CPU_ZERO(&allowed);
+        for (int cpu : cpus)
+            CPU_SET(cpu, &allowed);
+        std::vector<cpu_set_t> nodes;
+        for (unsigned i=0; readCpuList("/sys/devices/system/node/node"+
+                std::to_string(i)+"/cpulist", node); i++) {
+            // Nodes without CPUs allowed to the process are skipped
+            CPU_AND(&node, &node, &allowed);
+            if (CPU_COUNT(&node)>0)
+                nodes.push_back(node);
+        }
+        if (!nodes.empty()) {
+            for (unsigned i=0; i<count; i++)
+                result[i]=nodes[i%nodes.size()];
+            return result;
+        }
+        // No NUMA information, fall back to CPU blocks
+    }
+    
+    for (unsigned i=0; i<count; i++) {
+        // More shards than CPUs share them round robin
+        size_t first=size_t(i)*cpus.size()/count, last=size_t(i+1)*cpus.size()/count;
+        if (last==first)
+            last=first+1;
+        for (size_t j=first; j<last; j++)
+            CPU_SET(cpus[j%cpus.size()], &result[i]);
+    }
+    return result;
+}
+
+void pinThread(const cpu_set_t &cpus) {
+    if (CPU_COUNT(&cpus)==0)
+        return;
+    int error=pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error)
+        throw Error("setting CPU affinity", error);
+}
+
+unsigned getCpuCount() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set)<0)
+        return 1;
+    return unsigned(CPU_COUNT(&set));
+}
@@ -0,0 +1,33 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Placement of threads on CPUs and NUMA nodes
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_AFFINITY_HPP
+#define __UTILS_AFFINITY_HPP
+
+#include <sched.h>
+#include <vector>
+
+/** How threads of shards are bound to CPUs **/
+enum Pinning {
+    /** Threads run anywhere **/
+    PIN_NONE,
+    /** Allowed CPUs are split into consecutive blocks, one per shard **/
+    PIN_CPU,
+    /** Shards are bound to NUMA nodes in turn (memory is allocated on the
+        node of the thread which touches it first) **/
+    PIN_NUMA
+};
+
+/** Returns CPU sets for count shards (empty sets mean no pinning) **/
+std::vector<cpu_set_t> placeShards(unsigned count, Pinning pinning);
+/** Bind the calling thread (and threads it creates later) to CPUs, nothing
+    is done for an empty set **/
+void pinThread(const cpu_set_t &cpus);
+/** Returns number of CPUs the calling thread may run on **/
+unsigned getCpuCount();
+
+#endif
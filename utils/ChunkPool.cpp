@@ -0,0 +1,110 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Pool of fixed-size reference counted memory chunks
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include "ChunkPool.hpp"
+
+static_assert(sizeof(Chunk)==Chunk::SIZE, "chunk header is too large");
+
+/** Number of chunks allocated from the system at once **/
+static const size_t SLAB_CHUNKS=64;
+/** Number of chunks moved between thread cache and the global list at once **/
+static const size_t BATCH=32;
+
+/** Global free list **/
+static struct {
+    std::mutex mutex;
+    Chunk * head;
+    std::atomic<size_t> reserved;
+} global;
+
+/** Per-thread cache of free chunks, avoids taking the lock on every call **/
+struct ChunkCache {
+    ChunkCache() : head(nullptr), count(0) {}
+    ~ChunkCache() {
+        while (head) {
+            Chunk * chunk=head;
+            head=chunk->nextFree;
+            std::lock_guard<std::mutex> lock(global.mutex);
+            chunk->nextFree=global.head;
+            global.head=chunk;
+        }
+    }
+    Chunk * head;
+    size_t count;
+};
+
+static thread_local ChunkCache cache;
+
+/** Allocate a new slab and put it into the thread cache **/
+static void grow() {
+    void * slab=mmap(nullptr, SLAB_CHUNKS*Chunk::SIZE, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (slab==MAP_FAILED)
+        throw std::bad_alloc();
+    Chunk * chunks=static_cast<Chunk *>(slab);
+    for (size_t i=0; i<SLAB_CHUNKS; i++) {
+        Chunk * chunk=new(chunks+i) Chunk;
+        chunk->nextFree=cache.head;
+        cache.head=chunk;
+    }
+    cache.count+=SLAB_CHUNKS;
+    global.reserved+=SLAB_CHUNKS*Chunk::SIZE;
+}
+
+Chunk * ChunkPool::allocate() {
+    if (!cache.head) {
+        std::unique_lock<std::mutex> lock(global.mutex);
+        while (global.head&&cache.count<BATCH) {
+            Chunk * chunk=global.head;
+            global.head=chunk->nextFree;
+            chunk->nextFree=cache.head;
+            cache.head=chunk;
+            cache.count++;
+        }
+        lock.unlock();
+        if (!cache.head)
+            grow();
+    }
+    
+    Chunk * chunk=cache.head;
+    cache.head=chunk->nextFree;
+    cache.count--;
+    chunk->references.store(1, std::memory_order_relaxed);
+    chunk->filled.store(0, std::memory_order_relaxed);
+    chunk->stamp.store(0, std::memory_order_relaxed);
+    chunk->next.store(nullptr, std::memory_order_relaxed);
+    chunk->nextFree=nullptr;
+    return chunk;
+}
+
+void ChunkPool::recycle(Chunk * chunk) {
+    chunk->nextFree=cache.head;
+    cache.head=chunk;
+    if (++cache.count>=2*BATCH) {
+        // Return a batch to threads which allocate more than they free
+        Chunk * first=cache.head, * last=first;
+        for (size_t i=1; i<BATCH; i++)
+            last=last->nextFree;
+        cache.head=last->nextFree;
+        cache.count-=BATCH;
+        std::lock_guard<std::mutex> lock(global.mutex);
+        last->nextFree=global.head;
+        global.head=first;
+    }
+}
+
+size_t ChunkPool::getReservedBytes() {
+    return global.reserved;
+}
+
+void Chunk::release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel)==1)
+        ChunkPool::recycle(this);
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Pool of fixed-size reference counted memory chunks
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_CHUNKPOOL_HPP
+#define __UTILS_CHUNKPOOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Fixed-size block of capture memory **/
+struct Chunk {
+    /** Total size of chunk including header **/
+    static const size_t SIZE=16384;
+    /** Size of chunk header **/
+    static const size_t HEADER=64;
+    /** Number of payload bytes in chunk **/
+    static const size_t CAPACITY=SIZE-HEADER;
+
+    /** Number of owners, chunk returns to the pool when it drops to zero **/
+    std::atomic<unsigned> references;
+    /** Number of payload bytes published by the producer **/
+    std::atomic<size_t> filled;
+    /** Next chunk in a chain **/
+    std::atomic<Chunk *> next;
+    /** Next chunk in the free list of the pool **/
+    Chunk * nextFree;
+    /** When the last payload bytes arrived (Latency::now(), 0 if unknown) **/
+    std::atomic<uint64_t> stamp;
+    /** Payload **/
+    alignas(HEADER) uint8_t data[CAPACITY];
+
+    /** Take one more reference **/
+    void retain() { references.fetch_add(1, std::memory_order_relaxed); }
+    /** Drop a reference, return chunk to the pool after the last one **/
+    void release();
+};
+
+/** Global pool of chunks (memory is never given back to the allocator) **/
+class ChunkPool {
+public:
+    /** Take a chunk with one reference **/
+    static Chunk * allocate();
+    /** Put an unreferenced chunk back **/
+    static void recycle(Chunk * chunk);
+    /** Returns number of bytes currently allocated by the pool **/
+    static size_t getReservedBytes();
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Single-producer single-consumer byte stream made of pooled chunks
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstring>
+#include "ChunkQueue.hpp"
+
+ChunkQueue::~ChunkQueue() {
+    Chunk * chunk=head?head:first.load(std::memory_order_acquire);
+    while (chunk) {
+        Chunk * next=chunk->next.load(std::memory_order_acquire);
+        chunk->release();
+        chunk=next;
+    }
+    if (tail)
+        tail->release();
+}
+
+uint8_t * ChunkQueue::reserve(size_t &length, size_t minimum) {
+    size_t filled=tail?tail->filled.load(std::memory_order_relaxed):0;
+    if (!tail||Chunk::CAPACITY-filled<minimum) {
+        // Chain a fresh chunk, the queue and the producer own one reference each
+        Chunk * chunk=ChunkPool::allocate();
+        chunk->retain();
+        if (tail) {
+            tail->next.store(chunk, std::memory_order_release);
+            tail->release();
+        }
+        else
+            first.store(chunk, std::memory_order_release);
+        tail=chunk;
+        filled=0;
+    }
+    length=Chunk::CAPACITY-filled;
+    return tail->data+filled;
+}
+
+size_t ChunkQueue::peek(const uint8_t *&data) {
+    if (!head) {
+        head=first.load(std::memory_order_acquire);
+        if (!head)
+            return 0;
+    }
+    while (true) {
+        size_t filled=head->filled.load(std::memory_order_acquire);
+        if (offset<filled) {
+            data=head->data+offset;
+            return filled-offset;
+        }
+        
+        // The producer seals a chunk before linking the next one
+        Chunk * next=head->next.load(std::memory_order_acquire);
+        if (!next)
+            return 0;
+        if (offset<head->filled.load(std::memory_order_acquire))
+            continue;
+        head->release();
+        head=next;
+        offset=0;
+    }
+}
+
+size_t ChunkQueue::read(void * buffer, size_t length) {
+    uint8_t * byteBuffer=static_cast<uint8_t *>(buffer);
+    size_t result=0;
+    while (result<length) {
+        const uint8_t * data;
+        size_t available=peek(data);
+        if (!available)
+            break;
+        if (available>length-result)
+            available=length-result;
+        memcpy(byteBuffer+result, data, available);
+        consume(available);
+        result+=available;
+    }
+    return result;
+}
+
+size_t ChunkQueue::gather(struct iovec * iov, size_t count) {
+    const uint8_t * data;
+    size_t length=count?peek(data):0;
+    if (!length)
+        return 0;
+    iov[0].iov_base=const_cast<uint8_t *>(data);
+    iov[0].iov_len=length;
+    size_t result=1;
+    for (Chunk * chunk=head->next.load(std::memory_order_acquire);
+            chunk&&result<count; chunk=chunk->next.load(std::memory_order_acquire)) {
+        size_t filled=chunk->filled.load(std::memory_order_acquire);
+        if (!filled)
+            break;
+        iov[result].iov_base=chunk->data;
+        iov[result].iov_len=filled;
+        result++;
+    }
+    return result;
+}
+
+void ChunkQueue::skip(size_t length) {
+    while (length) {
+        const uint8_t * data;
+        size_t available=peek(data);
+        if (!available)
+            break;
+        if (available>length)
+            available=length;
+        consume(available);
+        length-=available;
+    }
+}
@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Single-producer single-consumer byte stream made of pooled chunks
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_CHUNKQUEUE_HPP
+#define __UTILS_CHUNKQUEUE_HPP
+
+#include <sys/uio.h>
+#include "ChunkPool.hpp"
+
+/** Lock-free byte stream between one producer and one consumer thread **/
+class ChunkQueue {
+public:
+    /** Create an empty queue (no memory is taken until the first write) **/
+    ChunkQueue() : first(nullptr), head(nullptr), offset(0), tail(nullptr) {}
+    /** Return all chunks to the pool **/
+    ~ChunkQueue();
+    
+    /** [producer] Returns free space at the tail, at least minimum bytes **/
+    uint8_t * reserve(size_t &length, size_t minimum=1024);
+    /** [producer] Publish bytes written to the reserved space **/
+    void commit(size_t length) {
+        tail->filled.store(tail->filled.load(std::memory_order_relaxed)+length,
+            std::memory_order_release);
+    }
+    /** [producer] Publish bytes which arrived at the given time **/
+    void commit(size_t length, uint64_t stamp) {
+        tail->stamp.store(stamp, std::memory_order_relaxed);
+        commit(length);
+    }
+    
+    /** [consumer] Returns contiguous readable bytes at the head **/
+    size_t peek(const uint8_t *&data);
+    /** [consumer] Returns arrival time of the newest bytes in the chunk of
+        the last peek() (0 if unknown) **/
+    uint64_t getStamp() const { return head?head->stamp.load(std::memory_order_relaxed):0; }
+    /** [consumer] Drop bytes returned by peek() **/
+    void consume(size_t length) { offset+=length; }
+    /** [consumer] Copy up to length bytes to buffer **/
+    size_t read(void * buffer, size_t length);
+    /** [consumer] Describe readable bytes with up to count I/O vectors
+        (nothing is consumed), returns number of vectors filled **/
+    size_t gather(struct iovec * iov, size_t count);
+    /** [consumer] Drop length bytes, which may span several chunks **/
+    void skip(size_t length);
+    
+private:
+    ChunkQueue(const ChunkQueue &)=delete;
+    ChunkQueue &operator =(const ChunkQueue &)=delete;
+    
+    /** First chunk, published once by the producer **/
+    std::atomic<Chunk *> first;
+    /** Consumer position **/
+    Chunk * head;
+    size_t offset;
+    /** Producer position (holds its own reference) **/
+    Chunk * tail;
+};
+
+#endif
@@ -0,0 +1,65 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Stackful coroutines
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstdint>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "Coroutine.hpp"
+#include "../sniffer.hpp"
+
+/** Coroutine running on this thread **/
+static thread_local Coroutine * running=nullptr;
+
+Coroutine::Coroutine(size_t stackSize) : stack(nullptr), stackSize(stackSize),
+        finished(false) {
+    // One inaccessible page below the stack turns an overflow into a crash
+    size_t page=sysconf(_SC_PAGESIZE);
+    stack=mmap(nullptr, stackSize+page, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+    if (stack==MAP_FAILED)
+        Error::raise("allocating coroutine stack");
+    mprotect(stack, page, PROT_NONE);
+    
+    if (getcontext(&context)<0)
+        Error::raise("getcontext()");
+    context.uc_stack.ss_sp=static_cast<char *>(stack)+page;
+    context.uc_stack.ss_size=stackSize;
+    context.uc_link=&caller;
+    uintptr_t self=reinterpret_cast<uintptr_t>(this);
+    makecontext(&context, reinterpret_cast<void (*)()>(&Coroutine::trampoline), 2,
+        unsigned(self>>32), unsigned(self));
+}
+
+Coroutine::~Coroutine() {
+    munmap(stack, stackSize+sysconf(_SC_PAGESIZE));
+}
+
+bool Coroutine::resume() {
+    if (finished)
+        return false;
+    Coroutine * previous=running;
+    running=this;
+    swapcontext(&caller, &context);
+    running=previous;
+    return !finished;
+}
+
+void Coroutine::yield() {
+    // The caller context is saved by the resume() which runs us right now
+    swapcontext(&context, &caller);
+}
+
+Coroutine * Coroutine::current() {
+    return running;
+}
+
+void Coroutine::trampoline(unsigned high, unsigned low) {
+    Coroutine * self=reinterpret_cast<Coroutine *>((uintptr_t(high)<<32)|low);
+    self->run();
+    self->finished=true;
+    // Returning switches to uc_link, i.e. to the latest caller
+}
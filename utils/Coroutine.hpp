@@ -0,0 +1,50 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Stackful coroutines
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_COROUTINE_HPP
+#define __UTILS_COROUTINE_HPP
+
+#include <cstddef>
+#include <ucontext.h>
+
+/** Function with its own stack which can be suspended and resumed later,
+    possibly on another thread **/
+class Coroutine {
+public:
+    /** Default stack size (memory is committed lazily) **/
+    static const size_t STACK_SIZE=256*1024;
+    /** Create a suspended coroutine **/
+    explicit Coroutine(size_t stackSize=STACK_SIZE);
+    /** Free the stack (the coroutine must not be running) **/
+    virtual ~Coroutine();
+    /** Run until the coroutine yields or returns, returns whether it can be
+        resumed again **/
+    bool resume();
+    /** [inside] Suspend execution and return from resume() **/
+    void yield();
+    /** Returns whether run() has returned **/
+    bool isFinished() const { return finished; }
+    /** Returns the coroutine running on the calling thread or nullptr **/
+    static Coroutine * current();
+    
+protected:
+    /** Coroutine body, must not throw **/
+    virtual void run()=0;
+    
+private:
+    Coroutine(const Coroutine &)=delete;
+    Coroutine &operator =(const Coroutine &)=delete;
+    static void trampoline(unsigned high, unsigned low);
+    
+    ucontext_t context;
+    ucontext_t caller;
+    void * stack;
+    size_t stackSize;
+    bool finished;
+};
+
+#endif
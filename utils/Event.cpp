@@ -0,0 +1,41 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Futex-based wakeup primitive
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "Event.hpp"
+
+static_assert(sizeof(std::atomic<int>)==sizeof(int), "futex must be an int");
+
+static long futex(std::atomic<int> * address, int operation, int value,
+        const struct timespec * timeout=nullptr) {
+    return syscall(SYS_futex, reinterpret_cast<int *>(address), operation,
+        value, timeout, nullptr, 0);
+}
+
+void Event::wait(int ticket) {
+    waiters.fetch_add(1);
+    // Returns immediately if the sequence was changed after prepare()
+    futex(&sequence, FUTEX_WAIT_PRIVATE, ticket);
+    waiters.fetch_sub(1);
+}
+
+void Event::wait(int ticket, unsigned timeout) {
+    struct timespec relative;
+    relative.tv_sec=timeout/1000;
+    relative.tv_nsec=long(timeout%1000)*1000000;
+    waiters.fetch_add(1);
+    futex(&sequence, FUTEX_WAIT_PRIVATE, ticket, &relative);
+    waiters.fetch_sub(1);
+}
+
+void Event::wake(bool one) {
+    futex(&sequence, FUTEX_WAKE_PRIVATE, one?1:INT_MAX);
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Futex-based wakeup primitive
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_EVENT_HPP
+#define __UTILS_EVENT_HPP
+
+#include <atomic>
+
+/** Sleep/wakeup primitive which does not take a lock on either side **/
+class Event {
+public:
+    Event() : sequence(0), waiters(0) {}
+    /** Returns a ticket which should be passed to wait() **/
+    int prepare() const { return sequence.load(); }
+    /** Sleep unless notify() was called after prepare() returned ticket **/
+    void wait(int ticket);
+    /** Same as wait(), but gives up after timeout in milliseconds **/
+    void wait(int ticket, unsigned timeout);
+    /** Wake up all waiting threads (cheap when nobody is waiting) **/
+    void notify() {
+        sequence.fetch_add(1);
+        if (waiters.load())
+            wake(false);
+    }
+    /** Wake up one waiting thread **/
+    void notifyOne() {
+        sequence.fetch_add(1);
+        if (waiters.load())
+            wake(true);
+    }
+    
+private:
+    std::atomic<int> sequence;
+    std::atomic<int> waiters;
+    void wake(bool one);
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Fast formatter of hex dumps
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cstring>
+#include "HexDump.hpp"
+
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#define HEXDUMP_X86
+#endif
+
+/** Width of hex part of a line **/
+static const size_t HEX_WIDTH=50;
+/** Length of a line with 16 bytes **/
+static const size_t LINE_LENGTH=HEX_WIDTH+16+1;
+
+/** Lookup tables of the scalar formatter **/
+static const struct Tables {
+    Tables() {
+        static const char DIGITS[]="0123456789abcdef";
+        for (unsigned i=0; i<256; i++) {
+            hex[i][0]=DIGITS[i>>4];
+            hex[i][1]=DIGITS[i&15];
+            hex[i][2]=hex[i][3]=' ';
+            printable[i]=(i>=32&&i<127)?char(i):'.';
+        }
+    }
+    /** Byte in hex followed by two spaces (the second one is overwritten
+        by the next byte, except at the middle and at the end of a line) **/
+    char hex[256][4];
+    char printable[256];
+} TABLES;
+
+/** Format one line of up to 16 bytes **/
+static char * formatLine(char * output, const uint8_t * data, size_t count) {
+    char * hex=output;
+    for (size_t i=0; i<count; i++) {
+        memcpy(hex, TABLES.hex[data[i]], 4);
+        hex+=i==7?4:3;
+    }
+    memset(hex, ' ', output+HEX_WIDTH-hex);
+    output+=HEX_WIDTH;
+    for (size_t i=0; i<count; i++)
+        *output++=TABLES.printable[data[i]];
+    *output++='\n';
+    return output;
+}
+
+size_t hexDumpLength(size_t length) {
+    return length/16*LINE_LENGTH+HEX_WIDTH+length%16+1;
+}
+
+static char * hexDumpScalar(char * output, const uint8_t * data, size_t length) {
+    for (; length>=16; length-=16, data+=16)
+        output=formatLine(output, data, 16);
+    return formatLine(output, data, length);
+}
+
+#ifdef HEXDUMP_X86
+/*
+ * Full lines are formatted with byte shuffles: nibbles are converted to
+ * digits with a lookup in a register, interleaved to 32 characters of hex
+ * pairs (A for bytes 0-7, B for bytes 8-15) and spread over 48 characters
+ * with spaces in between. Characters 48-49 are always spaces.
+ */
+#define SHUFFLE_TABLES \
+    const char Z=-1; \
+    const char A0[16]={0, 1, Z, 2, 3, Z, 4, 5, Z, 6, 7, Z, 8, 9, Z, 10}; \
+    const char A1[16]={11, Z, 12, 13, Z, 14, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z}; \
+    const char B1[16]={Z, Z, Z, Z, Z, Z, Z, Z, Z, 0, 1, Z, 2, 3, Z, 4}; \
+    const char B2[16]={5, Z, 6, 7, Z, 8, 9, Z, 10, 11, Z, 12, 13, Z, 14, 15}; \
+    const char S0[16]={0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0}; \
+    const char S1[16]={0, 32, 0, 0, 32, 0, 0, 32, 32, 0, 0, 32, 0, 0, 32, 0}; \
+    const char S2[16]={0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0, 32, 0, 0};
+
+__attribute__((target("ssse3")))
+static char * hexDumpSSSE3(char * output, const uint8_t * data, size_t length) {
+    SHUFFLE_TABLES
+    const __m128i digits=_mm_loadu_si128(reinterpret_cast<const __m128i *>("0123456789abcdef"));
+    const __m128i nibble=_mm_set1_epi8(15), dots=_mm_set1_epi8('.');
+    const __m128i a0=_mm_loadu_si128(reinterpret_cast<const __m128i *>(A0));
+    const __m128i a1=_mm_loadu_si128(reinterpret_cast<const __m128i *>(A1));
+    const __m128i b1=_mm_loadu_si128(reinterpret_cast<const __m128i *>(B1));
+    const __m128i b2=_mm_loadu_si128(reinterpret_cast<const __m128i *>(B2));
+    const __m128i s0=_mm_loadu_si128(reinterpret_cast<const __m128i *>(S0));
+    const __m128i s1=_mm_loadu_si128(reinterpret_cast<const __m128i *>(S1));
+    const __m128i s2=_mm_loadu_si128(reinterpret_cast<const __m128i *>(S2));
+
+    for (; length>=16; length-=16, data+=16, output+=LINE_LENGTH) {
+        __m128i bytes=_mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+        __m128i high=_mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i low=_mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+        __m128i a=_mm_unpacklo_epi8(high, low), b=_mm_unpackhi_epi8(high, low);
+        __m128i * line=reinterpret_cast<__m128i *>(output);
+        _mm_storeu_si128(line, _mm_or_si128(_mm_shuffle_epi8(a, a0), s0));
+        _mm_storeu_si128(line+1, _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, a1), _mm_shuffle_epi8(b, b1)), s1));
+        _mm_storeu_si128(line+2, _mm_or_si128(_mm_shuffle_epi8(b, b2), s2));
+        output[48]=output[49]=' ';
+
+        // Printable characters are 32..126 (bytes above 127 are negative)
+        __m128i printable=_mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(31)),
+            _mm_cmplt_epi8(bytes, _mm_set1_epi8(127)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output+HEX_WIDTH),
+            _mm_or_si128(_mm_and_si128(printable, bytes),
+            _mm_andnot_si128(printable, dots)));
+        output[LINE_LENGTH-1]='\n';
+    }
+    return formatLine(output, data, length);
+}
+
+/** Load the same 16 bytes to both lanes **/
+__attribute__((target("avx2")))
+static __m256i broadcast(const char * data) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)));
+}
+
+/** Store lanes of a register at the same offset in two consecutive lines **/
+__attribute__((target("avx2")))
+static void storeLanes(char * output, __m256i value) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output), _mm256_castsi256_si128(value));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(output+LINE_LENGTH),
+        _mm256_extracti128_si256(value, 1));
+}
+
+__attribute__((target("avx2")))
+static char * hexDumpAVX2(char * output, const uint8_t * data, size_t length) {
+    SHUFFLE_TABLES
+    // Shuffles work within 128-bit lanes, so each lane formats its own line
+    const __m256i digits=broadcast("0123456789abcdef");
+    const __m256i nibble=_mm256_set1_epi8(15), dots=_mm256_set1_epi8('.');
+    const __m256i a0=broadcast(A0), a1=broadcast(A1), b1=broadcast(B1),
+        b2=broadcast(B2), s0=broadcast(S0), s1=broadcast(S1), s2=broadcast(S2);
+
+    for (; length>=32; length-=32, data+=32, output+=2*LINE_LENGTH) {
+        __m256i bytes=_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+        __m256i high=_mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        __m256i low=_mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, nibble));
+        __m256i a=_mm256_unpacklo_epi8(high, low), b=_mm256_unpackhi_epi8(high, low);
+        storeLanes(output, _mm256_or_si256(_mm256_shuffle_epi8(a, a0), s0));
+        storeLanes(output+16, _mm256_or_si256(_mm256_or_si256(
+            _mm256_shuffle_epi8(a, a1), _mm256_shuffle_epi8(b, b1)), s1));
+        storeLanes(output+32, _mm256_or_si256(_mm256_shuffle_epi8(b, b2), s2));
+        output[48]=output[49]=output[LINE_LENGTH+48]=output[LINE_LENGTH+49]=' ';
+
+        __m256i printable=_mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(31)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(127), bytes));
+        storeLanes(output+HEX_WIDTH, _mm256_or_si256(_mm256_and_si256(printable, bytes),
+            _mm256_andnot_si256(printable, dots)));
+        output[LINE_LENGTH-1]=output[2*LINE_LENGTH-1]='\n';
+    }
+    return hexDumpSSSE3(output, data, length);
+}
+#endif
+
+HexDumpFunction getHexDumpFunction(const char * name) {
+    if (!strcmp(name, "scalar"))
+        return hexDumpScalar;
+#ifdef HEXDUMP_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "ssse3")&&__builtin_cpu_supports("ssse3"))
+        return hexDumpSSSE3;
+    if (!strcmp(name, "avx2")&&__builtin_cpu_supports("avx2"))
+        return hexDumpAVX2;
+#endif
+    return nullptr;
+}
+
+/** Returns the fastest supported implementation **/
+static HexDumpFunction getBestFunction() {
+    // AVX2 is not faster than SSSE3 (output stores dominate, see
+    // bench/hexdump), so it is used only on request
+    static const char * const NAMES[]={"ssse3"};
+    for (auto name : NAMES)
+        if (HexDumpFunction function=getHexDumpFunction(name))
+            return function;
+    return hexDumpScalar;
+}
+
+char * hexDump(char * output, const uint8_t * data, size_t length) {
+    static const HexDumpFunction best=getBestFunction();
+    return best(output, data, length);
+}
@@ -0,0 +1,30 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Fast formatter of hex dumps
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_HEXDUMP_HPP
+#define __UTILS_HEXDUMP_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/** Formatter of a hex dump, returns the end of written text **/
+typedef char * (* HexDumpFunction)(char * output, const uint8_t * data, size_t length);
+
+/** Returns number of characters in hex dump of length bytes **/
+size_t hexDumpLength(size_t length);
+
+/** Write hex dump to output (which must hold hexDumpLength(length) bytes).
+    Every line has 16 bytes in hex, padded to 50 characters and followed by
+    their printable characters. The last line has the remaining 0 to 15
+    bytes. Uses the fastest implementation supported by the CPU. **/
+char * hexDump(char * output, const uint8_t * data, size_t length);
+
+/** Returns implementation for "scalar", "ssse3" or "avx2" instruction set,
+    or null if it is not supported by the CPU **/
+HexDumpFunction getHexDumpFunction(const char * name);
+
+#endif
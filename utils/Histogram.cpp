@@ -0,0 +1,58 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Log-linear histogram of latencies
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cmath>
+#include "Histogram.hpp"
+
+void Histogram::add(const Histogram &other) {
+    for (size_t i=0; i<BUCKETS; i++)
+        increment(counts[i], other.counts[i].load(std::memory_order_relaxed));
+    increment(sum, other.getSum());
+    if (other.getMax()>getMax())
+        max.store(other.getMax(), std::memory_order_relaxed);
+}
+
+void Histogram::clear() {
+    for (size_t i=0; i<BUCKETS; i++)
+        counts[i].store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::getCount() const {
+    uint64_t result=0;
+    for (size_t i=0; i<BUCKETS; i++)
+        result+=counts[i].load(std::memory_order_relaxed);
+    return result;
+}
+
+uint64_t Histogram::getPercentile(double fraction) const {
+    uint64_t count=getCount();
+    if (count==0)
+        return 0;
+    uint64_t rank=uint64_t(std::ceil(fraction*double(count)));
+    if (rank==0)
+        rank=1;
+    uint64_t seen=0;
+    for (size_t i=0; i<BUCKETS; i++) {
+        seen+=counts[i].load(std::memory_order_relaxed);
+        if (seen>=rank)
+            // The middle of a bucket may lie above the largest value
+            return std::min(value(i), getMax());
+    }
+    return getMax();
+}
+
+uint64_t Histogram::value(size_t index) {
+    if (index<SUB)
+        return index;
+    size_t offset=index-SUB;
+    unsigned shift=unsigned(offset/(SUB/2))+1;
+    uint64_t lowest=uint64_t(SUB/2+offset%(SUB/2))<<shift;
+    return lowest+(uint64_t(1)<<shift)/2;
+}
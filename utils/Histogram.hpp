@@ -0,0 +1,76 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Log-linear histogram of latencies
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_HISTOGRAM_HPP
+#define __UTILS_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Histogram with buckets in the manner of HdrHistogram: values below SUB are
+    counted exactly, larger ones with relative error below 1/SUB. Values
+    beyond 2^MAX_BITS are counted in the last bucket. Only one thread may
+    record, any thread may read. **/
+class Histogram {
+public:
+    /** Bits of precision **/
+    static const unsigned SUB_BITS=6;
+    static const unsigned SUB=1<<SUB_BITS;
+    /** Bits of the largest value **/
+    static const unsigned MAX_BITS=40;
+    static const size_t BUCKETS=SUB+(MAX_BITS-SUB_BITS)*(SUB/2);
+    
+    Histogram() { clear(); }
+    /** [writer] Count value **/
+    void record(uint64_t value) {
+        increment(counts[index(value)], 1);
+        increment(sum, value);
+        if (value>max.load(std::memory_order_relaxed))
+            max.store(value, std::memory_order_relaxed);
+    }
+    /** [writer] Add counts of other histogram **/
+    void add(const Histogram &other);
+    /** [writer] Forget all values **/
+    void clear();
+    /** Returns number of values **/
+    uint64_t getCount() const;
+    /** Returns sum of values **/
+    uint64_t getSum() const { return sum.load(std::memory_order_relaxed); }
+    /** Returns the largest value **/
+    uint64_t getMax() const { return max.load(std::memory_order_relaxed); }
+    /** Returns value below which the given fraction of values lie (0 if
+        the histogram is empty) **/
+    uint64_t getPercentile(double fraction) const;
+    
+private:
+    Histogram(const Histogram &)=delete;
+    Histogram &operator =(const Histogram &)=delete;
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    
+    /** Increment without a locked instruction (single writer) **/
+    static void increment(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed)+value,
+            std::memory_order_relaxed);
+    }
+    /** Returns bucket of value **/
+    static size_t index(uint64_t value) {
+        if (value<SUB)
+            return size_t(value);
+        if (value>>MAX_BITS)
+            return BUCKETS-1;
+        // The top SUB_BITS bits of value select the bucket
+        unsigned shift=63-__builtin_clzll(value)-(SUB_BITS-1);
+        return SUB+(shift-1)*(SUB/2)+size_t((value>>shift)-SUB/2);
+    }
+    /** Returns value in the middle of bucket **/
+    static uint64_t value(size_t index);
+};
+
+#endif
@@ -40,7 +40,7 @@ size_t InflateReader::read(void * buffer, size_t length) {
     while ((stream.avail_out>0)&&!atEnd) {
         //cerr << "loop\n";
         if (stream.avail_in==0) {
-            size_t nRead=in.read(&internalBuffer[0], internalBuffer.size());
+            size_t nRead=in.readSome(&internalBuffer[0], internalBuffer.size());
             if (nRead==0) {
                 fprintf(stderr, "[.] FUCK: zero occurred\n");
                 throw End();
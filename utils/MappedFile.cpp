@@ -0,0 +1,65 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Append-only file written through a memory mapping
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../sniffer.hpp"
+#include "MappedFile.hpp"
+
+/** Length of the mapped window and the preallocation step **/
+static const off_t WINDOW=32<<20;
+
+MappedFile::MappedFile(int fd) : fd(fd), window(nullptr), windowOffset(0) {
+    struct stat st;
+    if (fstat(fd, &st)<0)
+        Error::raise("getting size of output file");
+    size=allocated=st.st_size;
+    remap();
+}
+
+MappedFile::~MappedFile() {
+    if (window)
+        munmap(window, WINDOW);
+    if (ftruncate(fd, size)<0) {
+        // Nothing to do, the tail is filled with zeroes anyway
+    }
+}
+
+uint8_t * MappedFile::reserve(size_t length) {
+    if (length>MAX_BLOCK)
+        throw Error("writing output file", EMSGSIZE);
+    if (size+off_t(length)>windowOffset+WINDOW)
+        remap();
+    return window+(size-windowOffset);
+}
+
+void MappedFile::remap() {
+    off_t offset=size&~off_t(sysconf(_SC_PAGESIZE)-1);
+    if (offset+WINDOW>allocated) {
+        // Allocate blocks now, so a full disk does not end up with SIGBUS
+        int error=posix_fallocate(fd, allocated, offset+WINDOW-allocated);
+        if (error==EOPNOTSUPP||error==EINVAL) {
+            if (ftruncate(fd, offset+WINDOW)<0)
+                Error::raise("extending output file");
+        }
+        else if (error)
+            throw Error("extending output file", error);
+        allocated=offset+WINDOW;
+    }
+    
+    void * result=mmap(nullptr, WINDOW, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+        offset);
+    if (result==MAP_FAILED)
+        Error::raise("mapping output file");
+    if (window)
+        munmap(window, WINDOW);
+    window=static_cast<uint8_t *>(result);
+    windowOffset=offset;
+}
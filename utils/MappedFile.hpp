@@ -0,0 +1,53 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Append-only file written through a memory mapping
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_MAPPEDFILE_HPP
+#define __UTILS_MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/** Appends blocks to the end of a file by copying them into a mapped window.
+    The file is preallocated ahead of the data and trimmed when closed. Not
+    thread-safe. **/
+class MappedFile {
+public:
+    /** Largest block which may be reserved at once **/
+    static const size_t MAX_BLOCK=1<<20;
+    
+    /** Start appending to descriptor (which must be open for reading and
+        writing, and is not closed by the object) **/
+    explicit MappedFile(int fd);
+    /** Unmap the file and cut off the preallocated tail **/
+    ~MappedFile();
+    /** Returns space for the next block (valid until commit() is called) **/
+    uint8_t * reserve(size_t length);
+    /** Append length bytes written to the reserved space **/
+    void commit(size_t length) { size+=length; }
+    /** Returns the size of the file **/
+    off_t getSize() const { return size; }
+    
+private:
+    MappedFile(const MappedFile &)=delete;
+    MappedFile &operator =(const MappedFile &)=delete;
+    
+    int fd;
+    /** Mapped window of the file **/
+    uint8_t * window;
+    /** Offset of the window in the file **/
+    off_t windowOffset;
+    /** End of data **/
+    off_t size;
+    /** Length of the file including preallocated space **/
+    off_t allocated;
+    
+    /** Map the window which starts near the end of data **/
+    void remap();
+};
+
+#endif
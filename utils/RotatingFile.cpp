@@ -0,0 +1,186 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Output file split into segments which are compressed in background
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "../sniffer.hpp"
+#include "RotatingFile.hpp"
+
+using std::string;
+
+static bool endsWith(const string &string, const char * suffix) {
+    size_t length=strlen(suffix);
+    return string.length()>=length&&!string.compare(string.length()-length, length, suffix);
+}
+
+static off_t getSize(const string &name) {
+    struct stat st;
+    return stat(name.c_str(), &st)<0?0:st.st_size;
+}
+
+RotatingFile::RotatingFile(const char * path, int mode, bool append,
+        const RotationPolicy &policy) : path(path), mode(mode), policy(policy),
+        fd(-1), opened(time(nullptr)), alive(true) {
+    fd=open(path, append);
+    scan();
+    compressor=std::thread(&RotatingFile::compressorFunc, this);
+}
+
+RotatingFile::~RotatingFile() {
+    alive=false;
+    closed.notify();
+    compressor.join();
+    ::close(fd);
+}
+
+bool RotatingFile::isDue(off_t size) const {
+    // An empty segment is kept, or idle intervals would push segments with
+    // data out of retention
+    if (!size)
+        return false;
+    if (policy.size&&size>=policy.size)
+        return true;
+    return policy.interval&&time(nullptr)-opened>=time_t(policy.interval);
+}
+
+int RotatingFile::rotate() {
+    time_t now=time(nullptr);
+    struct tm local;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+    // Several segments may be closed within a second, numbers keep them sorted
+    string name;
+    for (unsigned i=0; name.empty()||access(name.c_str(), F_OK)==0||
+            access((name+".gz").c_str(), F_OK)==0; i++) {
+        char number[8];
+        snprintf(number, sizeof(number), "-%03u", i);
+        name=path+"."+stamp+number;
+    }
+
+    // Prepare the new segment first, so the path always refers to a file
+    string temporary=path+".new";
+    int next=open(temporary.c_str(), false);
+    if (rename(path.c_str(), name.c_str())<0||rename(temporary.c_str(), path.c_str())<0) {
+        int error=errno;
+        ::close(next);
+        unlink(temporary.c_str());
+        throw Error("rotating output file", error);
+    }
+    ::close(fd);
+    fd=next;
+    opened=now;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uncompressed.push_back(name);
+    }
+    closed.notify();
+    return fd;
+}
+
+int RotatingFile::open(const char * name, bool append) {
+    int result=::open(name, mode|O_CREAT|O_CLOEXEC|(append?O_APPEND:O_TRUNC), 0644);
+    if (result<0)
+        Error::raise("opening output file");
+    return result;
+}
+
+void RotatingFile::scan() {
+    size_t slash=path.rfind('/');
+    string directory=slash==string::npos?".":path.substr(0, slash+1);
+    string prefix=(slash==string::npos?path:path.substr(slash+1))+".";
+
+    DIR * dir=opendir(directory.c_str());
+    if (!dir)
+        return;
+    std::deque<string> compressed;
+    while (struct dirent * entry=readdir(dir)) {
+        string name=entry->d_name;
+        if (name.compare(0, prefix.length(), prefix)||name.length()<=prefix.length()||
+                !isdigit(name[prefix.length()])||endsWith(name, ".tmp"))
+            continue;
+        name=slash==string::npos?name:directory+name;
+        (endsWith(name, ".gz")?compressed:uncompressed).push_back(name);
+    }
+    closedir(dir);
+
+    std::sort(compressed.begin(), compressed.end());
+    std::sort(uncompressed.begin(), uncompressed.end());
+    for (auto i=compressed.begin(); i!=compressed.end(); ++i)
+        segments.push_back(Segment {*i, getSize(*i)});
+}
+
+void RotatingFile::compress(const string &name) {
+    string result=name+".gz", temporary=result+".tmp";
+    int input=::open(name.c_str(), O_RDONLY|O_CLOEXEC);
+    gzFile output=input<0?nullptr:gzopen(temporary.c_str(), "wb");
+    bool success=output!=nullptr;
+
+    if (success) {
+        char buffer[1<<16];
+        ssize_t length;
+        while (success&&(length=read(input, buffer, sizeof(buffer)))>0)
+            success=gzwrite(output, buffer, length)==int(length);
+        success=gzclose(output)==Z_OK&&success&&length==0;
+    }
+    if (input>=0)
+        ::close(input);
+
+    if (success&&rename(temporary.c_str(), result.c_str())==0) {
+        unlink(name.c_str());
+        retain(result);
+    }
+    else {
+        std::cerr << "Failed to compress " << name << std::endl;
+        unlink(temporary.c_str());
+        retain(name);
+    }
+}
+
+void RotatingFile::retain(const string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    segments.push_back(Segment {name, getSize(name)});
+
+    off_t total=0;
+    for (auto i=segments.begin(); i!=segments.end(); ++i)
+        total+=i->size;
+    while (!segments.empty()&&((policy.keepSegments&&segments.size()>policy.keepSegments)||
+            (policy.keepBytes&&total>policy.keepBytes))) {
+        unlink(segments.front().name.c_str());
+        total-=segments.front().size;
+        segments.pop_front();
+    }
+}
+
+void RotatingFile::compressorFunc() {
+    while (true) {
+        int ticket=closed.prepare();
+        string name;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!uncompressed.empty()) {
+                name=uncompressed.front();
+                uncompressed.pop_front();
+            }
+        }
+        if (!name.empty())
+            compress(name);
+        else if (alive)
+            closed.wait(ticket);
+        else
+            break;
+    }
+}
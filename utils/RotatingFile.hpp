@@ -0,0 +1,90 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Output file split into segments which are compressed in background
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_ROTATINGFILE_HPP
+#define __UTILS_ROTATINGFILE_HPP
+
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include "Event.hpp"
+
+/** When to start a new segment and how many old segments to keep **/
+struct RotationPolicy {
+    RotationPolicy() : size(0), interval(0), keepSegments(0), keepBytes(0) {}
+    /** Maximum size of a segment in bytes (0 means unlimited) **/
+    off_t size;
+    /** Maximum age of a segment in seconds (0 means unlimited) **/
+    unsigned interval;
+    /** Maximum number of closed segments (0 means unlimited) **/
+    unsigned keepSegments;
+    /** Maximum total size of closed segments (0 means unlimited) **/
+    off_t keepBytes;
+};
+
+/** File at fixed path whose contents are moved away to PATH.YYYYMMDD-HHMMSS-NNN
+    segments. Closed segments are gzipped by a background thread, and the
+    oldest ones are removed according to the retention policy. rotate() is
+    meant to be called by the single thread which writes to the file. **/
+class RotatingFile {
+public:
+    /** Open file with specified access mode (O_WRONLY or O_RDWR) **/
+    RotatingFile(const char * path, int mode, bool append,
+        const RotationPolicy &policy=RotationPolicy());
+    /** Close the file and compress segments which are still waiting **/
+    ~RotatingFile();
+    /** Returns descriptor of the current segment **/
+    int getDescriptor() const { return fd; }
+    /** Returns true if the current segment of specified size should be closed
+        (never if it is empty) **/
+    bool isDue(off_t size) const;
+    /** Close the current segment and open an empty one, returns its descriptor **/
+    int rotate();
+
+private:
+    RotatingFile(const RotatingFile &)=delete;
+    RotatingFile &operator =(const RotatingFile &)=delete;
+
+    /** Closed segment **/
+    struct Segment {
+        std::string name;
+        off_t size;
+    };
+
+    std::string path;
+    int mode;
+    RotationPolicy policy;
+    int fd;
+    /** Time when the current segment was opened **/
+    time_t opened;
+    std::atomic<bool> alive;
+    /** Protects the lists of segments **/
+    std::mutex mutex;
+    /** Segments waiting for compression **/
+    std::deque<std::string> uncompressed;
+    /** Finished segments, oldest first **/
+    std::deque<Segment> segments;
+    /** Notified when a segment was closed **/
+    Event closed;
+    std::thread compressor;
+
+    /** Open a file at the path and replace the current one with it **/
+    int open(const char * name, bool append);
+    /** Add existing segments from previous runs **/
+    void scan();
+    /** Gzip a segment and replace it with the compressed file **/
+    void compress(const std::string &name);
+    /** Add a finished segment and remove the old ones **/
+    void retain(const std::string &name);
+    void compressorFunc();
+};
+
+#endif
@@ -0,0 +1,126 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Hierarchical timer wheel
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <algorithm>
+#include "TimerWheel.hpp"
+
+void TimerWheel::Timer::cancel() {
+    if (prev) {
+        unlink();
+        wheel->count--;
+        wheel=nullptr;
+    }
+}
+
+TimerWheel::TimerWheel(uint64_t now) : current(now), count(0) {
+    for (unsigned level=0; level<LEVELS; level++)
+        for (unsigned i=0; i<SLOTS; i++)
+            slots[level][i].prev=slots[level][i].next=&slots[level][i];
+}
+
+TimerWheel::~TimerWheel() {
+    for (unsigned level=0; level<LEVELS; level++)
+        for (unsigned i=0; i<SLOTS; i++) {
+            Link &head=slots[level][i];
+            while (head.next!=&head)
+                static_cast<Timer *>(head.next)->cancel();
+        }
+}
+
+void TimerWheel::schedule(Timer &timer, uint64_t deadline) {
+    timer.cancel();
+    timer.wheel=this;
+    count++;
+    timer.deadline=deadline<current?current:deadline;
+    insert(timer);
+}
+
+void TimerWheel::insert(Timer &timer) {
+    // Level is chosen by the distance, slot by the bits of the deadline
+    uint64_t delta=timer.deadline-current;
+    unsigned level=0;
+    while (level<LEVELS-1&&delta>=(uint64_t(1)<<(BITS*(level+1))))
+        level++;
+    uint64_t deadline=timer.deadline;
+    if (delta>=(uint64_t(1)<<(BITS*LEVELS)))
+        // Beyond the range, the timer is inserted again when it comes closer
+        deadline=current+(uint64_t(1)<<(BITS*LEVELS))-1;
+    Link &head=slots[level][(deadline>>(BITS*level))&(SLOTS-1)];
+    timer.prev=head.prev;
+    timer.next=&head;
+    head.prev->next=&timer;
+    head.prev=&timer;
+}
+
+void TimerWheel::cascade(unsigned level, unsigned index) {
+    Link &head=slots[level][index];
+    Link list;
+    if (head.next==&head)
+        return;
+    // Detach the whole list, insert() may put timers back to this wheel
+    list.next=head.next;
+    list.prev=head.prev;
+    list.next->prev=list.prev->next=&list;
+    head.prev=head.next=&head;
+    while (list.next!=&list) {
+        Timer * timer=static_cast<Timer *>(list.next);
+        timer->unlink();
+        insert(*timer);
+    }
+}
+
+void TimerWheel::advance(uint64_t now) {
+    while (current<=now) {
+        if (count==0) {
+            current=now+1;
+            break;
+        }
+        unsigned index=unsigned(current&(SLOTS-1));
+        for (unsigned level=1; level<LEVELS&&index==0; level++) {
+            index=unsigned((current>>(BITS*level))&(SLOTS-1));
+            cascade(level, index);
+        }
+        
+        // Timers rescheduled by their handlers go to the following ticks
+        Link &head=slots[0][current&(SLOTS-1)];
+        Link list;
+        current++;
+        if (head.next==&head)
+            continue;
+        list.next=head.next;
+        list.prev=head.prev;
+        list.next->prev=list.prev->next=&list;
+        head.prev=head.next=&head;
+        while (list.next!=&list) {
+            Timer * timer=static_cast<Timer *>(list.next);
+            timer->cancel();
+            timer->expired();
+        }
+    }
+}
+
+uint64_t TimerWheel::getNextExpiry() const {
+    uint64_t result=NEVER;
+    if (count==0)
+        return result;
+    for (unsigned level=0; level<LEVELS; level++) {
+        // Timers of coarse wheels are due when their slot is cascaded, which
+        // happens when the lower digits of the time are zero
+        unsigned shift=BITS*level;
+        uint64_t first=current>>shift;
+        if (current&((uint64_t(1)<<shift)-1))
+            first++;
+        for (uint64_t index=first; index<first+SLOTS; index++) {
+            const Link &head=slots[level][index&(SLOTS-1)];
+            if (head.next!=&head) {
+                result=std::min(result, std::max(index<<shift, current));
+                break;
+            }
+        }
+    }
+    return result;
+}
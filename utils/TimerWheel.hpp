@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Hierarchical timer wheel
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_TIMERWHEEL_HPP
+#define __UTILS_TIMERWHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/** Timers with O(1) scheduling and cancellation. Time is measured in ticks
+    chosen by the user. Each of the LEVELS wheels has SLOTS lists; timers
+    which are far away are moved to finer wheels as time goes on. Not
+    thread-safe. **/
+class TimerWheel {
+    /** Link of doubly linked list **/
+    struct Link {
+        Link() : prev(nullptr), next(nullptr) {}
+        Link * prev, * next;
+        /** Remove from list **/
+        void unlink() {
+            prev->next=next;
+            next->prev=prev;
+            prev=next=nullptr;
+        }
+    };
+    
+public:
+    /** Returned by getNextExpiry() when no timer is scheduled **/
+    static const uint64_t NEVER=~uint64_t(0);
+    
+    /** Intrusive timer, must not be destroyed while it fires **/
+    class Timer : private Link {
+    public:
+        Timer() : wheel(nullptr), deadline(0) {}
+        virtual ~Timer() { cancel(); }
+        /** Returns whether the timer is waiting in a wheel **/
+        bool isScheduled() const { return prev!=nullptr; }
+        /** Returns tick when the timer fires **/
+        uint64_t getDeadline() const { return deadline; }
+        /** Remove timer from its wheel **/
+        void cancel();
+        
+    protected:
+        /** Called when the deadline passes (the timer is not scheduled
+            anymore and may be scheduled again) **/
+        virtual void expired()=0;
+        
+    private:
+        Timer(const Timer &)=delete;
+        Timer &operator =(const Timer &)=delete;
+        TimerWheel * wheel;
+        uint64_t deadline;
+        friend class TimerWheel;
+    };
+    
+    /** Start at specified tick **/
+    explicit TimerWheel(uint64_t now=0);
+    /** Unschedule remaining timers **/
+    ~TimerWheel();
+    /** Returns the next tick which was not processed yet **/
+    uint64_t getTime() const { return current; }
+    /** Returns number of scheduled timers **/
+    size_t size() const { return count; }
+    /** Fire timer at deadline (timers in the past fire on the next tick) **/
+    void schedule(Timer &timer, uint64_t deadline);
+    /** Fire all timers due at or before now **/
+    void advance(uint64_t now);
+    /** Returns tick at which advance() should be called next, which may be
+        earlier than the nearest deadline when timers are in coarse wheels **/
+    uint64_t getNextExpiry() const;
+    
+private:
+    TimerWheel(const TimerWheel &)=delete;
+    TimerWheel &operator =(const TimerWheel &)=delete;
+    static const unsigned BITS=6;
+    static const unsigned SLOTS=1<<BITS;
+    static const unsigned LEVELS=4;
+    
+    /** Next tick to process **/
+    uint64_t current;
+    size_t count;
+    /** List heads (circular lists) **/
+    Link slots[LEVELS][SLOTS];
+    
+    /** Put timer to the list of its deadline **/
+    void insert(Timer &timer);
+    /** Move timers of a slot to finer wheels **/
+    void cascade(unsigned level, unsigned index);
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Wrappers of system calls and socket address helpers
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "Utils.hpp"
+
+namespace posix {
+    int socket(int family, int type, int protocol) {
+        int result=::socket(family, type, protocol);
+        if (result<0)
+            Error::raise("creating socket");
+        return result;
+    }
+    
+    int accept(int socket, struct sockaddr * addr, socklen_t * len) {
+        int result=::accept4(socket, addr, len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (result<0)
+            Error::raise("accepting a connection");
+        return result;
+    }
+    
+    void bind(int socket, const struct sockaddr * addr, socklen_t len) {
+        if (::bind(socket, addr, len)<0)
+            Error::raise("binding to port");
+    }
+    
+    void listen(int socket, int backlog) {
+        if (::listen(socket, backlog)<0)
+            Error::raise("listening to port");
+    }
+    
+    int epoll_create() {
+        int retval=::epoll_create1(EPOLL_CLOEXEC);
+        if (retval<0)
+            Error::raise("creating epoll instance");
+        return retval;
+    }
+    
+    void epoll_ctl(int epoll, int op, int fd, uint32_t events, uint64_t data) {
+        struct epoll_event event;
+        event.events=events;
+        event.data.u64=data;
+        if (::epoll_ctl(epoll, op, fd, &event)<0)
+            Error::raise("epoll_ctl()");
+    }
+    
+    int epoll_wait(int epoll, struct epoll_event * events, int count, int timeout) {
+        int retval=::epoll_wait(epoll, events, count, timeout);
+        if (retval<0)
+            Error::raise("epoll_wait()");
+        return retval;
+    }
+    
+    int eventfd() {
+        int retval=::eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (retval<0)
+            Error::raise("creating eventfd");
+        return retval;
+    }
+    
+    ssize_t read(int fd, void * buffer, size_t length) {
+        ssize_t retval=::read(fd, buffer, length);
+        if (retval<0)
+            Error::raise("reading from network");
+        return retval;
+    }
+    
+    ssize_t write(int fd, const void * buffer, size_t length) {
+        ssize_t retval=::write(fd, buffer, length);
+        if (retval<0)
+            Error::raise("writing to network");
+        return retval;
+    }
+    
+    ssize_t recv(int fd, void * buffer, size_t length) {
+        ssize_t retval=::recv(fd, buffer, length, MSG_DONTWAIT);
+        if (retval<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK)
+            Error::raise("reading from network");
+        return retval;
+    }
+}
+
+void unmapAddress(struct sockaddr_storage &address) {
+    const struct sockaddr_in6 in6=reinterpret_cast<const struct sockaddr_in6 &>(address);
+    if (address.ss_family==AF_INET6&&IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr)) {
+        struct sockaddr_in &in=reinterpret_cast<struct sockaddr_in &>(address);
+        in.sin_family=AF_INET;
+        in.sin_port=in6.sin6_port;
+        memcpy(&in.sin_addr, in6.sin6_addr.s6_addr+12, 4);
+    }
+}
@@ -0,0 +1,44 @@
+/*******************************************************************************
+ *  Advanced network sniffer
+ *  Wrappers of system calls and socket address helpers
+ *
+ *  © 2021, Sauron
+ ******************************************************************************/
+
+#ifndef __UTILS_UTILS_HPP
+#define __UTILS_UTILS_HPP
+
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "../sniffer.hpp"
+
+struct epoll_event;
+
+namespace posix {
+    int socket(int family, int type, int protocol);
+    /** Accept connection as a non-blocking socket **/
+    int accept(int socket, struct sockaddr * addr, socklen_t * len);
+    void bind(int socket, const struct sockaddr * addr, socklen_t len);
+    void listen(int socket, int backlog);
+    int epoll_create();
+    void epoll_ctl(int epoll, int op, int fd, uint32_t events, uint64_t data);
+    int epoll_wait(int epoll, struct epoll_event * events, int count, int timeout);
+    /** Non-blocking eventfd **/
+    int eventfd();
+    ssize_t read(int fd, void * buffer, size_t length);
+    ssize_t write(int fd, const void * buffer, size_t length);
+    /** Non-blocking receive, returns -1 if there is no data yet **/
+    ssize_t recv(int fd, void * buffer, size_t length);
+    
+    template <class T>
+    void setsockopt(int socket, int level, int option, T value) {
+        if (::setsockopt(socket, level, option, &value, sizeof(T))<0)
+            Error::raise("setting socket option");
+    }
+}
+
+/** Convert IPv4-mapped IPv6 address (of dual-stack listener) to IPv4 **/
+void unmapAddress(struct sockaddr_storage &address);
+
+#endif